@@ -41,7 +41,9 @@
 
 static uint16_t udp_port = 1884;
 static uint16_t keep_alive = 5;
+// With MQTT_SN_GW_DISCOVERY this is only the fallback when no gateway answers SEARCHGW
 static uint16_t broker_address[] = {0xaaaa, 0, 0, 0, 0, 0, 0, 0x1};
+// static uint16_t standby_gateways[][8] = {{0xaaaa, 0, 0, 0, 0, 0, 0, 0x2}};
 static struct   etimer time_poll;
 // static uint16_t tick_process = 0;
 static char     pub_test[20];
@@ -58,6 +60,7 @@ static char     *topics_mqtt[] = {"/topic_1",
 // This topics will run so much faster than others
 
 mqtt_sn_con_t mqtt_sn_connection;
+static mqtt_sn_client_t mqtt_client;
 
 void mqtt_sn_callback(char *topic, char *message){
   printf("\nMessage received:");
@@ -81,19 +84,22 @@ void init_broker(void){
   //mqtt_sn_connection.will_message  = will_message; // Configure as 0x00 if you don't want to use
   mqtt_sn_connection.will_topic    = 0x00;
   mqtt_sn_connection.will_message  = 0x00;
+  //mqtt_sn_connection.ipv6_gateways = standby_gateways;      // Tried in order when the current gateway stops answering
+  //mqtt_sn_connection.gateways_len  = ss(standby_gateways);
 
-  mqtt_sn_init();   // Inicializa alocação de eventos e a principal PROCESS_THREAD do MQTT-SN
+  mqtt_sn_init(&mqtt_client);   // Inicializa a instância, alocação de eventos e a principal PROCESS_THREAD do MQTT-SN
 
   size_t i;
   for(i=0;i<ss(topics_mqtt);i++)
     all_topics[i] = topics_mqtt[i];
   all_topics[i] = topic_hw;
 
-  mqtt_sn_create_sck(mqtt_sn_connection,
+  mqtt_sn_create_sck(&mqtt_client,
+                     mqtt_sn_connection,
                      all_topics,
                      ss(all_topics),
                      mqtt_sn_callback);
-  mqtt_sn_sub(topic_hw,0);
+  mqtt_sn_sub(&mqtt_client,topic_hw,0);
 }
 
 /*---------------------------------------------------------------------------*/
@@ -113,8 +119,9 @@ PROCESS_THREAD(init_system_process, ev, data) {
   while(1) {
       PROCESS_WAIT_EVENT();
       sprintf(pub_test,"%s",topic_hw);
-      mqtt_sn_pub("/topic_1",pub_test,true,0);
-      // debug_os("State MQTT:%s",mqtt_sn_check_status_string());
+      mqtt_sn_pub(&mqtt_client,"/topic_1",pub_test,true,0,MQTT_SN_PRIO_NORMAL);
+      //mqtt_sn_pub_coalesce(&mqtt_client,"/topic_1",pub_test,true,0,MQTT_SN_PRIO_NORMAL); // Gathers samples into one PUBLISH per MQTT_SN_COALESCE_WINDOW
+      // debug_os("State MQTT:%s",mqtt_sn_check_status_string(&mqtt_client));
       if (etimer_expired(&time_poll))
         etimer_reset(&time_poll);
   }
@@ -23,8 +23,6 @@
  * @date 19 Ago 2016
  * @brief Arquivo principal do código fonte do porte do MQTT-SN para o Contiki
  * @see http://www.aignacio.com
- * @todo Passar para a função de recepção de publicações de callback um ponteiro
-         para o dado e o comprimento ao invés de usar um for
 
  [Apontamento n-1]:
  Descoberta uma característica do contiki, o que ocorre é que se você utiliza
@@ -38,43 +36,68 @@
  compreendesse que o "timer continua expirado".
 
  [Apontamento n-2]:
- Como nesta API utiliza-se malloc necessitamos da função do tipo POSIX chamadas
- "sbrk" a qual utiliza de chamadas de sistema para realizar a operação de aloca
- ção de memória.Logo, devemos incluir no arquivo principal o arquivo syscalls.c
- (arquivo disponibilizado pelo contiki - lib/newlib/syscalls.c) e também  deve-
- mos incluir as variáveis _heap e _eheap no linker script (cc26xx.ld) para a
- função sbrk saber onde começa e termina a zona heap de memória do mcu.
-
- Incluir no linker:
- ...
-   _heap = .;
-   _eheap = ORIGIN(SRAM) + LENGTH(SRAM);
- }
+ A fila de tarefas e os nomes de tópicos recebidos do broker (REGISTER via
+ wildcard) não utilizam mais malloc. As tarefas ficam em um pool estático
+ circular por classe de prioridade (queue), cada um com MAX_QUEUE_MQTT_SN
+ posições e inserção e remoção O(1), e os nomes de tópico em um buffer estático (topic_name_pool) de
+ MQTT_SN_TOPIC_NAME_POOL bytes. Logo, não é mais necessário incluir o arquivo
+ syscalls.c nem declarar _heap/_eheap no linker script para a função sbrk.
+
+ [Apontamento n-3]:
+ Os pacotes enviados são montados direto na área de dados UDP do uip_buf (ver
+ mqtt_sn_tx_buf), a mesma área onde o uIP entrega o pacote recebido. Dentro do
+ parser, todo campo necessário deve ser lido ANTES de qualquer envio, inclusive
+ antes do callback do usuário, que pode publicar.
 */
 
+#ifndef MQTT_SN_POSIX
 #include "contiki.h"
 #include "net/ip/uip.h"
 #include "net/ipv6/uip-ds6.h"
 #include "simple-udp.h"
-#include <stdio.h>
-#include <string.h>
-#include <mqtt_sn.h>
 #include "sys/timer.h"
 #include "list.h"
 #include "sys/ctimer.h"
 #include "sys/etimer.h"
+#include "lib/random.h"
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <mqtt_sn.h>
 #include "stdint.h"
-#include <stdlib.h>
 #include <stdbool.h>
-#include "net/ipv6/uip-ds6.h"
-#if CONTIKI_TARGET_SRF06_CC26XX
-#include "lib/newlib/syscalls.c" //Utilizado quando se usa malloc
+#include <stddef.h>
+#include "mqtt_sn_predefined.h"
+#ifndef UIP_IP_BUF
+#define UIP_IP_BUF ((struct uip_ip_hdr *)&uip_buf[UIP_LLH_LEN])
+#endif
+#if (defined(MQTT_SN_TOPIC_CACHE) || defined(MQTT_SN_OFFLINE_CFS)) && !defined(MQTT_SN_POSIX)
+#include "cfs/cfs.h"
+#endif
+
+#if MAX_QUEUE_MQTT_SN > 255
+#error "MAX_QUEUE_MQTT_SN deve ser menor que 256 (indices da fila em uint8_t)"
+#endif
+
+#if MQTT_SN_OFFLINE_SLOTS < 1 || MQTT_SN_OFFLINE_SLOTS > 255 || MQTT_SN_OFFLINE_PAYLOAD > MQTT_SN_INFLIGHT_PAYLOAD
+#error "MQTT_SN_OFFLINE_SLOTS deve estar entre 1 e 255 e MQTT_SN_OFFLINE_PAYLOAD caber em MQTT_SN_INFLIGHT_PAYLOAD"
+#endif
+
+#if defined(MQTT_SN_TOPIC_CACHE) && !defined(MQTT_SN_PERSISTENT_SESSION)
+#error "MQTT_SN_TOPIC_CACHE requer MQTT_SN_PERSISTENT_SESSION (topic ids valem apenas para a sessao mantida no gateway)"
 #endif
 
-static struct ctimer              mqtt_time_connect;       // Estrutura de temporização para envio de CONNECT
-static struct ctimer              mqtt_time_register;      // Estrutura de temporização para envio de REGISTER
-static struct ctimer              mqtt_time_ping;          // Estrutura de temporização para envio de PING
-static struct ctimer              mqtt_time_subscribe;     // Estrutura de temporização para envio de SUBSCRIBE
+#if MAX_TOPIC_USED > 16384 || MQTT_SN_TOPIC_HASH_SIZE > 32768 || MQTT_SN_TOPIC_HASH_SIZE <= MAX_TOPIC_USED || (MQTT_SN_TOPIC_HASH_SIZE & (MQTT_SN_TOPIC_HASH_SIZE - 1))
+#error "MQTT_SN_TOPIC_HASH_SIZE deve ser potencia de 2 maior que MAX_TOPIC_USED, ate 32768 (max. 16384 topicos)"
+#endif
+
+#define MQTT_SN_TOPIC_POS_DELETED ((mqtt_sn_topic_pos_t)~0) // Entrada removida do índice de topic ids
+
+// Desconectado, o PUBLISH agrupado vai para a fila offline, que por sua vez
+// cabe em MQTT_SN_INFLIGHT_PAYLOAD
+#if MQTT_SN_COALESCE_BUDGET >= MQTT_SN_OFFLINE_PAYLOAD
+#error "MQTT_SN_COALESCE_BUDGET deve caber em MQTT_SN_OFFLINE_PAYLOAD (mais o terminador) para publicacoes retidas offline"
+#endif
 
 static process_event_t            mqtt_event_connect;          // Evento de req CONNECT  [nó --> broker]
 static process_event_t            mqtt_event_connack;          // Evento de req CONNACK  [broker --> nó]
@@ -88,36 +111,328 @@ static process_event_t            mqtt_event_ping_timeout;     // Evento de req.
 static process_event_t            mqtt_event_connected;        // Evento de req. PING REQUEST em excesso de não resposta do broker [broker <-> nó]
 static process_event_t            mqtt_event_will_topicreq;    // Evento de req. WILL TOPIC REQUEST [broker <-> nó]
 static process_event_t            mqtt_event_will_messagereq;  // Evento de req. WILL MESSAGE REQUEST [broker <-> nó]
-
-// Comentado por enquanto já que QoS - 0 não envia PUBACK
-// static process_event_t            mqtt_event_puback;     // Evento de req PUBACK   [broker --> nó]
-static bool                       g_recon = false;                   // Identificador de reconexão evitando dupla conexão UDP aberta
-static bool                       g_will = false;                    // Identificador de utilização de LWT
-static bool                       g_ping_flag_resp = true;           // Identificador de resposta ao PING REQUEST
-static char                       *g_message_bind;                   // Buffer temporário para o envio de mensagens do tipo publicação no caso de tarefas
-static char                       *topic_temp_wildcard;              // Buffer temporário para o armazenamento do buffer de inscrição wildcard
-static uint8_t                    g_tries_send = 0;                  // Identificador de tentativas de envio
-static uint8_t                    g_tries_ping = 0;                  // Identificador de tentativas de envio de PING REQUEST
-static uint8_t                    g_task_id = 0;                     // Identificador unitário de tarefa incremental
-static short_topics_t             g_topic_bind[MAX_TOPIC_USED];      // Vetor que armazena a relação nome do tópico com short topic id
-static mqtt_sn_con_t              g_mqtt_sn_con;                     // Estrutura principal da conexão MQTT
-static mqtt_sn_status_t           mqtt_status = MQTTSN_DISCONNECTED; // ASM principal do MQTT-SN
-static char                       *topics_reconnect[MAX_TOPIC_USED]; // Vetor de tópicos [reconexão]
-static uint16_t                   topics_len;                        // Comprimento total de tópicos fornecidos pelo usuário [reconexão]
-static mqtt_sn_cb_f               callback_mqtt;
+static process_event_t            mqtt_event_asleep;           // Evento de DISCONNECT/PINGRESP que leva o cliente ao estado ASLEEP [broker --> nó]
+// O PUBACK é tratado diretamente no parser (janela de publicações QoS 1),
+// sem gerar evento para a PROCESS_THREAD
+
+// Tabela de tópicos pré-definidos gerada em tempo de compilação a partir de
+// tools/predefined_topics.conf (mesma tabela carregada no gateway), comum a
+// todas as instâncias
+static const struct {
+  const char *topic_name;
+  uint16_t   topic_id;
+} g_predefined_topics[] = { MQTT_SN_PREDEFINED_TOPICS };
 
 PROCESS(mqtt_sn_main, "[MQTT-SN] Processo inicial");
 
 /*********************** FUNÇÕES AUXILIARES MQTT-SN ***************************/
-bool unlock_tasks(void) {
-  if (mqtt_status == MQTTSN_TOPIC_REGISTERED)
+static uint16_t mqtt_sn_topic_hash(const char *topic){
+  uint16_t hash = 5381;
+
+  while (*topic)
+    hash = ((hash << 5) + hash) ^ (uint8_t)*topic++;
+  return hash;
+}
+
+int16_t mqtt_sn_topic_find(mqtt_sn_client_t *client, const char *topic){
+  uint16_t hash, slot;
+  mqtt_sn_topic_pos_t pos;
+
+  if (topic == NULL)
+    return -1;
+
+  hash = mqtt_sn_topic_hash(topic);
+  slot = hash & (MQTT_SN_TOPIC_HASH_SIZE - 1);
+  // Sondagem linear: a tabela é maior que MAX_TOPIC_USED, logo sempre há
+  // uma posição vazia que encerra a busca
+  while ((pos = client->topic_hash[slot]) != 0) {
+    pos--;
+    if (client->topic_bind[pos].hash == hash &&
+        strcmp(client->topic_bind[pos].topic_name, topic) == 0)
+      return pos;
+    slot = (slot + 1) & (MQTT_SN_TOPIC_HASH_SIZE - 1);
+  }
+  return -1;
+}
+
+void mqtt_sn_topic_index(mqtt_sn_client_t *client, uint16_t pos){
+  uint16_t slot;
+
+  if (client->topic_bind[pos].topic_name == NULL ||
+      mqtt_sn_topic_find(client, client->topic_bind[pos].topic_name) >= 0)
+    return;
+
+  client->topic_bind[pos].hash = mqtt_sn_topic_hash(client->topic_bind[pos].topic_name);
+  slot = client->topic_bind[pos].hash & (MQTT_SN_TOPIC_HASH_SIZE - 1);
+  while (client->topic_hash[slot] != 0)
+    slot = (slot + 1) & (MQTT_SN_TOPIC_HASH_SIZE - 1);
+  client->topic_hash[slot] = pos + 1;
+}
+
+#ifdef MQTT_SN_TOPIC_CACHE
+static uint32_t mqtt_sn_fnv32(uint32_t hash, const void *data, size_t len){
+  const uint8_t *p = (const uint8_t *)data;
+
+  // FNV-1a de 32 bits, encadeável (hash inicial 2166136261)
+  while (len--)
+    hash = (hash ^ *p++) * 16777619UL;
+  return hash;
+}
+
+static int16_t mqtt_sn_topic_find_hash(mqtt_sn_client_t *client, mqtt_sn_cache_entry_t *entry){
+  uint16_t slot;
+  mqtt_sn_topic_pos_t pos;
+  const char *name;
+
+  slot = entry->hash & (MQTT_SN_TOPIC_HASH_SIZE - 1);
+  while ((pos = client->topic_hash[slot]) != 0) {
+    pos--;
+    name = client->topic_bind[pos].topic_name;
+    if (client->topic_bind[pos].hash == entry->hash &&
+        strlen(name) == entry->name_len &&
+        mqtt_sn_fnv32(2166136261UL, name, entry->name_len) == entry->fingerprint)
+      return pos;
+    slot = (slot + 1) & (MQTT_SN_TOPIC_HASH_SIZE - 1);
+  }
+  return -1;
+}
+
+static bool mqtt_sn_cache_name_cmp(int fd, const char *name, uint8_t len){
+  char chunk[16];
+  uint8_t n;
+  bool equal = (name != NULL);
+
+  // O nome é lido em blocos e comparado ao candidato, sempre consumindo os
+  // len bytes para que a próxima entrada seja lida da posição correta
+  while (len > 0) {
+    n = len < sizeof(chunk) ? len : sizeof(chunk);
+    if (cfs_read(fd, chunk, n) != n)
+      return false;
+    if (equal && memcmp(chunk, name, n) != 0)
+      equal = false;
+    if (equal)
+      name += n;
+    len -= n;
+  }
+  return equal;
+}
+
+static void mqtt_sn_cache_header(mqtt_sn_client_t *client, mqtt_sn_cache_hdr_t *hdr){
+  // Identificação completa do gateway e do client id, o fingerprint serve
+  // apenas para o nome do arquivo e para descartar rapidamente outra sessão
+  memset(hdr, 0, sizeof(*hdr));
+  hdr->magic = MQTT_SN_TOPIC_CACHE_MAGIC;
+  memcpy(hdr->gw_addr, client->gw_addr.u8, sizeof(hdr->gw_addr));
+  hdr->udp_port = client->con.udp_port;
+  strncpy(hdr->client_id, client->con.client_id, sizeof(hdr->client_id) - 1);
+  hdr->fingerprint = mqtt_sn_fnv32(2166136261UL, hdr->gw_addr,
+                                   sizeof(hdr->gw_addr) + sizeof(hdr->udp_port) + sizeof(hdr->client_id));
+}
+
+static void mqtt_sn_cache_file(mqtt_sn_cache_hdr_t *hdr, char *name){
+  // Um arquivo por gateway: voltando a um gateway já utilizado (failover) os
+  // seus topic ids são recuperados. O nome do Coffee comporta somente 16 bits
+  // do fingerprint, uma colisão apenas sobrescreve o arquivo do outro gateway
+  sprintf(name, "%s%04x", MQTT_SN_TOPIC_CACHE_FILE,
+          (unsigned)((hdr->fingerprint ^ (hdr->fingerprint >> 16)) & 0xFFFF));
+}
+
+resp_con_t mqtt_sn_cache_load(mqtt_sn_client_t *client){
+  char name[sizeof(MQTT_SN_TOPIC_CACHE_FILE) + 4];
+  mqtt_sn_cache_hdr_t hdr, cur;
+  mqtt_sn_cache_entry_t entry;
+  int fd;
+  int16_t pos;
+  uint16_t i, loaded = 0;
+
+  mqtt_sn_cache_header(client, &cur);
+  mqtt_sn_cache_file(&cur, name);
+  fd = cfs_open(name, CFS_READ);
+  if (fd < 0)
+    return FAIL_CON;
+
+  if (cfs_read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+      memcmp(&hdr, &cur, offsetof(mqtt_sn_cache_hdr_t, count)) != 0) {
+    debug_mqtt("Cache de topic ids invalido");
+    cfs_close(fd);
+    return FAIL_CON;
+  }
+
+  for (i = 0; i < hdr.count; i++) {
+    if (cfs_read(fd, &entry, sizeof(entry)) != sizeof(entry))
+      break;
+    // Somente tópicos informados pelo usuário nesta execução são preenchidos,
+    // e apenas se o nome gravado for idêntico ao do candidato
+    pos = mqtt_sn_topic_find_hash(client, &entry);
+    if (pos >= 0 && client->topic_bind[pos].short_topic_id != MQTT_SN_TOPIC_ID_NONE)
+      pos = -1;
+    if (!mqtt_sn_cache_name_cmp(fd, pos < 0 ? NULL : client->topic_bind[pos].topic_name, entry.name_len)) {
+      if (pos >= 0)
+        debug_mqtt("Nome divergente no cache:[%s]",client->topic_bind[pos].topic_name);
+      continue;
+    }
+    mqtt_sn_topic_set_id(client, pos, entry.topic_id);
+    loaded++;
+  }
+  cfs_close(fd);
+
+  debug_mqtt("Topic ids recuperados da flash:[%d]",loaded);
+  return loaded > 0 ? SUCCESS_CON : FAIL_CON;
+}
+
+resp_con_t mqtt_sn_cache_save(mqtt_sn_client_t *client){
+  char name[sizeof(MQTT_SN_TOPIC_CACHE_FILE) + 4];
+  mqtt_sn_cache_hdr_t hdr;
+  mqtt_sn_cache_entry_t entry;
+  int fd;
+  uint16_t i;
+
+  if (!client->cache_dirty)
+    return SUCCESS_CON;
+
+  mqtt_sn_cache_header(client, &hdr);
+  for (i = 1; i < MAX_TOPIC_USED; i++)
+    if (client->topic_bind[i].topic_name != NULL &&
+        client->topic_bind[i].topic_type == MQTT_SN_TOPIC_TYPE_NORMAL &&
+        client->topic_bind[i].short_topic_id != MQTT_SN_TOPIC_ID_NONE)
+      hdr.count++;
+
+  // O Coffee não sobrescreve um arquivo existente, ele é recriado
+  mqtt_sn_cache_file(&hdr, name);
+  cfs_remove(name);
+  fd = cfs_open(name, CFS_WRITE);
+  if (fd < 0)
+    return FAIL_CON;
+
+  if (cfs_write(fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+    goto fail;
+  for (i = 1; i < MAX_TOPIC_USED; i++) {
+    if (client->topic_bind[i].topic_name == NULL ||
+        client->topic_bind[i].topic_type != MQTT_SN_TOPIC_TYPE_NORMAL ||
+        client->topic_bind[i].short_topic_id == MQTT_SN_TOPIC_ID_NONE)
+      continue;
+    entry.topic_id = client->topic_bind[i].short_topic_id;
+    entry.hash = client->topic_bind[i].hash;
+    entry.name_len = strlen(client->topic_bind[i].topic_name);
+    entry.fingerprint = mqtt_sn_fnv32(2166136261UL, client->topic_bind[i].topic_name, entry.name_len);
+    if (cfs_write(fd, &entry, sizeof(entry)) != sizeof(entry) ||
+        cfs_write(fd, client->topic_bind[i].topic_name, entry.name_len) != entry.name_len)
+      goto fail;
+  }
+  cfs_close(fd);
+
+  client->cache_dirty = false;
+  debug_mqtt("Topic ids gravados na flash:[%d]",hdr.count);
+  return SUCCESS_CON;
+
+fail:
+  // Arquivo parcial seria recusado pela contagem, mas é removido mesmo assim
+  cfs_close(fd);
+  cfs_remove(name);
+  return FAIL_CON;
+}
+#endif
+
+static uint16_t mqtt_sn_topic_free_slot(mqtt_sn_client_t *client){
+  uint16_t i;
+
+  // A posição 0 não é utilizada, o message id 0 do REGISTER é evitado
+  for (i = 1; i < MAX_TOPIC_USED; i++)
+    if (client->topic_bind[i].topic_name == NULL)
+      return i;
+  return 0;
+}
+
+static uint16_t mqtt_sn_topic_id_slot(uint16_t topic_id){
+  return (topic_id ^ (topic_id >> 8)) & (MQTT_SN_TOPIC_HASH_SIZE - 1);
+}
+
+int16_t mqtt_sn_topic_find_id(mqtt_sn_client_t *client, uint16_t topic_id, uint8_t topic_type){
+  uint16_t slot, n;
+  mqtt_sn_topic_pos_t pos;
+
+  if (topic_id == MQTT_SN_TOPIC_ID_NONE)
+    return -1;
+
+  slot = mqtt_sn_topic_id_slot(topic_id);
+  for (n = 0; n < MQTT_SN_TOPIC_HASH_SIZE && (pos = client->topic_id_hash[slot]) != 0; n++) {
+    if (pos != MQTT_SN_TOPIC_POS_DELETED) {
+      pos--;
+      if (client->topic_bind[pos].topic_name != NULL &&
+          client->topic_bind[pos].short_topic_id == topic_id &&
+          client->topic_bind[pos].topic_type == topic_type)
+        return pos;
+    }
+    slot = (slot + 1) & (MQTT_SN_TOPIC_HASH_SIZE - 1);
+  }
+  return -1;
+}
+
+void mqtt_sn_topic_set_id(mqtt_sn_client_t *client, uint16_t pos, uint16_t topic_id){
+  uint16_t slot, n;
+  mqtt_sn_topic_pos_t entry;
+
+  // O topic id anterior (reconexão, REGACK repetido) sai do índice
+  if (client->topic_bind[pos].short_topic_id != MQTT_SN_TOPIC_ID_NONE) {
+    slot = mqtt_sn_topic_id_slot(client->topic_bind[pos].short_topic_id);
+    for (n = 0; n < MQTT_SN_TOPIC_HASH_SIZE && (entry = client->topic_id_hash[slot]) != 0; n++) {
+      if (entry == pos + 1) {
+        client->topic_id_hash[slot] = MQTT_SN_TOPIC_POS_DELETED;
+        break;
+      }
+      slot = (slot + 1) & (MQTT_SN_TOPIC_HASH_SIZE - 1);
+    }
+  }
+
+  client->topic_bind[pos].short_topic_id = topic_id;
+  if (topic_id == MQTT_SN_TOPIC_ID_NONE)
+    return;
+
+  // Há no máximo MAX_TOPIC_USED entradas válidas, logo sempre existe uma
+  // posição vazia ou removida
+  slot = mqtt_sn_topic_id_slot(topic_id);
+  for (n = 0; n < MQTT_SN_TOPIC_HASH_SIZE; n++) {
+    entry = client->topic_id_hash[slot];
+    if (entry == 0 || entry == MQTT_SN_TOPIC_POS_DELETED) {
+      client->topic_id_hash[slot] = pos + 1;
+      return;
+    }
+    slot = (slot + 1) & (MQTT_SN_TOPIC_HASH_SIZE - 1);
+  }
+}
+
+static int32_t mqtt_sn_predefined_id(const char *topic){
+  size_t i;
+
+  for (i = 0; g_predefined_topics[i].topic_name != NULL; i++)
+    if (strcmp(g_predefined_topics[i].topic_name, topic) == 0)
+      return g_predefined_topics[i].topic_id;
+  return -1;
+}
+
+resp_con_t verf_predefined(mqtt_sn_client_t *client, uint16_t pos){
+  int32_t topic_id = mqtt_sn_predefined_id(client->topic_bind[pos].topic_name);
+
+  if (topic_id < 0)
+    return FAIL_CON;
+
+  mqtt_sn_topic_set_id(client, pos, topic_id);
+  client->topic_bind[pos].topic_type = MQTT_SN_TOPIC_TYPE_PREDEFINED;
+  debug_mqtt("Topico pre-definido:[%s][%d]",client->topic_bind[pos].topic_name,client->topic_bind[pos].short_topic_id);
+  return SUCCESS_CON;
+}
+
+bool unlock_tasks(mqtt_sn_client_t *client) {
+  if (client->status == MQTTSN_TOPIC_REGISTERED)
     return true;
   return false;
 }
 
 void init_sub(void *ptr){
+  mqtt_sn_client_t *client = (mqtt_sn_client_t *)ptr;
+
   debug_mqtt("INICIANDO SUBSCRIBE");
-  process_post(&mqtt_sn_main,mqtt_event_run_task,NULL);
+  process_post(&mqtt_sn_main, mqtt_event_run_task, client);
 }
 
 void parse_mqtt_type_string(uint8_t type, char **type_string){
@@ -158,8 +473,8 @@ void parse_mqtt_type_string(uint8_t type, char **type_string){
   }
 }
 
-char* mqtt_sn_check_status_string(void){
-  switch (mqtt_status) {
+char* mqtt_sn_check_status_string(mqtt_sn_client_t *client){
+  switch (client->status) {
     case MQTTSN_DISCONNECTED:
       return "DESCONECTADO";
     break;
@@ -181,14 +496,23 @@ char* mqtt_sn_check_status_string(void){
     case MQTTSN_WAITING_WILLMSGREQ:
       return "AGUARDANDO WILL MESSAGE";
     break;
+    case MQTTSN_WAITING_DISCONNECT:
+      return "AGUARDANDO DISCONNECT";
+    break;
+    case MQTTSN_ASLEEP:
+      return "DORMINDO";
+    break;
+    case MQTTSN_AWAKE:
+      return "ACORDADO";
+    break;
     default:
       return "ESTADO NAO DESCRITO";
     break;
   }
 }
 
-mqtt_sn_status_t mqtt_sn_check_status(void){
-  return mqtt_status;
+mqtt_sn_status_t mqtt_sn_check_status(mqtt_sn_client_t *client){
+  return client->status;
 }
 
 resp_con_t mqtt_sn_check_rc(uint8_t rc){
@@ -226,19 +550,22 @@ uint8_t mqtt_sn_get_qos_flag(int8_t qos){
     }
 }
 
-resp_con_t mqtt_sn_sub_wildcard(char *topic, uint8_t qos){
-  mqtt_sn_task_t subscribe_task;
+resp_con_t mqtt_sn_sub_wildcard(mqtt_sn_client_t *client, char *topic, uint8_t qos){
+  mqtt_sn_task_t subscribe_task = {0};
 
   subscribe_task.msg_type_q      = MQTT_SN_TYPE_SUB_WILDCARD;
   subscribe_task.qos_level       = qos;
-  topic_temp_wildcard            = topic;
-  if (!mqtt_sn_insert_queue(subscribe_task))
+  subscribe_task.prio            = MQTT_SN_PRIO_LOW;
+  client->topic_temp_wildcard            = topic;
+  client->wildcard_sub                   = topic;
+  client->wildcard_qos                   = qos;
+  if (!mqtt_sn_insert_queue(client, subscribe_task))
    debug_task("ERRO AO ADICIONAR NA FILA");
 
   return SUCCESS_CON;
 }
 
-resp_con_t mqtt_sn_sub(char *topic, uint8_t qos){
+resp_con_t mqtt_sn_sub(mqtt_sn_client_t *client, char *topic, uint8_t qos){
   // Caso haja tópicos para registrar, não habilita a inscrição
   // evitando que prejudique alguma transação, ou seja, tasks
   // tem prioridade sobre inscrições diretas
@@ -246,32 +573,34 @@ resp_con_t mqtt_sn_sub(char *topic, uint8_t qos){
   // return FAIL_CON;
 
   if(strstr(topic,"#") || strstr(topic,"+")){
-    mqtt_sn_sub_wildcard(topic,qos);
+    mqtt_sn_sub_wildcard(client, topic,qos);
     return SUCCESS_CON;
   }
 
-  if (!verf_register(topic))
+  if (!verf_register(client, topic))
   return FAIL_CON;
 
-  if(verf_hist_sub(topic)){
-    mqtt_sn_task_t subscribe_task;
-    size_t i;
-    for (i=0; i < MAX_TOPIC_USED; i++)
-      if(strcmp(g_topic_bind[i].topic_name,topic) == 0) // Tópico novo ou existe?
-        break;
+  if(verf_hist_sub(client, topic)){
+    mqtt_sn_task_t subscribe_task = {0};
 
     subscribe_task.msg_type_q      = MQTT_SN_TYPE_SUBSCRIBE;
     subscribe_task.qos_level       = qos;
-    subscribe_task.short_topic     = i;
+    subscribe_task.prio            = MQTT_SN_PRIO_LOW;
+    subscribe_task.short_topic     = mqtt_sn_topic_find(client, topic);
+    client->topic_bind[subscribe_task.short_topic].sub_qos = qos;
 
     // Comentadas as duas linhas abaixo porque consideraremos que o usuário irá registrar os
     // topicos no começo do programa não sendo necessário gerar o evento de run_task
     //if (mqtt_sn_check_empty())
-    //  ctimer_set(&mqtt_time_subscribe, 3*MQTT_SN_TIMEOUT, init_sub, NULL);
+    //  ctimer_set(&time_subscribe, 3*MQTT_SN_TIMEOUT, init_sub, client);
 
-    if (!mqtt_sn_insert_queue(subscribe_task))
+    if (!mqtt_sn_insert_queue(client, subscribe_task))
      debug_task("ERRO AO ADICIONAR NA FILA");
 
+    // Inscrição feita após o registro dos tópicos: a fila estava parada
+    if (unlock_tasks(client))
+      process_post(&mqtt_sn_main, mqtt_event_run_task, client);
+
     return SUCCESS_CON;
   }
   else
@@ -279,584 +608,2049 @@ resp_con_t mqtt_sn_sub(char *topic, uint8_t qos){
 
 }
 
-resp_con_t mqtt_sn_pub(char *topic,char *message, bool retain_flag, uint8_t qos){
-  // Caso haja tópicos para registrar, não habilita a publicação
-  // evitando que prejudique alguma transação, ou seja, tasks
-  // tem prioridade sobre publicações diretas
-  if (!unlock_tasks())
-    return FAIL_CON;
+static uint16_t mqtt_sn_short_topic_id(const char *topic){
+  return ((uint16_t)(uint8_t)topic[0] << 8) | (uint8_t)topic[1];
+}
 
-  // Analisamos o buffer de tópicos registrados para ver se já foi registrado o tópico
-  if (!verf_register(topic))
+static resp_con_t mqtt_sn_pub_qos_n1_bin(mqtt_sn_client_t *client, char *topic, const uint8_t *payload, size_t len, bool retain_flag){
+  int32_t topic_id;
+
+  if (topic == NULL)
     return FAIL_CON;
 
-  mqtt_sn_pub_send(topic,message,retain_flag,qos);
-  return SUCCESS_CON;
+  // Sem CONNECT/REGISTER o gateway só entende topic ids pré-definidos ou
+  // short topic names, a publicação sai em um único datagrama
+  topic_id = mqtt_sn_predefined_id(topic);
+  if (topic_id >= 0)
+    return mqtt_sn_pub_send_bin(client, topic_id, MQTT_SN_TOPIC_TYPE_PREDEFINED,
+                                payload, len, retain_flag, -1);
+
+  if (strlen(topic) == 2)
+    return mqtt_sn_pub_send_bin(client, mqtt_sn_short_topic_id(topic),
+                                MQTT_SN_TOPIC_TYPE_SHORT,
+                                payload, len, retain_flag, -1);
+
+  debug_mqtt("Erro: QoS -1 exige topico pre-definido ou short topic name");
+  return FAIL_CON;
 }
 
-resp_con_t verf_hist_sub(char *topic){
-  size_t i;
-  //
-  // for (i=0; i < MAX_TOPIC_USED; i++)
-  //   if(strcmp(g_topic_bind[i].topic_name,topic) == 0) // Tópico novo ou existe?
-  //     break;
-  //
-  // if (g_topic_bind[i].short_topic_id == 0xFF) {
-  //   debug_mqtt("Topico nao registrado!")
-  //   return FAIL_CON;
-  // }
+/******************* PUBLICAÇÕES RETIDAS DURANTE A DESCONEXÃO *****************/
+// Publicações feitas sem a sessão pronta (reconexão, REGISTER em andamento)
+// ficam em uma fila circular em RAM e, opcionalmente, transbordam para um
+// arquivo CFS. Ao retomar a sessão são enviadas uma a cada
+// MQTT_SN_OFFLINE_DRAIN, na ordem original. O ponteiro do tópico também vai
+// para o arquivo, logo ele só vale durante a execução (não sobrevive a reset).
+#ifdef MQTT_SN_OFFLINE_CFS
+static void mqtt_sn_offline_file(mqtt_sn_client_t *client, char *name){
+  // Um arquivo por instância, identificada pelo client id
+  sprintf(name, "%s%04x", MQTT_SN_OFFLINE_CFS_FILE, mqtt_sn_topic_hash(client->con.client_id));
+}
 
-  for (i=0; i < MAX_TOPIC_USED; i++)
-    if(strcmp(g_topic_bind[i].topic_name,topic) == 0)
-      break;
+static resp_con_t mqtt_sn_offline_spill(mqtt_sn_client_t *client, const mqtt_sn_offline_t *entry){
+  char name[sizeof(MQTT_SN_OFFLINE_CFS_FILE) + 4];
+  int fd;
+  int len;
 
-  if (g_topic_bind[i].subscribed == 0x01){  // Na fila para inscrever? 0x01?
-    debug_mqtt("Inscricao do topico em andamento:[%s]",g_topic_bind[i].topic_name);
+  if (client->spill_wr >= MQTT_SN_OFFLINE_CFS_MAX)
     return FAIL_CON;
-  }
-  else if (g_topic_bind[i].subscribed == 0x02) {  // Já inscrito? 0x02?
-    debug_mqtt("Topico inscrito:[%s]",g_topic_bind[i].topic_name);
+
+  mqtt_sn_offline_file(client, name);
+  fd = cfs_open(name, CFS_WRITE | CFS_APPEND);
+  if (fd < 0)
     return FAIL_CON;
-  }
-  else if (g_topic_bind[i].subscribed == 0x00){  // Caso g_topic_bind[i].subscribed == 0x00 vamos preparar o topico para ser inscrito
-    g_topic_bind[i].subscribed = 0x01;
-    debug_mqtt("Preparando para inscricao:[%s]",g_topic_bind[i].topic_name);
-    return SUCCESS_CON;
-  }
-  else{
-    debug_mqtt("Topico com valor estranho no SUBSCRIBED:%d",g_topic_bind[i].subscribed);
+  len = cfs_write(fd, entry, sizeof(*entry));
+  cfs_close(fd);
+  if (len != sizeof(*entry))
     return FAIL_CON;
-  }
 
+  client->spill_wr++;
+  return SUCCESS_CON;
 }
 
-resp_con_t verf_register(char *topic){
-  size_t i;
-  for (i=0; i < MAX_TOPIC_USED; i++)
-    if(strcmp(g_topic_bind[i].topic_name,topic) == 0)  // Tópico novo ou existe?
-      return SUCCESS_CON;
+static void mqtt_sn_offline_refill(mqtt_sn_client_t *client){
+  char name[sizeof(MQTT_SN_OFFLINE_CFS_FILE) + 4];
+  int fd;
 
-  debug_mqtt("Topico nao registrado!");
-  return FAIL_CON;
-}
+  if (client->spill_rd == client->spill_wr)
+    return;
 
-void print_g_topics(void){
-  size_t i;
-  debug_mqtt("Vetor de topicos");
-  for(i = 0 ; g_topic_bind[i].short_topic_id != 0xFF; i++) {
-    debug_mqtt("[i=%d][%d][%s]",i,g_topic_bind[i].short_topic_id,g_topic_bind[i].topic_name);
+  mqtt_sn_offline_file(client, name);
+  fd = cfs_open(name, CFS_READ);
+  if (fd >= 0) {
+    cfs_seek(fd, (cfs_offset_t)client->spill_rd*sizeof(mqtt_sn_offline_t), CFS_SEEK_SET);
+    while (client->offline_len < MQTT_SN_OFFLINE_SLOTS && client->spill_rd < client->spill_wr) {
+      if (cfs_read(fd, &client->offline[(client->offline_head + client->offline_len) % MQTT_SN_OFFLINE_SLOTS],
+                   sizeof(mqtt_sn_offline_t)) != sizeof(mqtt_sn_offline_t))
+        break;
+      client->spill_rd++;
+      client->offline_len++;
+    }
+    cfs_close(fd);
   }
-}
 
-void init_vectors(void){
-  debug_mqtt("Inicializando vetores...");
-  size_t i;
-  for (i = 1; i < MAX_TOPIC_USED; i++){
-    g_topic_bind[i].short_topic_id = 0xFF;
-    g_topic_bind[i].topic_name = 0;
-    g_topic_bind[i].subscribed = 0x00;
+  // Arquivo consumido (ou ilegível): é recriado na próxima transbordada
+  if (fd < 0 || client->spill_rd == client->spill_wr) {
+    if (client->spill_rd != client->spill_wr) {
+      client->offline_dropped += client->spill_wr - client->spill_rd;
+      debug_mqtt("Erro ao ler publicacoes offline da flash");
+    }
+    cfs_remove(name);
+    client->spill_rd = 0;
+    client->spill_wr = 0;
   }
-
-  while (!mqtt_sn_check_empty())
-      mqtt_sn_delete_queue();
-  g_task_id = 0;
 }
+#endif
 
-/******************** FUNÇÕES DE ENVIO DE PACOTES MQTT-SN *********************/
-resp_con_t mqtt_sn_will_topic_send(void){
-  willtopic_packet_t packet;
-
-  size_t topic_name_len = strlen(g_mqtt_sn_con.will_topic);
-
-  if (topic_name_len > MQTT_SN_MAX_TOPIC_LENGTH) {
-    debug_mqtt("Erro: Nome do topico WILL excede o limite maximo");
-    return FAIL_CON;
-  }
+static mqtt_sn_offline_t *mqtt_sn_offline_at(mqtt_sn_client_t *client, uint8_t k){
+  return &client->offline[(client->offline_head + k) % MQTT_SN_OFFLINE_SLOTS];
+}
 
-  packet.flags = MQTT_SN_FLAG_RETAIN;
+static void mqtt_sn_offline_remove(mqtt_sn_client_t *client, uint8_t k){
+  // Retirada no meio da fila (escolha por prioridade): as seguintes avançam
+  for (; k + 1 < client->offline_len; k++)
+    *mqtt_sn_offline_at(client, k) = *mqtt_sn_offline_at(client, k + 1);
+  client->offline_len--;
+}
 
-  packet.type = MQTT_SN_TYPE_WILLTOPIC;
+static int16_t mqtt_sn_offline_victim(mqtt_sn_client_t *client, uint8_t prio){
+  int16_t victim = -1;
+  uint8_t k;
 
-  strncpy(packet.will_topic, g_mqtt_sn_con.will_topic, topic_name_len);
-  packet.length = 0x03 + topic_name_len;
-  packet.will_topic[topic_name_len] = '\0';
+  // Mais antiga da menor classe presente, desde que não acima de prio
+  for (k = 0; k < client->offline_len; k++)
+    if (mqtt_sn_offline_at(client, k)->prio <= prio &&
+        (victim < 0 || mqtt_sn_offline_at(client, k)->prio < mqtt_sn_offline_at(client, victim)->prio))
+      victim = k;
+  return victim;
+}
 
-  debug_mqtt("Enviando o pacote @WILL TOPIC");
-  simple_udp_send(&g_mqtt_sn_con.udp_con,&packet, packet.length);
+static bool mqtt_sn_offline_waiting(mqtt_sn_client_t *client, uint8_t prio){
+  uint8_t k;
 
-  return SUCCESS_CON;
+  // Retidas da mesma classe ou acima saem antes, preservando a ordem
+  for (k = 0; k < client->offline_len; k++)
+    if (mqtt_sn_offline_at(client, k)->prio >= prio)
+      return true;
+#ifdef MQTT_SN_OFFLINE_CFS
+  if (prio != MQTT_SN_PRIO_HIGH && client->spill_rd != client->spill_wr)
+    return true;
+#endif
+  return false;
 }
 
-resp_con_t mqtt_sn_will_message_send(void){
-  willmessage_packet_t packet;
-
-  size_t message_name_len = strlen(g_mqtt_sn_con.will_message);
+static resp_con_t mqtt_sn_offline_push(mqtt_sn_client_t *client, char *topic, const uint8_t *payload, size_t len, bool retain_flag, int8_t qos, uint8_t prio){
+  mqtt_sn_offline_t entry;
+  int16_t victim;
 
-  if (message_name_len > MQTT_SN_MAX_TOPIC_LENGTH) {
-    debug_mqtt("Erro: Nome da mensagem WILL excede o limite maximo");
+  if (len > MQTT_SN_OFFLINE_PAYLOAD) {
+    debug_mqtt("Publicacao offline excede MQTT_SN_OFFLINE_PAYLOAD");
+    client->offline_dropped++;
     return FAIL_CON;
   }
 
-  packet.type = MQTT_SN_TYPE_WILLMSG;
-
-  strncpy(packet.will_message, g_mqtt_sn_con.will_message, message_name_len);
-  packet.length = 0x02 + message_name_len;
-  packet.will_message[message_name_len] = '\0';
+  entry.topic = topic;
+  entry.retain = retain_flag;
+  entry.qos = qos;
+  entry.prio = prio;
+  entry.len = len;
+  memcpy(entry.data, payload, len);
+
+  if (ctimer_expired(&client->time_offline))
+    ctimer_set(&client->time_offline, MQTT_SN_OFFLINE_DRAIN, timeout_offline, client);
+
+#ifdef MQTT_SN_OFFLINE_CFS
+  // Havendo entradas no arquivo as novas seguem para ele, mantendo a ordem.
+  // Publicações de alta prioridade ficam sempre em RAM, sem esperar o arquivo
+  if (prio != MQTT_SN_PRIO_HIGH &&
+      (client->offline_len == MQTT_SN_OFFLINE_SLOTS || client->spill_rd != client->spill_wr) &&
+      mqtt_sn_offline_spill(client, &entry))
+    return SUCCESS_CON;
+#endif
 
-  debug_mqtt("Enviando o pacote @WILL MESSAGE");
-  simple_udp_send(&g_mqtt_sn_con.udp_con,&packet, packet.length);
+  if (client->offline_len == MQTT_SN_OFFLINE_SLOTS) {
+    // Uma classe mais alta sempre desloca a mais antiga de classe menor, na
+    // mesma classe vale MQTT_SN_OFFLINE_POLICY
+#if MQTT_SN_OFFLINE_POLICY == MQTT_SN_OFFLINE_DROP_NEWEST
+    victim = prio > 0 ? mqtt_sn_offline_victim(client, prio - 1) : -1;
+#else
+    victim = mqtt_sn_offline_victim(client, prio);
+#endif
+    client->offline_dropped++;
+    if (victim < 0) {
+      debug_mqtt("Fila offline cheia, publicacao descartada:[%s]",topic);
+      return FAIL_CON;
+    }
+    debug_mqtt("Fila offline cheia, descartada a mais antiga:[%s]",mqtt_sn_offline_at(client, victim)->topic);
+    mqtt_sn_offline_remove(client, victim);
+#ifdef MQTT_SN_OFFLINE_CFS
+    // A posição liberada recebe a próxima do arquivo, a nova vai para o fim
+    if (prio != MQTT_SN_PRIO_HIGH && client->spill_rd != client->spill_wr) {
+      mqtt_sn_offline_refill(client);
+      if (mqtt_sn_offline_spill(client, &entry))
+        return SUCCESS_CON;
+      // Arquivo sem espaço até esvaziar: a nova publicação é descartada
+      debug_mqtt("Arquivo offline cheio, publicacao descartada:[%s]",topic);
+      return FAIL_CON;
+    }
+#endif
+  }
 
+  *mqtt_sn_offline_at(client, client->offline_len) = entry;
+  client->offline_len++;
   return SUCCESS_CON;
 }
 
-void mqtt_sn_ping_send(void){
-  ping_req_t ping_request;
+uint16_t mqtt_sn_offline_pending(mqtt_sn_client_t *client){
+#ifdef MQTT_SN_OFFLINE_CFS
+  return client->offline_len + (client->spill_wr - client->spill_rd);
+#else
+  return client->offline_len;
+#endif
+}
 
-  ping_request.msg_type = MQTT_SN_TYPE_PINGREQ;
-  strncpy(ping_request.client_id, g_mqtt_sn_con.client_id, strlen(g_mqtt_sn_con.client_id));
-  ping_request.client_id[strlen(g_mqtt_sn_con.client_id)] = '\0';
-  //debug_mqtt("Client ID PING:%s",ping_request.client_id);
-  ping_request.length = 0x02 + strlen(ping_request.client_id);
-  //debug_mqtt("Enviando @PINGREQ");
-  simple_udp_send(&g_mqtt_sn_con.udp_con,&ping_request, ping_request.length);
+uint16_t mqtt_sn_offline_dropped(mqtt_sn_client_t *client){
+  return client->offline_dropped;
 }
 
-resp_con_t mqtt_sn_con_send(void){
-  connect_packet_t packet;
+static bool mqtt_sn_queue_busy(mqtt_sn_client_t *client, uint8_t prio);
 
-  // Criação do pacote CONNECT
-  packet.type = MQTT_SN_TYPE_CONNECT;
-  packet.flags = MQTT_SN_FLAG_CLEAN;
-  if (g_will)
-    packet.flags += MQTT_SN_FLAG_WILL;
-  packet.protocol_id = MQTT_SN_PROTOCOL_ID;
-  packet.duration = uip_htons(g_mqtt_sn_con.keep_alive); //Realiza a conversão para network byte order
-
-  strncpy(packet.client_id, g_mqtt_sn_con.client_id, strlen(g_mqtt_sn_con.client_id));
-  packet.client_id[strlen(g_mqtt_sn_con.client_id)] = '\0';
-  packet.length = 0x06 + strlen(packet.client_id);
-
-  // debug_mqtt("CLIENT_ID:%s, Tamanho:%d",packet.client_id,strlen(packet.client_id));
-  debug_mqtt("Enviando o pacote @CONNECT ");
-  simple_udp_send(&g_mqtt_sn_con.udp_con,&packet, packet.length);
-  // debug_mqtt("enviado!");
-  return SUCCESS_CON;
+static bool mqtt_sn_pub_ready(mqtt_sn_client_t *client, int16_t pos, uint8_t prio){
+  // Todos os estados a partir de MQTTSN_WAITING_REGACK implicam conexão
+  // aceita, sem ela e sem o topic id nenhuma publicação sai
+  if (client->status < MQTTSN_WAITING_REGACK ||
+      client->topic_bind[pos].short_topic_id == MQTT_SN_TOPIC_ID_NONE)
+    return false;
+
+  // Alta prioridade, pré-definidos e short topics só dependem do CONNACK.
+  // As demais esperam somente as tarefas de classe igual ou maior na fila,
+  // logo um SUBSCRIBE em retransmissão não segura MQTT_SN_PRIO_NORMAL
+  if (prio == MQTT_SN_PRIO_HIGH || client->topic_bind[pos].topic_type != MQTT_SN_TOPIC_TYPE_NORMAL)
+    return true;
+  if (prio == MQTT_SN_PRIO_NORMAL)
+    return !mqtt_sn_queue_busy(client, prio);
+  return unlock_tasks(client);
 }
 
-resp_con_t mqtt_sn_reg_send(void){
-  register_packet_t packet;
+static resp_con_t mqtt_sn_pub_data(mqtt_sn_client_t *client, char *topic, const uint8_t *payload, size_t len, bool retain_flag, int8_t qos, uint8_t prio){
+  int16_t i;
 
-  size_t i = 0;
-  for (i=1; i < MAX_TOPIC_USED; i++)
-    if (g_topic_bind[i].short_topic_id == 0xFF)
-      break;
+  // QoS -1 não depende de conexão nem do vetor de tópicos
+  if (qos == -1)
+    return mqtt_sn_pub_qos_n1_bin(client, topic, payload, len, retain_flag);
 
-  uint16_t task_id = i;
-  // Leak of memory
-  //size_t topic_name_len = strlen(mqtt_queue_first->data.long_topic); //Pega o primeiro da fila aguardando
-  size_t topic_name_len = strlen(g_topic_bind[task_id].topic_name);
+  // Analisamos o buffer de tópicos registrados para ver se já foi registrado o tópico
+  if (!verf_register(client, topic))
+    return FAIL_CON;
 
-  if (topic_name_len > MQTT_SN_MAX_TOPIC_LENGTH) {
-    debug_mqtt("Erro: Nome do topico excede o limite maximo");
+  // Tarefas da fila de classe igual ou maior têm prioridade sobre publicações
+  // diretas (mqtt_sn_pub_ready). Tópicos pré-definidos e short topics não
+  // dependem de REGISTER, logo são liberados logo após o CONNACK
+  i = mqtt_sn_topic_find(client, topic);
+  // Sem a sessão pronta a publicação é retida, e enquanto houver retidas da
+  // mesma classe ou acima as novas entram atrás delas
+  if (!mqtt_sn_pub_ready(client, i, prio) || mqtt_sn_offline_waiting(client, prio))
+    return mqtt_sn_offline_push(client, topic, payload, len, retain_flag, qos, prio);
+
+  return mqtt_sn_pub_send_bin(client, client->topic_bind[i].short_topic_id,
+                              client->topic_bind[i].topic_type,
+                              payload, len, retain_flag, qos);
+}
+
+resp_con_t mqtt_sn_pub(mqtt_sn_client_t *client, char *topic,char *message, bool retain_flag, int8_t qos, mqtt_sn_prio_t prio){
+  // O '\0' é enviado junto do payload, que precisa caber em um PUBLISH
+  // antes de ser reduzido ao uint8_t de mqtt_sn_pub_bin
+  size_t len = strlen(message) + 1;
+
+  if (len > MQTT_SN_MAX_PACKET_LENGTH-7) {
+    debug_mqtt("Erro: Payload e muito grande!");
     return FAIL_CON;
   }
+  return mqtt_sn_pub_bin(client, topic, (const uint8_t *)message, (uint8_t)len, retain_flag, qos, prio);
+}
 
-  if (mqtt_queue_first->data.msg_type_q != MQTT_SN_TYPE_REGISTER) {
-    debug_mqtt("Erro: Pacote a processar nao e do tipo REGISTER");
+resp_con_t mqtt_sn_pub_bin(mqtt_sn_client_t *client, char *topic, const uint8_t *payload, uint8_t len, bool retain_flag, int8_t qos, mqtt_sn_prio_t prio){
+  if (prio >= MQTT_SN_PRIO_CLASSES)
     return FAIL_CON;
-  }
+  return mqtt_sn_pub_data(client, topic, payload, len, retain_flag, qos, prio);
+}
 
-  packet.type = MQTT_SN_TYPE_REGISTER;
-  packet.topic_id = 0x0000;
+static int16_t mqtt_sn_topic_bind_short(mqtt_sn_client_t *client, char *topic){
+  int16_t pos = mqtt_sn_topic_find(client, topic);
+
+  // O tópico é inserido no vetor de tópicos somente para acompanhar o estado
+  // da inscrição e das publicações, o topic id é o próprio nome em 2 bytes
+  if (pos >= 0)
+    return pos;
+  pos = mqtt_sn_topic_free_slot(client);
+  if (pos == 0)
+    return -1;
+  client->topic_bind[pos].topic_name = topic;
+  mqtt_sn_topic_set_id(client, pos, mqtt_sn_short_topic_id(topic));
+  client->topic_bind[pos].topic_type = MQTT_SN_TOPIC_TYPE_SHORT;
+  mqtt_sn_topic_index(client, pos);
+  return pos;
+}
 
-  // Quando o broker responder com o short topic ID,
-  // ele utilizará como message id, o identificador único da task na
-  // queue de serviços do MQTT-SN, logo se torna fácil saber como montar
-  // a relação (short_topic/long_topic) no vetor global g_topic_bind[]
-  packet.message_id = uip_htons(task_id);
+resp_con_t mqtt_sn_pub_short(mqtt_sn_client_t *client, char *topic, char *message, bool retain_flag, int8_t qos, mqtt_sn_prio_t prio){
+  if (topic == NULL || strlen(topic) != 2) {
+    debug_mqtt("Erro: Short topic name deve ter 2 caracteres");
+    return FAIL_CON;
+  }
 
-  strncpy(packet.topic_name, g_topic_bind[task_id].topic_name, topic_name_len);
-  packet.length = 0x06 + topic_name_len;
-  packet.topic_name[topic_name_len] = '\0';
+  // Não há REGISTER para short topic name, logo basta o CONNACK
+  // (mqtt_sn_pub_ready). Com QoS -1 nem mesmo a conexão é necessária
+  if (qos != -1 && mqtt_sn_topic_bind_short(client, topic) < 0)
+    return FAIL_CON;
 
-  debug_mqtt("Topico a registrar:%s [%d][MSG_ID:%d]",packet.topic_name,strlen(packet.topic_name),(int)mqtt_queue_first->data.id_task);
-  debug_mqtt("Enviando o pacote @REGISTER");
-  simple_udp_send(&g_mqtt_sn_con.udp_con,&packet, packet.length);
+  return mqtt_sn_pub(client, topic, message, retain_flag, qos, prio);
+}
 
-  return SUCCESS_CON;
+resp_con_t mqtt_sn_pub_qos_n1(mqtt_sn_client_t *client, char *topic, char *message, bool retain_flag){
+  return mqtt_sn_pub(client, topic, message, retain_flag, -1, MQTT_SN_PRIO_NORMAL);
 }
 
-resp_con_t mqtt_sn_regack_send(uint16_t msg_id, uint16_t topic_id){
-  regack_packet_t packet;
+static resp_con_t mqtt_sn_coalesce_send(mqtt_sn_client_t *client, mqtt_sn_coalesce_t *c){
+  if (c->len == 0)
+    return SUCCESS_CON;
 
-  packet.type = MQTT_SN_TYPE_REGACK;
-  packet.topic_id = uip_htons(topic_id);
-  packet.message_id = uip_htons(msg_id);
-  packet.return_code = 0x00;
-  packet.length = 0x07;
+  c->data[c->len] = '\0';
+  if (!mqtt_sn_pub(client, c->topic, c->data, c->retain, c->qos, c->prio))
+    return FAIL_CON;
 
-  debug_mqtt("Enviando o pacote @REGACK");
-  simple_udp_send(&g_mqtt_sn_con.udp_con,&packet, packet.length);
+  debug_mqtt("Publicadas amostras agrupadas:[%s][%d]",c->topic,c->len);
+  ctimer_stop(&c->timer);
+  c->len = 0;
+  c->topic = NULL;
   return SUCCESS_CON;
 }
 
-resp_con_t mqtt_sn_pub_send(char *topic,char *message, bool retain_flag, uint8_t qos){
-  publish_packet_t packet;
-  uint16_t stopic = 0x0000;
-  uint8_t data_len = strlen(message);
+resp_con_t mqtt_sn_pub_coalesce(mqtt_sn_client_t *client, char *topic, char *sample, bool retain_flag, int8_t qos, mqtt_sn_prio_t prio){
+  mqtt_sn_coalesce_t *c = NULL;
+  size_t sample_len, i;
 
-  // if (mqtt_queue_first->data.msg_type_q != MQTT_SN_TYPE_PUBLISH) {
-  //   debug_mqtt("Erro: Pacote a processar nao e do tipo PUBLISH");
-  //   return FAIL_CON;
-  // }
-  size_t i = 0;
-  for (i=0; i < MAX_TOPIC_USED; i++)
-    if (strcmp(g_topic_bind[i].topic_name,topic) == 0) {
-      stopic = g_topic_bind[i].short_topic_id;
+  if (topic == NULL || sample == NULL)
+    return FAIL_CON;
+
+  sample_len = strlen(sample);
+  // Amostra que sozinha excede o orçamento segue sem agrupamento
+  if (sample_len > MQTT_SN_COALESCE_BUDGET)
+    return mqtt_sn_pub(client, topic, sample, retain_flag, qos, prio);
+
+  for (i = 0; i < MQTT_SN_COALESCE_TOPICS; i++)
+    if (client->coalesce[i].topic != NULL && strcmp(client->coalesce[i].topic, topic) == 0) {
+      c = &client->coalesce[i];
       break;
     }
 
-  if (data_len > sizeof(packet.data)) {
-      printf("Erro: Payload e muito grande!\n");
+  if (c == NULL) {
+    for (i = 0; i < MQTT_SN_COALESCE_TOPICS; i++)
+      if (client->coalesce[i].topic == NULL) {
+        c = &client->coalesce[i];
+        break;
+      }
+    if (c == NULL)
+      return mqtt_sn_pub(client, topic, sample, retain_flag, qos, prio);
+    c->client = client;
+    c->topic = topic;
+    c->len = 0;
+  }
+
+  // Mudança de QoS/retain/classe ou orçamento estourado: envia o que já foi acumulado.
+  // Se o envio falhar o buffer é mantido para o timeout_coalesce e a nova
+  // amostra é recusada
+  if (c->len > 0 &&
+      (c->qos != qos || c->retain != retain_flag || c->prio != prio ||
+       c->len + 1 + sample_len > MQTT_SN_COALESCE_BUDGET)) {
+    if (!mqtt_sn_coalesce_send(client, c)) {
+      debug_mqtt("Amostra recusada, buffer agrupado pendente:[%s][%d]",topic,c->len);
       return FAIL_CON;
+    }
+    c->topic = topic;
   }
 
-  packet.type  = MQTT_SN_TYPE_PUBLISH;
-  packet.flags = 0x00;
+  c->retain = retain_flag;
+  c->qos = qos;
+  c->prio = prio;
+  if (c->len > 0)
+    c->data[c->len++] = MQTT_SN_COALESCE_SEP;
+  memcpy(&c->data[c->len], sample, sample_len);
+  c->len += sample_len;
+
+  // A janela começa na primeira amostra do buffer
+  if (ctimer_expired(&c->timer))
+    ctimer_set(&c->timer, MQTT_SN_COALESCE_WINDOW, timeout_coalesce, c);
+  return SUCCESS_CON;
+}
 
-  if (retain_flag)
-    packet.flags += MQTT_SN_FLAG_RETAIN;
+void mqtt_sn_coalesce_flush(mqtt_sn_client_t *client){
+  size_t i;
 
-  packet.flags += mqtt_sn_get_qos_flag(qos);
+  for (i = 0; i < MQTT_SN_COALESCE_TOPICS; i++)
+    if (client->coalesce[i].topic != NULL)
+      mqtt_sn_coalesce_send(client, &client->coalesce[i]);
+}
 
-  // Segundo a especificação:
-  // TopicIdType: indicates whether the field TopicId or TopicName included in this message contains a normal
-  // topic id (set to “0b00”), a pre-defined topic id (set to “0b01”), or a short topic name (set to “0b10”). The
-  // value “0b11” is reserved. Refer to sections 3 and 6.7 for the definition of the various types of topic ids.
-  packet.flags += MQTT_SN_TOPIC_TYPE_NORMAL; //Utiliza-se o topic id já registrado
+resp_con_t mqtt_sn_sub_short(mqtt_sn_client_t *client, char *topic, uint8_t qos){
+  if (topic == NULL || strlen(topic) != 2) {
+    debug_mqtt("Erro: Short topic name deve ter 2 caracteres");
+    return FAIL_CON;
+  }
 
-  packet.topic_id = uip_htons(stopic);
-  packet.message_id = uip_htons(0x00); //Relevante somente se QoS > 0
-  strncpy(packet.data, message, data_len+1);
-  //
-  //  Pacote PUBLISH
-  //  _________________ ______________________ ___________ ________________ ______________ ________________
-  // | Comprimento - 0 | Tipo de mensagem - 1 | Flags - 2 | Topic ID - 3,4 | Msg ID - 5,6 | Dado - 7,n ....|
-  // |_________________|______________________|___________ ________________|______________|________________|
-  //
-  packet.length = 0x07 + (data_len+1);
+  if (mqtt_sn_topic_bind_short(client, topic) < 0)
+    return FAIL_CON;
 
-  debug_mqtt("Enviando o pacote @PUBLISH");
-  // debug_mqtt("Enviando o pacote @PUBLISH - Task:[%d]",(int)mqtt_queue_first->data.id_task);
-  simple_udp_send(&g_mqtt_sn_con.udp_con,&packet, packet.length);
-  return SUCCESS_CON;
+  return mqtt_sn_sub(client, topic, qos);
+}
+
+resp_con_t verf_hist_sub(mqtt_sn_client_t *client, char *topic){
+  int16_t i = mqtt_sn_topic_find(client, topic);
+
+  if (i < 0) {
+    debug_mqtt("Topico nao registrado!");
+    return FAIL_CON;
+  }
+
+  if (client->topic_bind[i].subscribed == 0x01){  // Na fila para inscrever? 0x01?
+    debug_mqtt("Inscricao do topico em andamento:[%s]",client->topic_bind[i].topic_name);
+    return FAIL_CON;
+  }
+  else if (client->topic_bind[i].subscribed == 0x02) {  // Já inscrito? 0x02?
+    debug_mqtt("Topico inscrito:[%s]",client->topic_bind[i].topic_name);
+    return FAIL_CON;
+  }
+  else if (client->topic_bind[i].subscribed == 0x00){  // Caso topic_bind[i].subscribed == 0x00 vamos preparar o topico para ser inscrito
+    client->topic_bind[i].subscribed = 0x01;
+    debug_mqtt("Preparando para inscricao:[%s]",client->topic_bind[i].topic_name);
+    return SUCCESS_CON;
+  }
+  else{
+    debug_mqtt("Topico com valor estranho no SUBSCRIBED:%d",client->topic_bind[i].subscribed);
+    return FAIL_CON;
+  }
+
+}
+
+resp_con_t verf_register(mqtt_sn_client_t *client, char *topic){
+  if (mqtt_sn_topic_find(client, topic) >= 0)  // Tópico novo ou existe?
+    return SUCCESS_CON;
+
+  debug_mqtt("Topico nao registrado!");
+  return FAIL_CON;
+}
+
+void print_g_topics(mqtt_sn_client_t *client){
+  size_t i;
+  debug_mqtt("Vetor de topicos");
+  for(i = 0 ; i < MAX_TOPIC_USED && client->topic_bind[i].short_topic_id != MQTT_SN_TOPIC_ID_NONE; i++) {
+    debug_mqtt("[i=%d][%d][%s]",(int)i,client->topic_bind[i].short_topic_id,client->topic_bind[i].topic_name);
+  }
+}
+
+void init_vectors(mqtt_sn_client_t *client){
+  debug_mqtt("Inicializando vetores...");
+  size_t i;
+  for (i = 1; i < MAX_TOPIC_USED; i++){
+    // Inscrições a refazer após o CONNECT com CLEAN (mqtt_sn_session_clean)
+    if (client->topic_bind[i].subscribed == 0x03)
+      continue;
+    client->topic_bind[i].short_topic_id = MQTT_SN_TOPIC_ID_NONE;
+    client->topic_bind[i].topic_name = 0;
+    client->topic_bind[i].subscribed = 0x00;
+    client->topic_bind[i].topic_type = MQTT_SN_TOPIC_TYPE_NORMAL;
+  }
+  memset(client->topic_hash, 0, sizeof(client->topic_hash));
+  memset(client->topic_id_hash, 0, sizeof(client->topic_id_hash));
+  memset(client->reg_window, 0, sizeof(client->reg_window));
+  memset(client->sub_window, 0, sizeof(client->sub_window));
+
+  client->topic_name_pool_len = 0;
+
+  while (!mqtt_sn_check_empty(client))
+      mqtt_sn_delete_queue(client);
+  client->task_id = 0;
+}
+
+/******************** FUNÇÕES DE ENVIO DE PACOTES MQTT-SN *********************/
+// Os pacotes são montados diretamente na área de dados UDP do uip_buf, onde o
+// simple_udp_send os copiaria. O ganho é apenas não manter um buffer de
+// montagem à parte (RAM), a cópia do uIP ainda percorre o pacote. Origem e
+// destino coincidem, o que só é seguro porque o uip_udp_packet_send do
+// Contiki 3.x copia com memmove; outra pilha que use memcpy exige um buffer
+// próprio aqui [Apontamento n-3].
+static void *mqtt_sn_tx_buf(void){
+  return &uip_buf[UIP_LLH_LEN + UIP_IPUDPH_LEN];
+}
+
+static bool mqtt_sn_tx_fits(size_t len){
+  if (len > MQTT_SN_MAX_PACKET_LENGTH ||
+      len > UIP_BUFSIZE - (UIP_LLH_LEN + UIP_IPUDPH_LEN)) {
+    debug_mqtt("Erro: Pacote de %d bytes excede o buffer de envio",(int)len);
+    return false;
+  }
+  return true;
+}
+
+static void mqtt_sn_tx_send(mqtt_sn_client_t *client, uint8_t len){
+  simple_udp_sendto(&client->con.udp_con, mqtt_sn_tx_buf(), len, &client->gw_addr);
+  client->last_tx = clock_time();
+}
+
+/*********************** ESTIMATIVA DE RTT E TIMEOUTS *************************/
+// Estimador de Jacobson/Karels (RFC 6298) em ticks do clock, com SRTT e RTTVAR
+// em ponto fixo (x8 e x4). Pela regra de Karn somente respostas a pacotes
+// enviados uma única vez geram amostra, quem chama verifica as tentativas.
+static void mqtt_sn_rtt_sample(mqtt_sn_client_t *client, clock_time_t sent_at){
+  int32_t m = (clock_time_t)(clock_time() - sent_at);
+  uint32_t rto;
+
+  if (m <= 0)
+    m = 1;
+  if (m > MQTT_SN_RTO_MAX)
+    m = MQTT_SN_RTO_MAX;
+
+  if (client->srtt == 0) {
+    client->srtt = m << 3;   // SRTT = R
+    client->rttvar = m << 1; // RTTVAR = R/2
+  }
+  else {
+    m -= (client->srtt >> 3);
+    client->srtt += m;       // SRTT = 7/8 SRTT + 1/8 R
+    if (m < 0)
+      m = -m;
+    m -= (client->rttvar >> 2);
+    client->rttvar += m;     // RTTVAR = 3/4 RTTVAR + 1/4 |SRTT - R|
+  }
+
+  // RTO = SRTT + 4*RTTVAR, o RTTVAR armazenado já está multiplicado por 4
+  rto = (client->srtt >> 3) + (client->rttvar > 0 ? client->rttvar : 1);
+  if (rto < MQTT_SN_RTO_MIN)
+    rto = MQTT_SN_RTO_MIN;
+  if (rto > MQTT_SN_RTO_MAX)
+    rto = MQTT_SN_RTO_MAX;
+  client->rto = rto;
+}
+
+static clock_time_t mqtt_sn_rto(mqtt_sn_client_t *client, uint8_t tries){
+  uint32_t rto = client->rto;
+
+  // Backoff exponencial a cada retransmissão do mesmo pacote
+  while (tries-- > 0 && rto < MQTT_SN_RTO_MAX)
+    rto <<= 1;
+  if (rto > MQTT_SN_RTO_MAX)
+    rto = MQTT_SN_RTO_MAX;
+
+  // Jitter de até 1/4 evita que nós que perderam o mesmo pacote (ex.: queda
+  // do gateway) retransmitam ao mesmo tempo
+  rto += random_rand() % ((rto >> 2) + 1);
+  return rto;
+}
+
+/*************************** GATEWAYS CANDIDATOS *****************************/
+// Configurados (ipv6_broker e ipv6_gateways) ou descobertos. Na descoberta os
+// gateways respondem ao SEARCHGW (multicast) com GWINFO unicast, cujo atraso
+// dá o RTT. O hop limit do GWINFO é guardado como recebido: o hop limit
+// inicial de cada gateway não é conhecido, então apenas a diferença para o
+// maior recebido entre os candidatos é penalizada, supondo o mesmo valor
+// inicial em todos. Os conhecidos somente por ADVERTISE ou configuração entram
+// sem essas medidas e são avaliados pelo RTO atual. Falhas seguidas têm
+// precedência sobre as medidas.
+static void mqtt_sn_ipv6_addr(uip_ipaddr_t *addr, const uint16_t *ipv6){
+  uip_ip6addr(addr, ipv6[0], ipv6[1], ipv6[2], ipv6[3],
+                    ipv6[4], ipv6[5], ipv6[6], ipv6[7]);
+}
+
+static clock_time_t mqtt_sn_gw_score(mqtt_sn_client_t *client, uint8_t i, uint8_t max_hop_limit){
+  clock_time_t score;
+
+  score = client->gw[i].rtt ? client->gw[i].rtt : client->rto;
+  if (client->gw[i].hop_limit != MQTT_SN_GW_HOP_LIMIT_UNKNOWN)
+    score += (clock_time_t)(max_hop_limit - client->gw[i].hop_limit) * MQTT_SN_GW_HOP_COST;
+  return score;
+}
+
+#ifdef MQTT_SN_PERSISTENT_SESSION
+static void mqtt_sn_gw_topics_drop(mqtt_sn_client_t *client, int8_t gw){
+  uint8_t i;
+
+  for (i = 0; i < MQTT_SN_GW_TOPICS; i++)
+    if (client->gw_topics[i].gw == gw)
+      client->gw_topics[i].topic_name = NULL;
+}
+
+static void mqtt_sn_gw_topics_save(mqtt_sn_client_t *client, uint16_t pos){
+  mqtt_sn_gw_topic_t *e, *slot = NULL;
+  uint8_t i;
+
+  if (client->gw_current < 0 ||
+      client->topic_bind[pos].topic_type != MQTT_SN_TOPIC_TYPE_NORMAL)
+    return;
+
+  // Posição livre tem preferência sobre a de outro gateway, os topic ids do
+  // gateway em uso nunca são descartados por falta de espaço
+  for (i = 0; i < MQTT_SN_GW_TOPICS; i++) {
+    e = &client->gw_topics[i];
+    if (e->topic_name != NULL && e->gw == client->gw_current) {
+      if (strcmp(e->topic_name, client->topic_bind[pos].topic_name) == 0) {
+        e->topic_id = client->topic_bind[pos].short_topic_id;
+        return;
+      }
+    }
+    else if (slot == NULL || (slot->topic_name != NULL && e->topic_name == NULL))
+      slot = e;
+  }
+  if (slot == NULL) {
+    debug_mqtt("Tabela de topic ids por gateway cheia");
+    return;
+  }
+  slot->topic_name = client->topic_bind[pos].topic_name;
+  slot->topic_id = client->topic_bind[pos].short_topic_id;
+  slot->gw = client->gw_current;
+}
+
+static uint16_t mqtt_sn_gw_topics_load(mqtt_sn_client_t *client){
+  uint16_t loaded = 0;
+  int16_t pos;
+  uint8_t i;
+
+  // Somente tópicos presentes em topic_bind e ainda sem topic id
+  for (i = 0; i < MQTT_SN_GW_TOPICS; i++) {
+    if (client->gw_topics[i].topic_name == NULL ||
+        client->gw_topics[i].gw != client->gw_current)
+      continue;
+    pos = mqtt_sn_topic_find(client, client->gw_topics[i].topic_name);
+    if (pos < 0 ||
+        client->topic_bind[pos].topic_type != MQTT_SN_TOPIC_TYPE_NORMAL ||
+        client->topic_bind[pos].short_topic_id != MQTT_SN_TOPIC_ID_NONE)
+      continue;
+    mqtt_sn_topic_set_id(client, pos, client->gw_topics[i].topic_id);
+    loaded++;
+  }
+  debug_mqtt("Topic ids recuperados da RAM:[%d]",loaded);
+  return loaded;
+}
+#endif
+
+static void mqtt_sn_gw_update(mqtt_sn_client_t *client, const uip_ipaddr_t *addr, uint8_t gw_id, uint8_t hop_limit, clock_time_t rtt, uint16_t duration){
+  uint8_t i, oldest = 0;
+
+  for (i = 0; i < client->gw_len; i++)
+    if (uip_ipaddr_cmp(&client->gw[i].addr, addr))
+      break;
+
+  if (i == client->gw_len) {
+    if (client->gw_len < MQTT_SN_GW_MAX)
+      client->gw_len++;
+    else {
+      // Tabela cheia: substitui o gateway ouvido há mais tempo, exceto o atual
+      for (i = 0; i < client->gw_len; i++)
+        if (i != client->gw_current &&
+            (oldest == client->gw_current ||
+             (clock_time_t)(client->gw[oldest].last_seen - client->gw[i].last_seen) < (clock_time_t)~0 / 2))
+          oldest = i;
+      if (oldest == client->gw_current)
+        return;
+      i = oldest;
+    }
+#ifdef MQTT_SN_PERSISTENT_SESSION
+    // Posição reaproveitada por outro gateway, os topic ids antigos não valem
+    mqtt_sn_gw_topics_drop(client, i);
+#endif
+    uip_ipaddr_copy(&client->gw[i].addr, addr);
+    client->gw[i].rtt = 0;
+    client->gw[i].hop_limit = MQTT_SN_GW_HOP_LIMIT_UNKNOWN;
+    client->gw[i].duration = 0;
+    client->gw[i].fails = 0;
+  }
+
+  client->gw[i].gw_id = gw_id;
+  client->gw[i].last_seen = clock_time();
+  if (hop_limit != MQTT_SN_GW_HOP_LIMIT_UNKNOWN)
+    client->gw[i].hop_limit = hop_limit;
+  if (duration)
+    client->gw[i].duration = duration;
+  // RTT suavizado entre buscas (3/4 anterior + 1/4 nova amostra)
+  if (rtt)
+    client->gw[i].rtt = client->gw[i].rtt ? (3 * client->gw[i].rtt + rtt) >> 2 : rtt;
+}
+
+static bool mqtt_sn_gw_select(mqtt_sn_client_t *client){
+  int8_t best = -1;
+  uint8_t i, max_hop_limit = 0;
+
+  for (i = 0; i < client->gw_len; i++)
+    if (client->gw[i].hop_limit > max_hop_limit)
+      max_hop_limit = client->gw[i].hop_limit;
+
+  for (i = 0; i < client->gw_len; i++)
+    if (best < 0 || client->gw[i].fails < client->gw[best].fails ||
+        (client->gw[i].fails == client->gw[best].fails &&
+         mqtt_sn_gw_score(client, i, max_hop_limit) < mqtt_sn_gw_score(client, best, max_hop_limit)))
+      best = i;
+  if (best < 0)
+    return false;
+
+  client->gw_current = best;
+  uip_ipaddr_copy(&client->gw_addr, &client->gw[best].addr);
+  debug_mqtt("Gateway selecionado:[%d] RTT:[%d] hop limit:[%d]",
+             client->gw[best].gw_id,(int)client->gw[best].rtt,client->gw[best].hop_limit);
+  uip_debug_ipaddr_print(&client->gw_addr);
+
+  // O RTT do GWINFO inicia o estimador, evitando o CONNECT com o RTO inicial
+  if (client->srtt == 0 && client->gw[best].rtt)
+    mqtt_sn_rtt_sample(client, clock_time() - client->gw[best].rtt);
+  return true;
+}
+
+static void mqtt_sn_gw_configured(mqtt_sn_client_t *client){
+  uip_ipaddr_t addr;
+  uint8_t i;
+
+  // Ordem de preferência entre os não medidos: ipv6_broker e os reservas
+  if (client->con.ipv6_broker) {
+    mqtt_sn_ipv6_addr(&addr, client->con.ipv6_broker);
+    mqtt_sn_gw_update(client, &addr, 0, MQTT_SN_GW_HOP_LIMIT_UNKNOWN, 0, 0);
+  }
+  for (i = 0; client->con.ipv6_gateways && i < client->con.gateways_len; i++) {
+    mqtt_sn_ipv6_addr(&addr, client->con.ipv6_gateways[i]);
+    mqtt_sn_gw_update(client, &addr, 0, MQTT_SN_GW_HOP_LIMIT_UNKNOWN, 0, 0);
+  }
+}
+
+static bool mqtt_sn_gw_failover(mqtt_sn_client_t *client){
+  int8_t failed = client->gw_current;
+
+  // Somente gateway em silêncio: sessão perdida ou DISCONNECT do próprio
+  // gateway reconectam no mesmo, que acabou de responder
+  if (failed < 0 || (clock_time_t)(clock_time() - client->last_rx) <= client->rto)
+    return false;
+  if (client->gw[failed].fails < 0xFF)
+    client->gw[failed].fails++;
+  if (client->gw_len < 2)
+    return false;
+
+#ifdef MQTT_SN_TOPIC_CACHE
+  // Topic ids do gateway perdido ficam na flash para uma volta futura
+  mqtt_sn_cache_save(client);
+#endif
+  // Outro caminho na malha: o estimador de RTT recomeça
+  client->srtt = 0;
+  client->rttvar = 0;
+  client->rto = MQTT_SN_TIMEOUT_CONNECT;
+  mqtt_sn_gw_select(client);
+  if (client->gw_current == failed)
+    return false;
+
+  // Topic ids do gateway anterior não valem no novo, a sessão só é retomada
+  // se os topic ids do novo gateway forem recuperados da RAM (gw_topics) ou
+  // do cache em flash (mqtt_sn_session_start)
+  debug_mqtt("Failover para o gateway:[%d]",client->gw_current);
+  client->clean_session = true;
+  client->session_resumed = false;
+  client->gw_switched = true;
+  return true;
+}
+
+#ifdef MQTT_SN_GW_DISCOVERY
+static void mqtt_sn_gw_recv(mqtt_sn_client_t *client, const uip_ipaddr_t *sender, const uint8_t *data){
+  clock_time_t rtt = 0;
+  uint8_t hop_limit = MQTT_SN_GW_HOP_LIMIT_UNKNOWN;
+
+  switch (data[1]) {
+    case MQTT_SN_TYPE_GWINFO:
+      // GWINFO com GwAdd é a resposta de outro cliente em nome do gateway, sem
+      // medidas do próprio gateway, portanto ignorada
+      if (data[0] != 3)
+        break;
+      if (client->gw_search_at != 0) {
+        rtt = clock_time() - client->gw_search_at;
+        if (rtt == 0)
+          rtt = 1;
+      }
+      hop_limit = UIP_IP_BUF->ttl;
+      debug_mqtt("GWINFO recebido:[%d] RTT:[%d] hop limit:[%d]",data[2],(int)rtt,hop_limit);
+      mqtt_sn_gw_update(client, sender, data[2], hop_limit, rtt, 0);
+    break;
+    case MQTT_SN_TYPE_ADVERTISE:
+      if (data[0] < 5)
+        break;
+      debug_mqtt("ADVERTISE recebido:[%d]",data[2]);
+      mqtt_sn_gw_update(client, sender, data[2], hop_limit, 0, ((uint16_t)data[3] << 8) | data[4]);
+    break;
+    default:
+      // SEARCHGW de outros clientes: respostas em nome do gateway não suportadas
+    break;
+  }
+}
+
+static void mqtt_sn_gw_search_send(mqtt_sn_client_t *client){
+  static const uint16_t mcast[] = MQTT_SN_GW_SEARCH_ADDR;
+  searchgw_packet_t *packet = mqtt_sn_tx_buf();
+  uip_ipaddr_t addr;
+
+  uip_ip6addr(&addr, mcast[0], mcast[1], mcast[2], mcast[3],
+                     mcast[4], mcast[5], mcast[6], mcast[7]);
+  packet->length = 0x03;
+  packet->msg_type = MQTT_SN_TYPE_SEARCHGW;
+  packet->radius = MQTT_SN_GW_RADIUS;
+  simple_udp_sendto(&client->con.udp_con, packet, packet->length, &addr);
+  client->gw_search_at = clock_time();
+  debug_mqtt("SEARCHGW enviado");
+}
+
+static void mqtt_sn_gw_discover(mqtt_sn_client_t *client){
+  // Atraso aleatório antes do primeiro SEARCHGW (TSEARCHGW da especificação)
+  // evita a rajada de buscas quando vários nós reiniciam juntos
+  client->gw_current = -1;
+  client->gw_tries = 0;
+  client->gw_search_at = 0;
+  ctimer_set(&client->time_gw, 1 + random_rand() % MQTT_SN_GW_SEARCH_JITTER, timeout_gw_search, client);
+}
+#endif
+
+resp_con_t mqtt_sn_will_topic_send(mqtt_sn_client_t *client){
+  willtopic_packet_t *packet = mqtt_sn_tx_buf();
+
+  size_t topic_name_len = strlen(client->con.will_topic);
+
+  if (topic_name_len > MQTT_SN_MAX_TOPIC_LENGTH || !mqtt_sn_tx_fits(0x04 + topic_name_len)) {
+    debug_mqtt("Erro: Nome do topico WILL excede o limite maximo");
+    return FAIL_CON;
+  }
+
+  packet->flags = MQTT_SN_FLAG_RETAIN;
+
+  packet->type = MQTT_SN_TYPE_WILLTOPIC;
+
+  memcpy(packet->will_topic, client->con.will_topic, topic_name_len);
+  packet->length = 0x03 + topic_name_len;
+  packet->will_topic[topic_name_len] = '\0';
+
+  debug_mqtt("Enviando o pacote @WILL TOPIC");
+  mqtt_sn_tx_send(client, packet->length);
+
+  return SUCCESS_CON;
+}
+
+resp_con_t mqtt_sn_will_message_send(mqtt_sn_client_t *client){
+  willmessage_packet_t *packet = mqtt_sn_tx_buf();
+
+  size_t message_name_len = strlen(client->con.will_message);
+
+  if (message_name_len > MQTT_SN_MAX_TOPIC_LENGTH || !mqtt_sn_tx_fits(0x03 + message_name_len)) {
+    debug_mqtt("Erro: Nome da mensagem WILL excede o limite maximo");
+    return FAIL_CON;
+  }
+
+  packet->type = MQTT_SN_TYPE_WILLMSG;
+
+  memcpy(packet->will_message, client->con.will_message, message_name_len);
+  packet->length = 0x02 + message_name_len;
+  packet->will_message[message_name_len] = '\0';
+
+  debug_mqtt("Enviando o pacote @WILL MESSAGE");
+  mqtt_sn_tx_send(client, packet->length);
+  // Com LWT o CONNACK responde ao WILLMSG
+  client->connect_sent_at = clock_time();
+
+  return SUCCESS_CON;
+}
+
+void mqtt_sn_ping_send(mqtt_sn_client_t *client){
+  ping_req_t *ping_request = mqtt_sn_tx_buf();
+  size_t client_id_len = strlen(client->con.client_id);
+
+  ping_request->msg_type = MQTT_SN_TYPE_PINGREQ;
+  memcpy(ping_request->client_id, client->con.client_id, client_id_len);
+  ping_request->client_id[client_id_len] = '\0';
+  //debug_mqtt("Client ID PING:%s",ping_request->client_id);
+  ping_request->length = 0x02 + client_id_len;
+  //debug_mqtt("Enviando @PINGREQ");
+  mqtt_sn_tx_send(client, ping_request->length);
+}
+
+resp_con_t mqtt_sn_con_send(mqtt_sn_client_t *client){
+  connect_packet_t *packet = mqtt_sn_tx_buf();
+  size_t client_id_len = strlen(client->con.client_id);
+
+  // Criação do pacote CONNECT
+  packet->type = MQTT_SN_TYPE_CONNECT;
+  packet->flags = 0x00;
+  if (client->clean_session)
+    packet->flags += MQTT_SN_FLAG_CLEAN;
+  if (client->will)
+    packet->flags += MQTT_SN_FLAG_WILL;
+  packet->protocol_id = MQTT_SN_PROTOCOL_ID;
+  packet->duration = uip_htons(client->con.keep_alive); //Realiza a conversão para network byte order
+
+  memcpy(packet->client_id, client->con.client_id, client_id_len);
+  packet->client_id[client_id_len] = '\0';
+  packet->length = 0x06 + client_id_len;
+
+  // debug_mqtt("CLIENT_ID:%s, Tamanho:%d",packet->client_id,client_id_len);
+  debug_mqtt("Enviando o pacote @CONNECT ");
+  mqtt_sn_tx_send(client, packet->length);
+  client->connect_sent_at = clock_time();
+  // debug_mqtt("enviado!");
+  return SUCCESS_CON;
+}
+
+static uint16_t mqtt_sn_next_msg_id(mqtt_sn_client_t *client){
+  // O message id 0x0000 é reservado para QoS 0 e -1
+  if (++client->msg_id == 0x0000)
+    client->msg_id = 0x0001;
+  return client->msg_id;
+}
+
+static mqtt_sn_reg_req_t *mqtt_sn_reg_find(mqtt_sn_client_t *client, uint16_t msg_id, uint16_t pos){
+  uint8_t i;
+
+  // Busca pelo message id (REGACK) ou, com msg_id 0x0000, pela posição do
+  // tópico entre os REGISTERs pendentes
+  for (i = 0; i < MQTT_SN_REG_WINDOW; i++) {
+    if (client->reg_window[i].message_id == 0x0000)
+      continue;
+    if (msg_id != 0x0000 ? client->reg_window[i].message_id == msg_id : client->reg_window[i].pos == pos)
+      return &client->reg_window[i];
+  }
+  return NULL;
+}
+
+static mqtt_sn_reg_req_t *mqtt_sn_reg_free(mqtt_sn_client_t *client){
+  uint8_t i;
+
+  for (i = 0; i < MQTT_SN_REG_WINDOW; i++)
+    if (client->reg_window[i].message_id == 0x0000)
+      return &client->reg_window[i];
+  return NULL;
+}
+
+static resp_con_t mqtt_sn_reg_encode(mqtt_sn_client_t *client, mqtt_sn_reg_req_t *req){
+  register_packet_t *packet;
+  size_t topic_name_len = strlen(client->topic_bind[req->pos].topic_name);
+
+  if (topic_name_len > MQTT_SN_MAX_TOPIC_LENGTH || !mqtt_sn_tx_fits(0x07 + topic_name_len)) {
+    debug_mqtt("Erro: Nome do topico excede o limite maximo");
+    return FAIL_CON;
+  }
+
+  packet = mqtt_sn_tx_buf();
+  packet->type = MQTT_SN_TYPE_REGISTER;
+  packet->topic_id = 0x0000;
+
+  // O REGACK traz o mesmo message id, que leva à entrada da janela e dela
+  // à posição do tópico no vetor global topic_bind[]
+  packet->message_id = uip_htons(req->message_id);
+
+  memcpy(packet->topic_name, client->topic_bind[req->pos].topic_name, topic_name_len);
+  packet->length = 0x06 + topic_name_len;
+  packet->topic_name[topic_name_len] = '\0';
+
+  debug_mqtt("Topico a registrar:%s [%d][MSG_ID:%d]",packet->topic_name,(int)topic_name_len,(int)req->message_id);
+  debug_mqtt("Enviando o pacote @REGISTER");
+  mqtt_sn_tx_send(client, packet->length);
+
+  req->sent_at = clock_time();
+  req->timeout = mqtt_sn_rto(client, req->tries);
+  return SUCCESS_CON;
+}
+
+resp_con_t mqtt_sn_reg_send(mqtt_sn_client_t *client){
+  mqtt_sn_reg_req_t *req = mqtt_sn_reg_free(client);
+  size_t i = 0;
+
+  if (mqtt_sn_check_empty(client) || client->queue_first->msg_type_q != MQTT_SN_TYPE_REGISTER) {
+    debug_mqtt("Erro: Pacote a processar nao e do tipo REGISTER");
+    return FAIL_CON;
+  }
+
+  if (req == NULL)
+    return FAIL_CON; // Janela de REGISTER cheia
+
+  // Próximo tópico sem topic id que ainda não está na janela. A busca
+  // continua de onde parou, logo um tópico abandonado após MQTT_SN_RETRY
+  // tentativas não é escolhido de novo na mesma sessão
+  for (i = client->reg_next; i < MAX_TOPIC_USED; i++)
+    if (client->topic_bind[i].short_topic_id == MQTT_SN_TOPIC_ID_NONE &&
+        client->topic_bind[i].topic_name != NULL &&
+        mqtt_sn_reg_find(client, 0x0000, i) == NULL)
+      break;
+
+  if (i >= MAX_TOPIC_USED)
+    return FAIL_CON;
+  client->reg_next = i + 1;
+
+  req->pos = i;
+  req->tries = 0;
+  req->message_id = mqtt_sn_next_msg_id(client);
+  if (!mqtt_sn_reg_encode(client, req)) {
+    req->message_id = 0x0000;
+    return FAIL_CON;
+  }
+  return SUCCESS_CON;
+}
+
+uint8_t mqtt_sn_reg_fill(mqtt_sn_client_t *client){
+  uint8_t sent = 0;
+
+  while (mqtt_sn_reg_send(client))
+    sent++;
+  return sent;
+}
+
+static resp_con_t mqtt_sn_reg_resend(mqtt_sn_client_t *client){
+  uint8_t i, pending = 0, failed = 0;
+
+  // Gateway inacessível: todos os REGISTERs pendentes esgotaram as
+  // tentativas juntos, a janela é mantida para a reconexão
+  for (i = 0; i < MQTT_SN_REG_WINDOW; i++) {
+    if (client->reg_window[i].message_id == 0x0000)
+      continue;
+    pending++;
+    if (client->reg_window[i].tries >= MQTT_SN_RETRY &&
+        (clock_time_t)(clock_time() - client->reg_window[i].sent_at) >= client->reg_window[i].timeout)
+      failed++;
+  }
+  if (pending > 0 && failed == pending)
+    return FAIL_CON;
+
+  // Cada REGISTER possui seu próprio prazo e contador de tentativas, um
+  // REGACK perdido não provoca o reenvio dos demais
+  for (i = 0; i < MQTT_SN_REG_WINDOW; i++) {
+    if (client->reg_window[i].message_id == 0x0000 ||
+        (clock_time_t)(clock_time() - client->reg_window[i].sent_at) < client->reg_window[i].timeout)
+      continue;
+    if (client->reg_window[i].tries >= MQTT_SN_RETRY) {
+      // Somente este tópico fica sem topic id (novo REGISTER na próxima
+      // sessão). A tarefa é removida como em um REGACK e a posição da
+      // janela passa ao próximo tópico da fila
+      debug_mqtt("Limite maximo de pacotes REGISTER:[%s]",client->topic_bind[client->reg_window[i].pos].topic_name);
+      client->reg_window[i].message_id = 0x0000;
+      process_post(&mqtt_sn_main, mqtt_event_regack, client);
+      continue;
+    }
+    debug_mqtt("Expirou tempo de REGISTER:[%d]",client->reg_window[i].message_id);
+    client->reg_window[i].tries++;
+    mqtt_sn_reg_encode(client, &client->reg_window[i]);
+  }
+  return SUCCESS_CON;
+}
+
+resp_con_t mqtt_sn_regack_recv(mqtt_sn_client_t *client, uint16_t msg_id, uint16_t topic_id){
+  mqtt_sn_reg_req_t *req;
+  uint16_t pos;
+
+  // O REGACK é correlacionado pelo message id do REGISTER
+  if (msg_id == 0x0000 || (req = mqtt_sn_reg_find(client, msg_id, 0)) == NULL)
+    return FAIL_CON;
+
+  // Regra de Karn: REGACK de REGISTER retransmitido é ambíguo e não gera amostra
+  if (req->tries == 0)
+    mqtt_sn_rtt_sample(client, req->sent_at);
+  pos = req->pos;
+  req->message_id = 0x0000;
+  mqtt_sn_topic_set_id(client, pos, topic_id);
+#ifdef MQTT_SN_PERSISTENT_SESSION
+  mqtt_sn_gw_topics_save(client, pos);
+#endif
+#ifdef MQTT_SN_TOPIC_CACHE
+  client->cache_dirty = true;
+#endif
+  return SUCCESS_CON;
+}
+
+resp_con_t mqtt_sn_regack_send(mqtt_sn_client_t *client, uint16_t msg_id, uint16_t topic_id){
+  regack_packet_t *packet = mqtt_sn_tx_buf();
+
+  packet->type = MQTT_SN_TYPE_REGACK;
+  packet->topic_id = uip_htons(topic_id);
+  packet->message_id = uip_htons(msg_id);
+  packet->return_code = 0x00;
+  packet->length = 0x07;
+
+  debug_mqtt("Enviando o pacote @REGACK");
+  mqtt_sn_tx_send(client, packet->length);
+  return SUCCESS_CON;
+}
+
+resp_con_t mqtt_sn_pub_send(mqtt_sn_client_t *client, char *topic,char *message, bool retain_flag, int8_t qos){
+  int16_t i = mqtt_sn_topic_find(client, topic);
+
+  if (i < 0)
+    return FAIL_CON;
+
+  return mqtt_sn_pub_send_id(client, client->topic_bind[i].short_topic_id,
+                             client->topic_bind[i].topic_type,
+                             message, retain_flag, qos);
+}
+
+static void mqtt_sn_pub_encode(mqtt_sn_client_t *client, uint16_t stopic, uint8_t flags, uint16_t msg_id, const uint8_t *data, uint8_t data_len){
+  publish_packet_t *packet = mqtt_sn_tx_buf();
+
+  // memmove: o payload pode ser a própria publicação recebida no uip_buf
+  memmove(packet->data, data, data_len);
+  packet->type  = MQTT_SN_TYPE_PUBLISH;
+  packet->flags = flags;
+  packet->topic_id = uip_htons(stopic);
+  packet->message_id = uip_htons(msg_id); //Relevante somente se QoS > 0
+  //
+  //  Pacote PUBLISH
+  //  _________________ ______________________ ___________ ________________ ______________ ________________
+  // | Comprimento - 0 | Tipo de mensagem - 1 | Flags - 2 | Topic ID - 3,4 | Msg ID - 5,6 | Dado - 7,n ....|
+  // |_________________|______________________|___________ ________________|______________|________________|
+  //
+  packet->length = 0x07 + data_len;
+
+  debug_mqtt("Enviando o pacote @PUBLISH");
+  mqtt_sn_tx_send(client, packet->length);
+}
+
+static void mqtt_sn_msg_id_send(mqtt_sn_client_t *client, uint8_t type, uint16_t msg_id){
+  msg_id_packet_t *packet = mqtt_sn_tx_buf();
+
+  // PUBREC, PUBREL e PUBCOMP possuem somente o message id
+  packet->type = type;
+  packet->message_id = uip_htons(msg_id);
+  packet->length = 0x04;
+
+  mqtt_sn_tx_send(client, packet->length);
+}
+
+static void mqtt_sn_puback_send(mqtt_sn_client_t *client, uint16_t topic_id, uint16_t msg_id, uint8_t rc){
+  puback_packet_t *packet = mqtt_sn_tx_buf();
+
+  packet->type = MQTT_SN_TYPE_PUBACK;
+  packet->topic_id = uip_htons(topic_id);
+  packet->message_id = uip_htons(msg_id);
+  packet->return_code = rc;
+  packet->length = 0x07;
+
+  debug_mqtt("Enviando o pacote @PUBACK");
+  mqtt_sn_tx_send(client, packet->length);
+}
+
+static mqtt_sn_qos2_t *mqtt_sn_qos2_find(mqtt_sn_client_t *client, uint16_t msg_id, uint8_t inbound){
+  size_t i;
+
+  for (i = 0; i < MQTT_SN_QOS2_MAX; i++)
+    if (client->qos2[i].message_id == msg_id &&
+        (client->qos2[i].state & MQTT_SN_QOS2_INBOUND) == inbound)
+      return &client->qos2[i];
+  return NULL;
+}
+
+static void mqtt_sn_inflight_timer_start(mqtt_sn_client_t *client){
+  if (ctimer_expired(&client->time_inflight))
+    ctimer_set(&client->time_inflight, client->rto, timeout_inflight, client);
+}
+
+static mqtt_sn_qos2_t *mqtt_sn_qos2_add(mqtt_sn_client_t *client, uint16_t msg_id, uint8_t inbound){
+  size_t i;
+
+  for (i = 0; i < MQTT_SN_QOS2_MAX; i++)
+    if (client->qos2[i].message_id == 0x0000) {
+      client->qos2[i].message_id = msg_id;
+      client->qos2[i].state = inbound;
+      mqtt_sn_inflight_timer_start(client);
+      return &client->qos2[i];
+    }
+  return NULL;
+}
+
+static resp_con_t mqtt_sn_pub_window(mqtt_sn_client_t *client, uint16_t stopic, uint8_t flags, const uint8_t *message, uint8_t data_len){
+  size_t i;
+
+  if (data_len > MQTT_SN_INFLIGHT_PAYLOAD) {
+    debug_mqtt("Erro: Payload QoS 1/2 excede MQTT_SN_INFLIGHT_PAYLOAD");
+    return FAIL_CON;
+  }
+
+  for (i = 0; i < MQTT_SN_QOS1_WINDOW; i++)
+    if (client->inflight[i].message_id == 0x0000)
+      break;
+
+  if (i == MQTT_SN_QOS1_WINDOW) {
+    debug_mqtt("Janela QoS 1/2 cheia, publicacao recusada");
+    return FAIL_CON;
+  }
+
+  // O payload é mantido na janela para retransmissão até o PUBACK (QoS 1)
+  // ou PUBREC (QoS 2)
+  client->inflight[i].message_id = mqtt_sn_next_msg_id(client);
+  client->inflight[i].topic_id   = stopic;
+  client->inflight[i].flags      = flags;
+  client->inflight[i].tries      = 0;
+  client->inflight[i].data_len   = data_len;
+  memcpy(client->inflight[i].data, message, data_len);
+
+  mqtt_sn_pub_encode(client, stopic, flags, client->inflight[i].message_id, message, data_len);
+  client->inflight[i].sent_at = clock_time();
+  client->inflight[i].timeout = mqtt_sn_rto(client, 0);
+
+  mqtt_sn_inflight_timer_start(client);
+  return SUCCESS_CON;
+}
+
+resp_con_t mqtt_sn_pub_send_id(mqtt_sn_client_t *client, uint16_t stopic, uint8_t topic_type, char *message, bool retain_flag, int8_t qos){
+  // O '\0' é enviado junto do payload
+  return mqtt_sn_pub_send_bin(client, stopic, topic_type, (const uint8_t *)message,
+                              strlen(message) + 1, retain_flag, qos);
+}
+
+resp_con_t mqtt_sn_pub_send_bin(mqtt_sn_client_t *client, uint16_t stopic, uint8_t topic_type, const uint8_t *payload, size_t data_len, bool retain_flag, int8_t qos){
+  uint8_t flags = 0x00;
+
+  if (data_len > MQTT_SN_MAX_PACKET_LENGTH-7 || !mqtt_sn_tx_fits(0x07 + data_len)) {
+      debug_mqtt("Erro: Payload e muito grande!");
+      return FAIL_CON;
+  }
+
+  if (retain_flag)
+    flags += MQTT_SN_FLAG_RETAIN;
+
+  flags += mqtt_sn_get_qos_flag(qos);
+
+  // Segundo a especificação:
+  // TopicIdType: indicates whether the field TopicId or TopicName included in this message contains a normal
+  // topic id (set to “0b00”), a pre-defined topic id (set to “0b01”), or a short topic name (set to “0b10”). The
+  // value “0b11” is reserved. Refer to sections 3 and 6.7 for the definition of the various types of topic ids.
+  flags += topic_type; //Topic id registrado, pré-definido ou short topic name
+
+  if (qos == 1 || qos == 2)
+    return mqtt_sn_pub_window(client, stopic, flags, payload, data_len);
+
+  mqtt_sn_pub_encode(client, stopic, flags, 0x0000, payload, data_len);
+  return SUCCESS_CON;
+}
+
+uint8_t mqtt_sn_pub_inflight(mqtt_sn_client_t *client){
+  uint8_t i, cnt = 0;
+
+  for (i = 0; i < MQTT_SN_QOS1_WINDOW; i++)
+    if (client->inflight[i].message_id != 0x0000)
+      cnt++;
+  return cnt;
+}
+
+void mqtt_sn_puback_recv(mqtt_sn_client_t *client, uint16_t msg_id, uint8_t rc){
+  mqtt_sn_qos2_t *entry;
+  size_t i;
+
+  for (i = 0; i < MQTT_SN_QOS1_WINDOW; i++)
+    if (client->inflight[i].message_id == msg_id && msg_id != 0x0000)
+      break;
+
+  if (i == MQTT_SN_QOS1_WINDOW) {
+    // Troca QoS 2 já na fase de PUBREL: PUBACK não faz parte dela
+    entry = mqtt_sn_qos2_find(client, msg_id, 0x00);
+    if (entry != NULL && msg_id != 0x0000) {
+      debug_mqtt("Erro de protocolo: PUBACK durante PUBREL, troca QoS 2 descartada:[%d][rc=%d]",msg_id,rc);
+      entry->message_id = 0x0000;
+      return;
+    }
+    debug_mqtt("Recebido PUBACK sem requisicao![%d]",msg_id);
+    return;
+  }
+
+  // A publicação QoS 2 espera PUBREC: um PUBACK (rejeição ou aceite
+  // indevido) encerra a troca e a publicação é descartada
+  if ((client->inflight[i].flags & MQTT_SN_FLAG_QOS_MASK) == MQTT_SN_FLAG_QOS_2) {
+    debug_mqtt("Erro de protocolo: PUBACK para publicacao QoS 2, descartada:[%d][rc=%d]",msg_id,rc);
+    client->inflight[i].message_id = 0x0000;
+    return;
+  }
+
+  switch (rc) {
+    case ACCEPTED:
+      debug_mqtt("PUBACK recebido:[%d]",msg_id);
+      if (client->inflight[i].tries == 0)
+        mqtt_sn_rtt_sample(client, client->inflight[i].sent_at);
+      client->inflight[i].message_id = 0x0000;
+    break;
+    case REJECTED_CONGESTION:
+      // Mantém na janela, a retransmissão ocorre após o próximo timeout
+      debug_mqtt("PUBACK com congestionamento, aguardando:[%d]",msg_id);
+      client->inflight[i].sent_at = clock_time();
+    break;
+    case REJECTED_INVALID_TOPIC_ID:
+      debug_mqtt("PUBACK com topic id invalido:[%d][%d]",msg_id,client->inflight[i].topic_id);
+      client->inflight[i].message_id = 0x0000;
+    break;
+    default:
+      debug_mqtt("PUBACK recusado:[%d][rc=%d]",msg_id,rc);
+      client->inflight[i].message_id = 0x0000;
+    break;
+  }
+}
+
+static resp_con_t mqtt_sn_sub_encode(mqtt_sn_client_t *client, uint16_t pos, uint8_t qos, uint16_t msg_id){
+  subscribe_packet_t *packet = mqtt_sn_tx_buf();
+
+  packet->type  = MQTT_SN_TYPE_SUBSCRIBE;
+  packet->flags = 0x00;
+
+  packet->flags += mqtt_sn_get_qos_flag(qos);
+  // O SUBACK é reconhecido pelo message id na tabela sub_window
+  packet->message_id = uip_htons(msg_id);
+  // No short topic name os dois caracteres ocupam o campo de topic id
+  packet->topic_id =  uip_htons(client->topic_bind[pos].short_topic_id);
+  if (client->topic_bind[pos].topic_type == MQTT_SN_TOPIC_TYPE_SHORT)
+    packet->flags += MQTT_SN_TOPIC_TYPE_SHORT;
+  else
+    packet->flags += MQTT_SN_TOPIC_TYPE_PREDEFINED; //Utiliza-se o topic id já registrado
+  packet->length = 0x07;
+  //
+  //  Pacote SUBSCRIBE
+  //  _________________ ______________________ ___________ ________________ _____________________________________
+  // | Comprimento - 0 | Tipo de mensagem - 1 | Flags - 2 | Msg ID - 3,4  | Topic ID - 5,6 ou Topic name 5,n ....|
+  // |_________________|______________________|___________|_______________|______________________________________|
+  //
+  debug_mqtt("Enviando o pacote @SUBSCRIBE");
+  mqtt_sn_tx_send(client, packet->length);
+  return SUCCESS_CON;
+}
+
+static resp_con_t mqtt_sn_sub_wildcard_encode(mqtt_sn_client_t *client, char *topic, uint8_t qos, uint16_t msg_id){
+  subscribe_wildcard_packet_t *packet = mqtt_sn_tx_buf();
+  size_t topic_len = strlen(topic);
+
+  if (!mqtt_sn_tx_fits(0x05 + topic_len))
+    return FAIL_CON;
+
+  packet->type  = MQTT_SN_TYPE_SUBSCRIBE;
+  packet->flags = 0x00;
+
+  packet->flags += mqtt_sn_get_qos_flag(qos);
+  packet->message_id = uip_htons(msg_id);
+  memcpy(packet->topic_name,topic,topic_len);
+  packet->flags += MQTT_SN_TOPIC_TYPE_NORMAL;
+  packet->length = 0x05+topic_len;
+
+  //
+  //  Pacote SUBSCRIBE
+  //  _________________ ______________________ ___________ ________________ _____________________________________
+  // | Comprimento - 0 | Tipo de mensagem - 1 | Flags - 2 | Msg ID - 3,4  | Topic ID - 5,6 ou Topic name 5,n ....|
+  // |_________________|______________________|___________|_______________|______________________________________|
+  //
+  debug_mqtt("Enviando o pacote @SUBSCRIBE(Wildcard)");
+  mqtt_sn_tx_send(client, packet->length);
+  return SUCCESS_CON;
+}
+
+static resp_con_t mqtt_sn_sub_req_send(mqtt_sn_client_t *client, mqtt_sn_sub_req_t *req){
+  req->sent_at = clock_time();
+  req->timeout = mqtt_sn_rto(client, req->tries);
+  if (req->wildcard != NULL)
+    return mqtt_sn_sub_wildcard_encode(client, req->wildcard, req->qos, req->message_id);
+  return mqtt_sn_sub_encode(client, req->pos, req->qos, req->message_id);
+}
+
+static mqtt_sn_sub_req_t *mqtt_sn_sub_req_free(mqtt_sn_client_t *client){
+  uint8_t i;
+
+  for (i = 0; i < MQTT_SN_SUB_WINDOW; i++)
+    if (client->sub_window[i].message_id == 0x0000)
+      return &client->sub_window[i];
+  return NULL;
+}
+
+static resp_con_t mqtt_sn_sub_req_add(mqtt_sn_client_t *client, uint16_t pos, char *wildcard, uint8_t qos){
+  mqtt_sn_sub_req_t *req = mqtt_sn_sub_req_free(client);
+
+  if (req == NULL) {
+    debug_mqtt("Tabela de SUBSCRIBE cheia");
+    return FAIL_CON;
+  }
+
+  req->pos      = pos;
+  req->wildcard = wildcard;
+  req->qos      = qos;
+  req->tries    = 0;
+  req->message_id = mqtt_sn_next_msg_id(client);
+  if (!mqtt_sn_sub_req_send(client, req)) {
+    req->message_id = 0x0000;
+    return FAIL_CON;
+  }
+
+  if (ctimer_expired(&client->time_subscribe))
+    ctimer_set(&client->time_subscribe, client->rto, timeout_subscribe, client);
+  return SUCCESS_CON;
+}
+
+resp_con_t mqtt_sn_sub_send(mqtt_sn_client_t *client, char *topic, uint8_t qos){
+  int16_t i = mqtt_sn_topic_find(client, topic);
+
+  if (i < 0)
+    return FAIL_CON;
+  return mqtt_sn_sub_req_add(client, i, NULL, qos);
+}
+
+resp_con_t mqtt_sn_sub_send_wildcard(mqtt_sn_client_t *client, char *topic, uint8_t qos){
+  return mqtt_sn_sub_req_add(client, 0, topic, qos);
+}
+
+void mqtt_sn_suback_recv(mqtt_sn_client_t *client, uint16_t msg_id, uint8_t rc){
+  uint8_t i;
+
+  for (i = 0; i < MQTT_SN_SUB_WINDOW; i++)
+    if (client->sub_window[i].message_id == msg_id && msg_id != 0x0000)
+      break;
+
+  if (i == MQTT_SN_SUB_WINDOW) {
+    debug_mqtt("Recebido SUBACK sem requisicao![%d]",msg_id);
+    return;
+  }
+
+  if (client->sub_window[i].tries == 0)
+    mqtt_sn_rtt_sample(client, client->sub_window[i].sent_at);
+
+  if (client->sub_window[i].wildcard != NULL) {
+    debug_mqtt("Recebido SUBACK de WILDCARD:[%s][rc=%d]",client->sub_window[i].wildcard,rc);
+    if (!mqtt_sn_check_rc(rc) && client->wildcard_sub == client->sub_window[i].wildcard)
+      client->wildcard_sub = NULL;
+  }
+  else if (mqtt_sn_check_rc(rc)) {
+    debug_mqtt("Reconhecimento de inscricao:[%s]",client->topic_bind[client->sub_window[i].pos].topic_name);
+    client->topic_bind[client->sub_window[i].pos].subscribed = 0x02;
+  }
+  else {
+    debug_mqtt("Inscricao recusada:[%s][rc=%d]",client->topic_bind[client->sub_window[i].pos].topic_name,rc);
+    client->topic_bind[client->sub_window[i].pos].subscribed = 0x00;
+  }
+
+  // A posição liberada pode ser ocupada pelos próximos SUBSCRIBEs da fila
+  client->sub_window[i].message_id = 0x0000;
+  process_post(&mqtt_sn_main, mqtt_event_suback, client);
+}
+
+resp_con_t mqtt_sn_disconnect_send(mqtt_sn_client_t *client, uint16_t duration){
+  disconnect_packet_t *packet = mqtt_sn_tx_buf();
+
+  packet->msg_type = MQTT_SN_TYPE_DISCONNECT;
+  packet->duration = uip_htons(duration);
+  // O campo duration só é enviado pelo cliente que vai dormir
+  packet->length = duration ? 0x04 : 0x02;
+  debug_mqtt("Desconectando do broker...");
+
+  mqtt_sn_tx_send(client, packet->length);
+  return SUCCESS_CON;
+}
+
+void mqtt_sn_pubrec_recv(mqtt_sn_client_t *client, uint16_t msg_id){
+  size_t i;
+
+  // PUBREC repetido: o PUBREL anterior se perdeu
+  if (msg_id != 0x0000 && mqtt_sn_qos2_find(client, msg_id, 0x00) != NULL) {
+    mqtt_sn_msg_id_send(client, MQTT_SN_TYPE_PUBREL, msg_id);
+    return;
+  }
+
+  for (i = 0; i < MQTT_SN_QOS1_WINDOW; i++)
+    if (client->inflight[i].message_id == msg_id && msg_id != 0x0000 &&
+        (client->inflight[i].flags & MQTT_SN_FLAG_QOS_MASK) == MQTT_SN_FLAG_QOS_2)
+      break;
+
+  if (i == MQTT_SN_QOS1_WINDOW) {
+    debug_mqtt("Recebido PUBREC sem requisicao![%d]",msg_id);
+    return;
+  }
+
+  // O broker já possui a mensagem, o payload é liberado da janela e somente
+  // o message id segue na tabela compacta até o PUBCOMP. Sem espaço na tabela
+  // a publicação permanece na janela e o PUBLISH(DUP) gera um novo PUBREC
+  if (mqtt_sn_qos2_add(client, msg_id, 0x00) == NULL) {
+    debug_mqtt("Tabela QoS 2 cheia:[%d]",msg_id);
+    return;
+  }
+  if (client->inflight[i].tries == 0)
+    mqtt_sn_rtt_sample(client, client->inflight[i].sent_at);
+  client->inflight[i].message_id = 0x0000;
+
+  debug_mqtt("Enviando o pacote @PUBREL:[%d]",msg_id);
+  mqtt_sn_msg_id_send(client, MQTT_SN_TYPE_PUBREL, msg_id);
+}
+
+void mqtt_sn_pubcomp_recv(mqtt_sn_client_t *client, uint16_t msg_id){
+  mqtt_sn_qos2_t *entry = mqtt_sn_qos2_find(client, msg_id, 0x00);
+
+  if (entry == NULL || msg_id == 0x0000) {
+    debug_mqtt("Recebido PUBCOMP sem requisicao![%d]",msg_id);
+    return;
+  }
+  debug_mqtt("PUBCOMP recebido:[%d]",msg_id);
+  entry->message_id = 0x0000;
+}
+
+void mqtt_sn_pubrel_recv(mqtt_sn_client_t *client, uint16_t msg_id){
+  mqtt_sn_qos2_t *entry = mqtt_sn_qos2_find(client, msg_id, MQTT_SN_QOS2_INBOUND);
+
+  // O PUBCOMP é enviado mesmo sem a troca na tabela (PUBREL repetido)
+  if (entry != NULL && msg_id != 0x0000)
+    entry->message_id = 0x0000;
+
+  debug_mqtt("Enviando o pacote @PUBCOMP:[%d]",msg_id);
+  mqtt_sn_msg_id_send(client, MQTT_SN_TYPE_PUBCOMP, msg_id);
+}
+
+/************************** FUNÇÕES DE FILA MQTT-SN ***************************/
+static mqtt_sn_task_t *mqtt_sn_queue_next(mqtt_sn_client_t *client){
+  uint8_t c;
+
+  // Primeira tarefa da classe mais alta com tarefas pendentes
+  for (c = MQTT_SN_PRIO_CLASSES; c-- > 0; )
+    if (client->queue[c].len > 0)
+      return &client->queue[c].task[client->queue[c].head];
+  return NULL;
+}
+
+static bool mqtt_sn_queue_busy(mqtt_sn_client_t *client, uint8_t prio){
+  uint8_t c;
+
+  for (c = prio; c < MQTT_SN_PRIO_CLASSES; c++)
+    if (client->queue[c].len > 0)
+      return true;
+  return false;
+}
+
+resp_con_t mqtt_sn_insert_queue(mqtt_sn_client_t *client, mqtt_sn_task_t new){
+  mqtt_sn_task_ring_t *ring;
+  mqtt_sn_task_t *temp;
+  char *task_type;
+
+  if (new.prio >= MQTT_SN_PRIO_CLASSES)
+    return FAIL_CON;
+
+  //Limita o número máximo de tarefas alocadas em cada classe da fila
+  ring = &client->queue[new.prio];
+  if (ring->len >= MAX_QUEUE_MQTT_SN)
+    return FAIL_CON;
+
+  temp = &ring->task[(ring->head + ring->len) % MAX_QUEUE_MQTT_SN];
+  *temp = new;
+  temp->id_task = client->task_id;
+  client->task_id++;
+  ring->len++;
+  client->queue_len++;
+  // A primeira tarefa pode estar em andamento (CONNECT aguardando CONNACK,
+  // REGISTER aguardando REGACK), logo só é trocada quando removida
+  if (client->queue_first == NULL)
+    client->queue_first = temp;
+
+  parse_mqtt_type_string(temp->msg_type_q,&task_type);
+  debug_task("Task adicionada:[%2.0d][%s]",(int)temp->id_task, task_type);
+  return SUCCESS_CON;
+}
+
+void mqtt_sn_delete_queue(mqtt_sn_client_t *client){
+  mqtt_sn_task_ring_t *ring;
+  char *task_type;
+
+  if (client->queue_len == 0)
+    return;
+
+  parse_mqtt_type_string(client->queue_first->msg_type_q,&task_type);
+  debug_task("Task removida:[%2.0d][%s]",(int)client->queue_first->id_task,task_type);
+
+  // A primeira tarefa é sempre o início do anel da sua classe
+  ring = &client->queue[client->queue_first->prio];
+  ring->head = (ring->head + 1) % MAX_QUEUE_MQTT_SN;
+  ring->len--;
+  client->queue_len--;
+
+  if (client->queue_len == 0) {
+      client->task_id = 0;
+      client->queue_first = NULL;
+      debug_task("Task info: Fila vazia");
+  }
+  else {
+      client->task_id--;
+      client->queue_first = mqtt_sn_queue_next(client);
+  }
+}
+
+void mqtt_sn_check_queue(mqtt_sn_client_t *client){
+  uint8_t i, c;
+  mqtt_sn_task_t *temp;
+  char *task_type;
+
+  debug_task("VALOR DO GLOBAL ID client->task_id:%d",client->task_id);
+
+  debug_task("FILA:");
+  for (c = MQTT_SN_PRIO_CLASSES; c-- > 0; )
+    for (i = 0; i < client->queue[c].len; i++) {
+      temp = &client->queue[c].task[(client->queue[c].head + i) % MAX_QUEUE_MQTT_SN];
+      parse_mqtt_type_string(temp->msg_type_q,&task_type);
+      debug_task("[%2.0d][%s][%d]",(int)temp->id_task, task_type,temp->short_topic);
+    }
+  debug_task("Tamanho da fila:[%d]", client->queue_len);
+}
+
+bool mqtt_sn_check_empty(mqtt_sn_client_t *client){
+  if (client->queue_len == 0)
+    return true;
+  else
+    return false;
 }
 
-resp_con_t mqtt_sn_sub_send(char *topic, uint8_t qos){
-  subscribe_packet_t packet;
-  uint16_t stopic = 0x0000;
+static resp_con_t mqtt_sn_insert_queue_first(mqtt_sn_client_t *client, mqtt_sn_task_t new){
+  mqtt_sn_task_ring_t *ring;
+  char *task_type;
 
-  // if (mqtt_queue_first->data.msg_type_q != MQTT_SN_TYPE_PUBLISH) {
-  //   debug_mqtt("Erro: Pacote a processar nao e do tipo PUBLISH");
-  //   return FAIL_CON;
-  // }
-  size_t i = 0;
-  for (i=0; i < MAX_TOPIC_USED; i++)
-    if (strcmp(g_topic_bind[i].topic_name,topic) == 0) {
-      stopic = g_topic_bind[i].short_topic_id;
-      break;
-    }
+  if (new.prio >= MQTT_SN_PRIO_CLASSES)
+    return FAIL_CON;
 
-  packet.type  = MQTT_SN_TYPE_SUBSCRIBE;
-  packet.flags = 0x00;
+  ring = &client->queue[new.prio];
+  if (ring->len >= MAX_QUEUE_MQTT_SN)
+    return FAIL_CON;
 
-  packet.flags += mqtt_sn_get_qos_flag(0);
-  packet.message_id = uip_htons(stopic);
-  packet.topic_id =  uip_htons(stopic);
-  packet.flags += MQTT_SN_TOPIC_TYPE_PREDEFINED; //Utiliza-se o topic id já registrado
-  packet.length = 0x07;
-  //
-  //  Pacote SUBSCRIBE
-  //  _________________ ______________________ ___________ ________________ _____________________________________
-  // | Comprimento - 0 | Tipo de mensagem - 1 | Flags - 2 | Msg ID - 3,4  | Topic ID - 5,6 ou Topic name 5,n ....|
-  // |_________________|______________________|___________|_______________|______________________________________|
-  //
-  debug_mqtt("Enviando o pacote @SUBSCRIBE");
-  simple_udp_send(&g_mqtt_sn_con.udp_con,&packet, packet.length);
+  // Passa à frente da tarefa em andamento (retomada de sessão)
+  ring->head = (ring->head + MAX_QUEUE_MQTT_SN - 1) % MAX_QUEUE_MQTT_SN;
+  ring->task[ring->head] = new;
+  ring->task[ring->head].id_task = client->task_id;
+  client->task_id++;
+  ring->len++;
+  client->queue_len++;
+  client->queue_first = &ring->task[ring->head];
+
+  parse_mqtt_type_string(new.msg_type_q,&task_type);
+  debug_task("Task adicionada no inicio:[%2.0d][%s]",(int)client->queue_first->id_task, task_type);
   return SUCCESS_CON;
 }
 
-resp_con_t mqtt_sn_sub_send_wildcard(char *topic, uint8_t qos){
-  subscribe_wildcard_packet_t packet;
+/************** FUNÇÕES DE GERENCIMENTO DE CONEXÃO MQTT-SN ********************/
+static void mqtt_sn_sleep_arm(mqtt_sn_client_t *client){
+  uint16_t step = client->sleep_left;
+
+  // O clock_time_t de 16 bits não comporta minutos de sono em uma única
+  // temporização, então o período é contado em passos de MQTT_SN_SLEEP_STEP
+  if (step > MQTT_SN_SLEEP_STEP)
+    step = MQTT_SN_SLEEP_STEP;
+  client->sleep_left -= step;
+  ctimer_set(&client->time_sleep, (clock_time_t)step*CLOCK_SECOND, timeout_sleep, client);
+}
 
-  // Analisamos o buffer de tópicos registrados para ver se já foi registrado o tópico
-  size_t i = 0;
-  for (i=0; i < MAX_TOPIC_USED; i++){
-    if (g_topic_bind[i].short_topic_id == 0xFF)
-      break;
+static void mqtt_sn_session_resume(mqtt_sn_client_t *client){
+  mqtt_sn_task_t task = {0};
+  uint8_t i;
+
+  // Reconexão sem CLEAN: o gateway mantém os topic ids e as inscrições, então
+  // topic_bind e as tarefas pendentes são preservados e somente o CONNECT
+  // (mais o LWT) volta para o início da fila
+  debug_mqtt("Retomando sessao sem CLEAN");
+  client->session_resumed = true;
+
+  // Tarefas de conexão da tentativa anterior são refeitas abaixo
+  while (!mqtt_sn_check_empty(client) &&
+         (client->queue_first->msg_type_q == MQTT_SN_TYPE_CONNECT ||
+          client->queue_first->msg_type_q == MQTT_SN_TYPE_WILLTOPIC ||
+          client->queue_first->msg_type_q == MQTT_SN_TYPE_WILLMSG))
+    mqtt_sn_delete_queue(client);
+
+  // SUBSCRIBEs sem SUBACK voltam para a fila, atrás dos REGISTERs, que
+  // continuam na fila e são reenviados quando a janela for preenchida novamente
+  task.prio = MQTT_SN_PRIO_LOW;
+  for (i = 0; i < MQTT_SN_SUB_WINDOW; i++) {
+    if (client->sub_window[i].message_id == 0x0000)
+      continue;
+    task.qos_level = client->sub_window[i].qos;
+    if (client->sub_window[i].wildcard != NULL) {
+      task.msg_type_q = MQTT_SN_TYPE_SUB_WILDCARD;
+      client->topic_temp_wildcard = client->sub_window[i].wildcard;
+    }
+    else {
+      task.msg_type_q = MQTT_SN_TYPE_SUBSCRIBE;
+      task.short_topic = client->sub_window[i].pos;
+    }
+    mqtt_sn_insert_queue(client, task);
   }
+  memset(client->sub_window, 0, sizeof(client->sub_window));
+  memset(client->reg_window, 0, sizeof(client->reg_window));
+  client->reg_next = 1;
+
+  task.prio = MQTT_SN_PRIO_HIGH;
+  task.short_topic = 0;
+  task.qos_level = 0;
+  if (client->will) {
+    task.msg_type_q = MQTT_SN_TYPE_WILLMSG;
+    mqtt_sn_insert_queue_first(client, task);
+    task.msg_type_q = MQTT_SN_TYPE_WILLTOPIC;
+    mqtt_sn_insert_queue_first(client, task);
+  }
+  task.msg_type_q = MQTT_SN_TYPE_CONNECT;
+  mqtt_sn_insert_queue_first(client, task);
 
-  packet.type  = MQTT_SN_TYPE_SUBSCRIBE;
-  packet.flags = 0x00;
+  process_post(&mqtt_sn_main, mqtt_event_run_task, client);
+}
 
-  packet.flags += mqtt_sn_get_qos_flag(0);
-  packet.message_id = uip_htons(i);
-  strncpy(packet.topic_name,topic,strlen(topic));
-  packet.flags += MQTT_SN_TOPIC_TYPE_NORMAL;
-  packet.length = 0x05+strlen(topic);
+resp_con_t mqtt_sn_sleep(mqtt_sn_client_t *client, uint16_t duration){
+  // Somente com a conexão ociosa: sem tarefas na fila nem REGISTER pendente
+  if (duration == 0 || !unlock_tasks(client) || !mqtt_sn_check_empty(client))
+    return FAIL_CON;
 
-  //
-  //  Pacote SUBSCRIBE
-  //  _________________ ______________________ ___________ ________________ _____________________________________
-  // | Comprimento - 0 | Tipo de mensagem - 1 | Flags - 2 | Msg ID - 3,4  | Topic ID - 5,6 ou Topic name 5,n ....|
-  // |_________________|______________________|___________|_______________|______________________________________|
-  //
-  debug_mqtt("Enviando o pacote @SUBSCRIBE(Wildcard)");
-  simple_udp_send(&g_mqtt_sn_con.udp_con,&packet, packet.length);
+  debug_mqtt("Entrando em modo dormindo:[%d s]",duration);
+  client->sleep_duration = duration;
+  ctimer_stop(&client->time_ping);
+  mqtt_sn_disconnect_send(client, duration);
+  client->status = MQTTSN_WAITING_DISCONNECT;
+  ctimer_set(&client->time_connect, mqtt_sn_rto(client, 0), timeout_con, client);
+  client->tries_send = 0;
   return SUCCESS_CON;
 }
 
-resp_con_t mqtt_sn_disconnect(uint16_t duration){
-  disconnect_packet_t packet;
-
-  packet.msg_type = MQTT_SN_TYPE_DISCONNECT;
-  packet.duration = uip_htons(duration);
-  packet.length = 0x04;
-  debug_mqtt("Desconectando do broker...");
+resp_con_t mqtt_sn_wake(mqtt_sn_client_t *client){
+  if (client->status != MQTTSN_ASLEEP)
+    return FAIL_CON;
 
-  simple_udp_send(&g_mqtt_sn_con.udp_con,&packet, packet.length);
+  // PINGREQ com client id: o gateway entrega as mensagens retidas durante o
+  // sono e encerra com PINGRESP, que devolve o cliente ao estado ASLEEP
+  debug_mqtt("Acordando para buscar mensagens");
+  ctimer_stop(&client->time_sleep);
+  client->status = MQTTSN_AWAKE;
+  client->ping_flag_resp = false;
+  client->tries_ping = 0;
+  mqtt_sn_ping_send(client);
+  ctimer_set(&client->time_ping, mqtt_sn_rto(client, 0), timeout_ping_mqtt, client);
   return SUCCESS_CON;
 }
 
-/************************** FUNÇÕES DE FILA MQTT-SN ***************************/
-resp_con_t mqtt_sn_insert_queue(mqtt_sn_task_t new){
-  struct node *temp,*temp2;
-
-  temp2 = mqtt_queue_first;
-  int cnt = 0;
-  while (temp2) {
-      temp2 = temp2->link;
-      cnt++;
-  }
-
-  //Limita o número máximo de tarefas alocadas na fila
-  if (cnt > MAX_QUEUE_MQTT_SN)
+resp_con_t mqtt_sn_active(mqtt_sn_client_t *client){
+  if (client->status != MQTTSN_ASLEEP && client->status != MQTTSN_AWAKE)
     return FAIL_CON;
 
-  temp = (struct node *)malloc(sizeof(struct node));
-  temp->data.msg_type_q  = new.msg_type_q;
-  temp->data.short_topic = new.short_topic;
-  temp->data.retain      = new.retain;
-  temp->data.qos_level   = new.qos_level;
-  temp->data.id_task     = g_task_id;
-  g_task_id++;
-
-  temp->link = NULL;
-  if (mqtt_queue_last  ==  NULL) {
-      mqtt_queue_first = mqtt_queue_last = temp;
-  }
-  else {
-      mqtt_queue_last->link = temp;
-      mqtt_queue_last = temp;
-  }
-
-  char *task_type;
-  //parse_mqtt_type_string(mqtt_queue_first->data.msg_type_q,&task_type_2);
-  //debug_task("Task principal:[%2.0d][%s]",(int)mqtt_queue_first->data.id_task,task_type_2);
-  parse_mqtt_type_string(temp->data.msg_type_q,&task_type);
-  debug_task("Task adicionada:[%2.0d][%s]",(int)temp->data.id_task, task_type);
+  // O cliente volta ao estado ACTIVE com um CONNECT sem CLEAN, mantendo a
+  // sessão (topic ids e inscrições) guardada pelo gateway durante o sono
+  debug_mqtt("Saindo do modo dormindo");
+  ctimer_stop(&client->time_sleep);
+  ctimer_stop(&client->time_ping);
+  client->status = MQTTSN_DISCONNECTED;
+  client->clean_session = false;
+  mqtt_sn_session_resume(client);
   return SUCCESS_CON;
 }
 
-void mqtt_sn_delete_queue(void){
-  struct node *temp;
-  char *task_type;
+static void mqtt_sn_session_lost(mqtt_sn_client_t *client){
+  // Topic id recusado após retomar a sessão: o gateway não guardou a sessão
+  // (reinício ou expiração), reconecta com CLEAN e refaz REGISTER/SUBSCRIBE
+  if (!client->session_resumed)
+    return;
 
-  temp = mqtt_queue_first;
-  if (mqtt_queue_first->link == NULL) {
-      g_task_id = 0;
-      parse_mqtt_type_string(mqtt_queue_first->data.msg_type_q,&task_type);
-      debug_task("Task removida:[%2.0d][%s]",(int)mqtt_queue_first->data.id_task,task_type);
-      debug_task("Task info: Fila vazia");
-      mqtt_queue_first = mqtt_queue_last = NULL;
-  }
-  else {
-      g_task_id--;
-      parse_mqtt_type_string(mqtt_queue_first->data.msg_type_q,&task_type);
-      debug_task("Task removida:[%2.0d][%s]",(int)mqtt_queue_first->data.id_task,task_type);
-      mqtt_queue_first = mqtt_queue_first->link;
-      free(temp);
-  }
+  debug_mqtt("Sessao perdida no gateway, reconectando com CLEAN");
+  client->session_resumed = false;
+  client->clean_session = true;
+  process_post(&mqtt_sn_main, mqtt_event_ping_timeout, client);
 }
 
-void mqtt_sn_check_queue(void){
-  int cnt = 0;
-  struct node *temp;
-  char *task_type;
-
-  temp = mqtt_queue_first;
+#ifdef MQTT_SN_AUTO_RECONNECT
+static void mqtt_sn_session_clean(mqtt_sn_client_t *client){
+  uint16_t pos, topic_id;
+  char *name;
+
+  // CONNECT com CLEAN descarta as inscrições guardadas no gateway. Os tópicos
+  // inscritos pelo usuário atravessam o init_vectors (marcados com 0x03) e os
+  // SUBSCRIBEs entram na fila depois do CONNECT e dos REGISTERs, refeitos logo
+  // após o CONNACK. Nomes do topic_name_pool vieram de REGISTERs do gateway e
+  // voltam pela inscrição wildcard
+  debug_mqtt("Nova sessao com CLEAN");
+  client->session_resumed = false;
+  for (pos = 1; pos < MAX_TOPIC_USED; pos++) {
+    name = client->topic_bind[pos].topic_name;
+    if (name != NULL && client->topic_bind[pos].subscribed != 0x00 &&
+        (name < client->topic_name_pool ||
+         name >= client->topic_name_pool + MQTT_SN_TOPIC_NAME_POOL))
+      client->topic_bind[pos].subscribed = 0x03;
+  }
+  init_vectors(client);
+
+  // Índices refeitos para os tópicos mantidos, somente os ids curtos e
+  // pré-definidos continuam válidos, os demais passam por novo REGISTER
+  for (pos = 1; pos < MAX_TOPIC_USED; pos++) {
+    if (client->topic_bind[pos].subscribed != 0x03)
+      continue;
+    topic_id = client->topic_bind[pos].short_topic_id;
+    client->topic_bind[pos].short_topic_id = MQTT_SN_TOPIC_ID_NONE;
+    mqtt_sn_topic_index(client, pos);
+    if (client->topic_bind[pos].topic_type != MQTT_SN_TOPIC_TYPE_NORMAL)
+      mqtt_sn_topic_set_id(client, pos, topic_id);
+  }
 
-  debug_task("VALOR DO GLOBAL ID g_task_id:%d",g_task_id);
+  mqtt_sn_create_sck(client, client->con, client->topics_reconnect, client->topics_len, client->callback);
 
-  debug_task("FILA:");
-  while (temp) {
-      parse_mqtt_type_string(temp->data.msg_type_q,&task_type);
-      debug_task("[%2.0d][%s][%d]",(int)temp->data.id_task, task_type,temp->data.short_topic);
-      temp = temp->link;
-      cnt++;
+  for (pos = 1; pos < MAX_TOPIC_USED; pos++) {
+    if (client->topic_bind[pos].subscribed != 0x03)
+      continue;
+    client->topic_bind[pos].subscribed = 0x00;
+    mqtt_sn_sub(client, client->topic_bind[pos].topic_name, client->topic_bind[pos].sub_qos);
   }
-  debug_task("Tamanho da fila:[%d]", cnt);
+  if (client->wildcard_sub != NULL)
+    mqtt_sn_sub_wildcard(client, client->wildcard_sub, client->wildcard_qos);
 }
+#endif
 
-bool mqtt_sn_check_empty(void){
-  if (mqtt_queue_first  ==  NULL)
-    return true;
-  else
-    return false;
+static uint8_t mqtt_sn_min_length(uint8_t msg_type){
+  switch (msg_type) {
+    case MQTT_SN_TYPE_CONNACK:
+      return 3;
+    case MQTT_SN_TYPE_PUBREC:
+    case MQTT_SN_TYPE_PUBCOMP:
+    case MQTT_SN_TYPE_PUBREL:
+      return 4;
+    case MQTT_SN_TYPE_REGISTER:
+      return 6;
+    case MQTT_SN_TYPE_REGACK:
+    case MQTT_SN_TYPE_PUBACK:
+    case MQTT_SN_TYPE_PUBLISH:
+      return 7;
+    case MQTT_SN_TYPE_SUBACK:
+      return 8;
+    default:
+      return 2;
+  }
 }
 
-/************** FUNÇÕES DE GERENCIMENTO DE CONEXÃO MQTT-SN ********************/
-void mqtt_sn_recv_parser(const uint8_t *data){
-    uint8_t msg_type = data[1],
-            return_code = 0xFF,
-            short_topic;
-    size_t i = 0;
+void mqtt_sn_recv_parser(mqtt_sn_client_t *client, uint8_t *data, uint16_t datalen){
+    uint8_t msg_type,
+            return_code = 0xFF;
+    uint16_t short_topic,
+             msg_id;
+
+    // O campo de comprimento de 3 bytes (0x01) não é suportado e um pacote
+    // nunca pode ser maior que o datagrama recebido, todo acesso a data[]
+    // abaixo fica dentro de data[0] bytes
+    if (datalen < 2 || data[0] < 2 || data[0] > datalen) {
+      debug_mqtt("Pacote recebido com comprimento invalido:[%d]",datalen);
+      return;
+    }
+    msg_type = data[1];
+    if (data[0] < mqtt_sn_min_length(msg_type)) {
+      debug_mqtt("Pacote recebido truncado:[%d][%d]",msg_type,data[0]);
+      return;
+    }
+    // Todo pacote válido do gateway comprova a conexão (keep alive)
+    client->last_rx = clock_time();
+    client->rx_since_ping = true;
     // Como o MsgType não se altera de posição, testamos primeiro ele antes do
     // returning code, já que este pode variar
     switch (msg_type) {
       case MQTT_SN_TYPE_CONNACK:
         return_code = data[2]; //No caso do CONNACK - RC[2]
         if (mqtt_sn_check_rc(return_code)){
-          if (mqtt_status == MQTTSN_WAITING_CONNACK)
-            process_post(&mqtt_sn_main, mqtt_event_connack, NULL);
+          if (client->status == MQTTSN_WAITING_CONNACK)
+            process_post(&mqtt_sn_main, mqtt_event_connack, client);
           else
             debug_mqtt("Recebido CONNAC sem requisicao!");
         }
       break;
       case MQTT_SN_TYPE_REGACK:
-        return_code = data[6]; //No caso do REGACK - RC[6]
-        short_topic = data[3];
-        // Na verdade os bytes de short topic são o [2] e [3], porém
-        // só estamos usa-se o [3] porque não consideramos mais do que
-        // 15 tópicos
-        /// @todo Rever o short topic para adequar bytes [2][3] juntos..
+        // Pacote REGACK: Topic ID [2][3], Msg ID [4][5] e RC [6]
+        return_code = data[6];
+        short_topic = ((uint16_t)data[2] << 8) | data[3];
+        msg_id = ((uint16_t)data[4] << 8) | data[5];
         if (mqtt_sn_check_rc(return_code)){
-          for (i = 0;i < MAX_TOPIC_USED; i++) { //Compara o byte menor do MSG ID para atribuir o short topic a requisição REGISTER correta
-            if (i == data[5]){
-              g_topic_bind[i].short_topic_id = short_topic;
-            }
-          }
-          if (mqtt_queue_first->data.msg_type_q == MQTT_SN_TYPE_REGISTER &&
-              mqtt_status == MQTTSN_WAITING_REGACK)
-            process_post(&mqtt_sn_main, mqtt_event_regack, NULL);
+          // O MSG ID identifica o REGISTER na janela, cada REGACK da janela
+          // gera um evento que remove uma tarefa de REGISTER
+          if (!mqtt_sn_check_empty(client) &&
+              client->queue_first->msg_type_q == MQTT_SN_TYPE_REGISTER &&
+              client->status == MQTTSN_WAITING_REGACK &&
+              mqtt_sn_regack_recv(client, msg_id, short_topic))
+            process_post(&mqtt_sn_main, mqtt_event_regack, client);
           else
             debug_mqtt("Recebido REGACK sem requisicao!");
         }
       break;
       case MQTT_SN_TYPE_PUBACK:
-        // return_code = data[6]; //No caso do PUBACK - RC[6]
-        // short_topic = data[3];
-        // // Na verdade os bytes de short topic são o [2] e [3], porém
-        // // só estamos usa-se o [3] porque não consideramos mais do que
-        // // 15 tópicos
-        // /// @todo Rever o short topic para adequar bytes [2][3] juntos
-        //
-        // /// @TODO Implementar verificação de message ID e short topic ID para melhorar a confiança do recebimento
-        // if (mqtt_sn_check_rc(return_code))
-        //   if (mqtt_queue_first->data.msg_type_q == MQTT_SN_TYPE_PUBLISH)
-        //     process_post(&mqtt_sn_main, mqtt_event_puback, NULL);
+        // Pacote PUBACK: Topic ID [2][3], Msg ID [4][5] e RC [6]
+        if (data[6] == REJECTED_INVALID_TOPIC_ID)
+          mqtt_sn_session_lost(client);
+        mqtt_sn_puback_recv(client, ((uint16_t)data[4] << 8) | data[5], data[6]);
+      break;
+      case MQTT_SN_TYPE_PUBREC:
+        mqtt_sn_pubrec_recv(client, ((uint16_t)data[2] << 8) | data[3]);
+      break;
+      case MQTT_SN_TYPE_PUBCOMP:
+        mqtt_sn_pubcomp_recv(client, ((uint16_t)data[2] << 8) | data[3]);
+      break;
+      case MQTT_SN_TYPE_PUBREL:
+        mqtt_sn_pubrel_recv(client, ((uint16_t)data[2] << 8) | data[3]);
       break;
       case MQTT_SN_TYPE_SUBACK:
-        return_code = data[7]; //No caso do SUBACK - RC[7]
-        short_topic = data[4];
-        // Na verdade os bytes de short topic são o [2] e [3], porém
-        // só estamos usa-se o [3] porque não consideramos mais do que
-        // 15 tópicos
-        /// @todo Rever o short topic para adequar bytes [2][3] juntos...
+        // Pacote SUBACK: Topic ID [3][4], Msg ID [5][6] e RC [7]. O topic id
+        // não é utilizado porque no short topic name e no wildcard pode ser
+        // 0x0000, o SUBACK é correlacionado pelo message id
         debug_mqtt("Recebido SUBACK");
-
-        if (mqtt_sn_check_rc(return_code))
-          if (short_topic != 0x00) {
-            debug_mqtt("Reconhecimento de inscricao:[%s]",g_topic_bind[short_topic].topic_name);
-            g_topic_bind[short_topic].subscribed = 0x02;
-            if (mqtt_queue_first->data.msg_type_q == MQTT_SN_TYPE_SUBSCRIBE &&
-                mqtt_status == MQTTSN_WAITING_SUBACK)
-              process_post(&mqtt_sn_main, mqtt_event_suback, NULL);
-            else
-              debug_mqtt("Recebido SUBACK sem requisicao!");
-          }
-          else{
-            debug_mqtt("Recebido SUBACK de WILDCARD");
-            if (mqtt_queue_first->data.msg_type_q == MQTT_SN_TYPE_SUB_WILDCARD){
-              mqtt_status = MQTTSN_TOPIC_REGISTERED;
-              mqtt_sn_delete_queue();
-            }
-          }
-        else
-          debug_mqtt("Erro: Codigo de retorno invalido");
+        // Gateways que descartam o PUBLISH com topic id desconhecido sem
+        // PUBACK (ex.: RSMB) só acusam a sessão perdida no SUBACK
+        if (data[7] == REJECTED_INVALID_TOPIC_ID)
+          mqtt_sn_session_lost(client);
+        mqtt_sn_suback_recv(client, ((uint16_t)data[5] << 8) | data[6], data[7]);
       break;
       case MQTT_SN_TYPE_PINGRESP:
-        g_ping_flag_resp = true;
+        // No estado AWAKE o PINGRESP vem após as mensagens retidas, o tempo
+        // não representa o RTT
+        if (!client->ping_flag_resp && client->tries_ping == 0 && client->status != MQTTSN_AWAKE)
+          mqtt_sn_rtt_sample(client, client->ping_sent_at);
+        client->ping_flag_resp = true;
         //debug_mqtt("Ping respondido");
+        // Fim das mensagens retidas pelo gateway, volta a dormir
+        if (client->status == MQTTSN_AWAKE)
+          process_post(&mqtt_sn_main, mqtt_event_asleep, client);
+      break;
+      case MQTT_SN_TYPE_DISCONNECT:
+        if (client->status == MQTTSN_WAITING_DISCONNECT)
+          process_post(&mqtt_sn_main, mqtt_event_asleep, client);
+        else if (client->status != MQTTSN_DISCONNECTED &&
+                 client->status != MQTTSN_WAITING_CONNACK) {
+          // Desconexão iniciada pelo gateway (ex.: sono expirado). Aguardando
+          // CONNACK não há sessão, o DISCONNECT é resposta atrasada de uma
+          // sessão anterior na mesma porta e reconectar perderia a fila
+          debug_mqtt("Recebido DISCONNECT do gateway");
+          process_post(&mqtt_sn_main, mqtt_event_ping_timeout, client);
+        }
       break;
       case MQTT_SN_TYPE_PINGREQ:
-        mqtt_sn_ping_send();
+        mqtt_sn_ping_send(client);
       break;
       case MQTT_SN_TYPE_PUBLISH:
         debug_mqtt("Recebida publicacao:");
         uint8_t message_length = data[0]-7;
-        //uint8_t msg_id = data[6];
-        short_topic = data[4];
-        char message[MQTT_SN_MAX_PACKET_LENGTH];
+        uint8_t qos_flag = data[2] & MQTT_SN_FLAG_QOS_MASK;
+        msg_id = ((uint16_t)data[5] << 8) | data[6];
+        uint16_t topic_id = ((uint16_t)data[3] << 8) | data[4];
+        short_topic = topic_id;
+        int16_t pos = -1;
+        char short_name[3];
+        char *topic_name = short_name;
+        uint8_t *message = &data[7];
+
+        // Short topic name: os dois caracteres do tópico vêm no campo de topic
+        // id, dispensando a consulta ao vetor de tópicos
+        if ((data[2] & MQTT_SN_TOPIC_TYPE_MASK) == MQTT_SN_TOPIC_TYPE_SHORT) {
+          short_name[0] = data[3];
+          short_name[1] = data[4];
+          short_name[2] = '\0';
+        }
+        else {
+          pos = mqtt_sn_topic_find_id(client, short_topic, data[2] & MQTT_SN_TOPIC_TYPE_MASK);
+          if (pos < 0) {
+            // Com QoS 1 e 2 o gateway é avisado, senão retransmitiria a
+            // publicação até o limite de tentativas
+            debug_mqtt("Publicacao de topic id desconhecido:[%d]",short_topic);
+            if (qos_flag == MQTT_SN_FLAG_QOS_1 || qos_flag == MQTT_SN_FLAG_QOS_2)
+              mqtt_sn_puback_send(client, topic_id, msg_id, REJECTED_INVALID_TOPIC_ID);
+            break;
+          }
+          topic_name = client->topic_bind[pos].topic_name;
+        }
         // debug_mqtt("[Msg_ID][%d]/[Topic ID][%d]",msg_id,short_topic);
 
-        size_t i;
-        for (i = 0; i < (message_length); i++)
-          message[i] = data[i+7];
-        message[i] = '\0';
-        // debug_mqtt("Topico:%s",g_topic_bind[short_topic].topic_name);
-        // debug_mqtt("Mensagem:%s",message);
-        // debug_mqtt("\n");
-        (*callback_mqtt)(g_topic_bind[short_topic].topic_name, message);
+        // QoS 2 repetida (PUBREC perdido): já entregue, somente o PUBREC
+        if (qos_flag == MQTT_SN_FLAG_QOS_2 &&
+            mqtt_sn_qos2_find(client, msg_id, MQTT_SN_QOS2_INBOUND) != NULL) {
+          debug_mqtt("Publicacao QoS 2 repetida:[%d]",msg_id);
+          mqtt_sn_msg_id_send(client, MQTT_SN_TYPE_PUBREC, msg_id);
+          break;
+        }
+
+        // O callback de texto precisa do '\0': normalmente ele já vem no
+        // payload, senão é escrito no byte seguinte ao datagrama, ainda
+        // dentro do uip_buf. Sem espaço a mensagem não pode ser entregue e é
+        // recusada antes de entrar na tabela QoS 2, senão a retransmissão
+        // seria confirmada sem nunca ter sido entregue
+        if (client->callback_bin == NULL && client->callback != NULL &&
+            (message_length == 0 || message[message_length-1] != '\0')) {
+          if (&message[message_length] >= &uip_buf[UIP_BUFSIZE]) {
+            debug_mqtt("Erro: Sem espaco para terminar a mensagem recebida");
+            if (qos_flag == MQTT_SN_FLAG_QOS_1 || qos_flag == MQTT_SN_FLAG_QOS_2)
+              mqtt_sn_puback_send(client, topic_id, msg_id, REJECTED_NOT_SUPPORTED);
+            break;
+          }
+          message[message_length] = '\0';
+        }
+
+        // QoS 2: a mensagem é entregue uma única vez, o message id fica na
+        // tabela compacta até o PUBREL. Se a tabela estiver cheia não há
+        // PUBREC e o broker retransmite a publicação mais tarde
+        if (qos_flag == MQTT_SN_FLAG_QOS_2 &&
+            mqtt_sn_qos2_add(client, msg_id, MQTT_SN_QOS2_INBOUND) == NULL) {
+          debug_mqtt("Tabela QoS 2 cheia:[%d]",msg_id);
+          break;
+        }
+
+        // O payload é entregue sem cópia, direto do pacote recebido. Os
+        // campos do pacote já foram lidos: a partir daqui qualquer envio
+        // (inclusive no callback) sobrescreve o pacote recebido no uip_buf
+        if (client->callback_bin != NULL) {
+          (*client->callback_bin)(topic_name, message, message_length);
+        }
+        else if (client->callback != NULL) {
+          // debug_mqtt("Topico:%s",topic_name);
+          // debug_mqtt("Mensagem:%s",message);
+          (*client->callback)(topic_name, (char *)message);
+        }
+
+        if (qos_flag == MQTT_SN_FLAG_QOS_1)
+          mqtt_sn_puback_send(client, topic_id, msg_id, ACCEPTED);
+        else if (qos_flag == MQTT_SN_FLAG_QOS_2)
+          mqtt_sn_msg_id_send(client, MQTT_SN_TYPE_PUBREC, msg_id);
       break;
       case MQTT_SN_TYPE_REGISTER:
         debug_mqtt("Recebido registro de topico novo:");
-        uint8_t msg_id_reg = data[5];
+        // Pacote REGISTER: Topic ID [2][3], Msg ID [4][5] e Topic name [6,n]
+        uint16_t msg_id_reg = ((uint16_t)data[4] << 8) | data[5];
         uint8_t message_length_buf = data[0]-6;
-        size_t j,t;
-        char buff[MQTT_SN_MAX_TOPIC_LENGTH];
+        char name_reg[MQTT_SN_MAX_TOPIC_LENGTH+1];
+        int16_t j;
+        char *s;
 
-        short_topic = data[3];
+        short_topic = ((uint16_t)data[2] << 8) | data[3];
 
-        for (t = 0; t < message_length_buf; t++)
-          buff[t] = data[t+6];
-        buff[t] = '\0';
+        if (message_length_buf > MQTT_SN_MAX_TOPIC_LENGTH) {
+          debug_mqtt("Erro: Nome do topico excede o limite maximo");
+          break;
+        }
+        memcpy(name_reg, &data[6], message_length_buf);
+        name_reg[message_length_buf] = '\0';
+
+        // Tópico já conhecido (REGISTER repetido pelo gateway, REGACK perdido
+        // ou nova sessão): somente o topic id é atualizado, sem ocupar outra
+        // posição do vetor nem bytes do buffer de nomes
+        j = mqtt_sn_topic_find(client, name_reg);
+        if (j >= 0) {
+          mqtt_sn_topic_set_id(client, j, short_topic);
+          debug_mqtt("Topico ja registrado, topic id atualizado![%s][%d]",client->topic_bind[j].topic_name,short_topic);
+          mqtt_sn_regack_send(client, msg_id_reg, short_topic);
+          break;
+        }
 
-        for (j = 0; j < MAX_TOPIC_USED; j++)
-          if (g_topic_bind[j].short_topic_id == 0xFF)
-            break;
+        j = mqtt_sn_topic_free_slot(client);
 
-        // Apesar de a variável ser local (buff) precisamos alocar dinamicamente
-        // memória para o ponteiro s para que consigamos fornecer um novo endereço
-        // de memória para a estrutura g_topic_bind...
-        char *s;
-        s = (char *)malloc(strlen(buff)+1);
-        strcpy(s,buff);
-        g_topic_bind[j].short_topic_id = short_topic;
-        g_topic_bind[j].subscribed = true;
-        g_topic_bind[j].topic_name = s;
-
-        debug_mqtt("Topico registrado![%s]",g_topic_bind[j].topic_name);
-        mqtt_sn_regack_send((uint16_t)msg_id_reg,(uint16_t)short_topic);
+        // O nome do tópico é copiado para o buffer estático de nomes, sem
+        // alocação dinâmica de memória
+        if (j == 0 ||
+            client->topic_name_pool_len + message_length_buf + 1 > MQTT_SN_TOPIC_NAME_POOL) {
+          debug_mqtt("Erro: Sem espaco para registrar o topico novo");
+          break;
+        }
+
+        s = &client->topic_name_pool[client->topic_name_pool_len];
+        memcpy(s, name_reg, message_length_buf + 1);
+        client->topic_name_pool_len += message_length_buf + 1;
+
+        client->topic_bind[j].subscribed = true;
+        client->topic_bind[j].topic_name = s;
+        client->topic_bind[j].topic_type = MQTT_SN_TOPIC_TYPE_NORMAL;
+        mqtt_sn_topic_set_id(client, j, short_topic);
+        mqtt_sn_topic_index(client, j);
+
+        debug_mqtt("Topico registrado![%s]",client->topic_bind[j].topic_name);
+        mqtt_sn_regack_send(client, msg_id_reg, short_topic);
       break;
       case MQTT_SN_TYPE_WILLTOPICREQ:
         // debug_mqtt("Recebido um pacote WILL TOPIC REQ");
-        if (mqtt_status == MQTTSN_WAITING_WILLTOPICREQ)
-          process_post(&mqtt_sn_main,mqtt_event_will_topicreq,NULL);
+        if (client->status == MQTTSN_WAITING_WILLTOPICREQ)
+          process_post(&mqtt_sn_main, mqtt_event_will_topicreq, client);
       break;
       case MQTT_SN_TYPE_WILLMSGREQ:
-        if (mqtt_status == MQTTSN_WAITING_WILLMSGREQ)
-          process_post(&mqtt_sn_main,mqtt_event_will_messagereq,NULL);
+        if (client->status == MQTTSN_WAITING_WILLMSGREQ)
+          process_post(&mqtt_sn_main, mqtt_event_will_messagereq, client);
       break;
       default:
         debug_mqtt("Recebida mensagem porem nao identificada!");
@@ -864,6 +2658,10 @@ void mqtt_sn_recv_parser(const uint8_t *data){
     }
 }
 
+void mqtt_sn_set_bin_callback(mqtt_sn_client_t *client, mqtt_sn_bin_cb_f cb_f){
+  client->callback_bin = cb_f;
+}
+
 void mqtt_sn_udp_rec_cb(struct simple_udp_connection *c,
                             const uip_ipaddr_t *sender_addr,
                             uint16_t sender_port,
@@ -871,111 +2669,226 @@ void mqtt_sn_udp_rec_cb(struct simple_udp_connection *c,
                             uint16_t receiver_port,
                             const uint8_t *data,
                             uint16_t datalen) {
+  // A conexão UDP fica dentro da instância, que é obtida a partir dela
+  mqtt_sn_client_t *client = (mqtt_sn_client_t *)((char *)c - offsetof(mqtt_sn_client_t, con.udp_con));
+
+  (void)sender_port;
+  (void)receiver_addr;
+  (void)receiver_port;
   debug_udp("##########RECEBIDO ALGO VIA UDP!##########");
-  mqtt_sn_recv_parser(data);
+#ifdef MQTT_SN_GW_DISCOVERY
+  // GWINFO/ADVERTISE de qualquer gateway alimentam a tabela de candidatos
+  if (datalen >= 3 && data[0] >= 3 && data[0] <= datalen &&
+      (data[1] == MQTT_SN_TYPE_GWINFO ||
+       data[1] == MQTT_SN_TYPE_ADVERTISE ||
+       data[1] == MQTT_SN_TYPE_SEARCHGW)) {
+    mqtt_sn_gw_recv(client, sender_addr, data);
+    return;
+  }
+#endif
+  // Socket aberto a qualquer origem, os demais pacotes somente do gateway em uso
+  if (!uip_ipaddr_cmp(sender_addr, &client->gw_addr))
+    return;
+  // O datagrama está no uip_buf do Contiki, que o parser pode alterar
+  // (terminador da mensagem) sem cópia
+  mqtt_sn_recv_parser(client, (uint8_t *)data, datalen);
+}
+
+static resp_con_t mqtt_sn_udp_open(mqtt_sn_client_t *client){
+  // O socket aceita qualquer origem e o parser só recebe pacotes do gateway
+  // selecionado (mqtt_sn_udp_rec_cb), a troca de gateway (failover ou
+  // descoberta) não registra o socket novamente
+  if (client->con.ipv6_broker)
+    mqtt_sn_ipv6_addr(&client->gw_addr, client->con.ipv6_broker);
+
+  debug_mqtt("Endereco do broker IPv6: ");
+  uip_debug_ipaddr_print(&client->gw_addr);
+  debug_mqtt("Endereco da porta:%d ",client->con.udp_port);
+
+  if (!simple_udp_register(&client->con.udp_con,
+                           client->con.local_port ? client->con.local_port : client->con.udp_port,
+                           NULL,
+                           client->con.udp_port,
+                           mqtt_sn_udp_rec_cb))
+    return FAIL_CON;
+  return SUCCESS_CON;
+}
+
+resp_con_t mqtt_sn_open_qos_n1(mqtt_sn_client_t *client, mqtt_sn_con_t mqtt_sn_connection){
+  // Modo sem conexão: somente o socket UDP é aberto. Não há CONNECT, fila de
+  // tarefas, PINGREQ nem temporizadores, cada leitura custa um único PUBLISH
+  if (client->recon)
+    return SUCCESS_CON;
+
+  client->con = mqtt_sn_connection;
+  if (!mqtt_sn_udp_open(client))
+    return FAIL_CON;
+
+  // Evita um segundo registro do socket UDP
+  client->recon = true;
+  return SUCCESS_CON;
 }
 
-resp_con_t mqtt_sn_create_sck(mqtt_sn_con_t mqtt_sn_connection, char *topics[], size_t topic_len, mqtt_sn_cb_f cb_f){
-  callback_mqtt = cb_f;
+static void mqtt_sn_session_start(mqtt_sn_client_t *client){
+  /****************************************************************************/
+  // Criando tarefas de [REGISTER]
+  //
+  // Para cada tópico definido pelo usuário no código principal.Inicia-se o pro
+  // cesso de preenchimento de tarefas na fila de serviços MQT-SN.
+  // Primeiro antes de qualquer processo MQTT-SN registra-se todos os tópicos in
+  // formados pelo usuário, otimizando as funções de inscrição e publicação, o
+  // broker irá então responder com os respectivos SHORT TOPIC para utilizarmos.
+  // Tópicos pré-definidos (tools/predefined_topics.conf) já possuem topic id e
+  // não geram tarefas de REGISTER.
+  mqtt_sn_task_t topic_reg = {0};
+  uint16_t pos;
+
+#ifdef MQTT_SN_PERSISTENT_SESSION
+  // Volta a um gateway já utilizado (failover): a sessão mantida por ele é
+  // retomada com os topic ids guardados em RAM, com ou sem o cache em flash.
+  // Sessão nova (CLEAN) no gateway invalida os topic ids guardados dele
+  if (client->gw_switched && mqtt_sn_gw_topics_load(client) > 0) {
+    client->clean_session = false;
+    client->session_resumed = true;
+  }
+#endif
+#ifdef MQTT_SN_TOPIC_CACHE
+  // Reinício do nó (watchdog, atualização de firmware): os topic ids gravados
+  // na flash são reutilizados e a sessão do gateway é retomada sem CLEAN. Se
+  // o gateway não tiver a sessão, o PUBACK com topic id inválido leva a uma
+  // reconexão com CLEAN (mqtt_sn_session_lost)
+  // Após um failover o novo gateway usa o seu próprio arquivo de topic ids
+  if ((!client->recon || client->gw_switched) && mqtt_sn_cache_load(client)) {
+    client->clean_session = false;
+    client->session_resumed = true;
+  }
+#endif
+  client->gw_switched = false;
+#ifdef MQTT_SN_PERSISTENT_SESSION
+  if (client->clean_session)
+    mqtt_sn_gw_topics_drop(client, client->gw_current);
+#endif
+
+  // Somente tópicos sem topic id (nem pré-definido nem recuperado) geram
+  // REGISTER, o mqtt_sn_reg_send escolhe a posição de cada um
+  client->reg_next = 1;
+  for (pos = 1; pos < MAX_TOPIC_USED; pos++){
+    if (client->topic_bind[pos].topic_name == NULL ||
+        client->topic_bind[pos].short_topic_id != MQTT_SN_TOPIC_ID_NONE)
+      continue;
+
+    topic_reg.msg_type_q = MQTT_SN_TYPE_REGISTER;
+    topic_reg.prio = MQTT_SN_PRIO_NORMAL;
+    if (!mqtt_sn_insert_queue(client, topic_reg)) break;
+  }
+  /****************************************************************************/
+
+  process_post(&mqtt_sn_main, mqtt_event_run_task, client);
+}
+
+resp_con_t mqtt_sn_create_sck(mqtt_sn_client_t *client, mqtt_sn_con_t mqtt_sn_connection, char *topics[], size_t topic_len, mqtt_sn_cb_f cb_f){
+  client->callback = cb_f;
   /************************************ RECONEXÃO******************************/
-  topics_len = topic_len;
+  client->topics_len = topic_len;
   size_t t = 0;
   for (t=0; t < topic_len; t++){
-    topics_reconnect[t] = topics[t];
+    client->topics_reconnect[t] = topics[t];
     // debug_mqtt("Armazenando topico: %s",(char *)topics_reconnect[t]);
   }
   /************************************ RECONEXÃO******************************/
 
-  static uip_ipaddr_t broker_addr;
-  static uint8_t con_udp_status = 0;
-
-  g_mqtt_sn_con = mqtt_sn_connection;
-  uip_ip6addr(&broker_addr, *g_mqtt_sn_con.ipv6_broker,
-                            *(g_mqtt_sn_con.ipv6_broker+1),
-                            *(g_mqtt_sn_con.ipv6_broker+2),
-                            *(g_mqtt_sn_con.ipv6_broker+3),
-                            *(g_mqtt_sn_con.ipv6_broker+4),
-                            *(g_mqtt_sn_con.ipv6_broker+5),
-                            *(g_mqtt_sn_con.ipv6_broker+6),
-                            *(g_mqtt_sn_con.ipv6_broker+7));
-
-  if (strlen(g_mqtt_sn_con.client_id) > 23){
-    debug_mqtt("Cli. ID SIZE:%d > 23!",strlen(g_mqtt_sn_con.client_id));
+  client->con = mqtt_sn_connection;
+
+  if (strlen(client->con.client_id) > 23){
+    debug_mqtt("Cli. ID SIZE:%d > 23!",(int)strlen(client->con.client_id));
     return FAIL_CON;
   }
 
-  debug_mqtt("Endereco do broker IPv6: ");
-  uip_debug_ipaddr_print(&broker_addr);
-  debug_mqtt("Endereco da porta:%d ",g_mqtt_sn_con.udp_port);
-  debug_mqtt("Client ID:%s/%d",g_mqtt_sn_con.client_id,strlen(g_mqtt_sn_con.client_id));
-
-
-  if(!g_recon){
-    con_udp_status = simple_udp_register(&g_mqtt_sn_con.udp_con,
-                                          g_mqtt_sn_con.udp_port,
-                                          &broker_addr,
-                                          g_mqtt_sn_con.udp_port,
-                                          mqtt_sn_udp_rec_cb);
-    if(!con_udp_status)
-      return FAIL_CON;
-  }
+  debug_mqtt("Client ID:%s/%d",client->con.client_id,(int)strlen(client->con.client_id));
+
+  if(!client->recon && !mqtt_sn_udp_open(client))
+    return FAIL_CON;
 
-  if (g_mqtt_sn_con.will_topic && g_mqtt_sn_con.will_message)
-    g_will = true;
+  if (client->con.will_topic && client->con.will_message)
+    client->will = true;
 
   /****************************************************************************/
   // Criando tarefa de [CONNECT]
   //
   // Inicialmente precisamos enviar a requisição de CONNECT ao broker MQTT-SN pa
   // ra que seja possível qualquer outra operação.
-  mqtt_sn_task_t connect_task;
+  mqtt_sn_task_t connect_task = {0};
 
   // debug_mqtt("Criando tarefa de CONNECT");
   connect_task.msg_type_q = MQTT_SN_TYPE_CONNECT;
-  mqtt_sn_insert_queue(connect_task);
+  connect_task.prio = MQTT_SN_PRIO_HIGH;
+  mqtt_sn_insert_queue(client, connect_task);
   /****************************************************************************/
 
   /****************************************************************************/
   // Implementação do recurso de [LWT]
   // Verificando se o usuário quer utilizar will topic e will message
-  if (g_mqtt_sn_con.will_topic && g_mqtt_sn_con.will_message){
-    mqtt_sn_task_t will_topic_task;
+  if (client->con.will_topic && client->con.will_message){
+    mqtt_sn_task_t will_topic_task = {0};
     will_topic_task.msg_type_q = MQTT_SN_TYPE_WILLTOPIC;
-    mqtt_sn_insert_queue(will_topic_task);
+    will_topic_task.prio = MQTT_SN_PRIO_HIGH;
+    mqtt_sn_insert_queue(client, will_topic_task);
 
-    mqtt_sn_task_t will_message_task;
+    mqtt_sn_task_t will_message_task = {0};
     will_message_task.msg_type_q = MQTT_SN_TYPE_WILLMSG;
-    mqtt_sn_insert_queue(will_message_task);
+    will_message_task.prio = MQTT_SN_PRIO_HIGH;
+    mqtt_sn_insert_queue(client, will_message_task);
   }
 
   /****************************************************************************/
-  // Criando tarefas de [REGISTER]
-  //
-  // Para cada tópico definido pelo usuário no código principal.Inicia-se o pro
-  // cesso de preenchimento de tarefas na fila de serviços MQT-SN.
-  // Primeiro antes de qualquer processo MQTT-SN registra-se todos os tópicos in
-  // formados pelo usuário, otimizando as funções de inscrição e publicação, o
-  // broker irá então responder com os respectivos SHORT TOPIC para utilizarmos.
-  mqtt_sn_task_t topic_reg;
-
-  // debug_mqtt("Criando tarefa de REGISTER");
+  // Tópicos informados pelo usuário entram no vetor de tópicos, os pré-defini
+  // dos (tools/predefined_topics.conf) já com o topic id
   size_t i;
+  uint16_t pos;
   for(i = 0; i < topic_len; i++){
-    if (g_mqtt_sn_con.will_topic && g_mqtt_sn_con.will_message)
-      g_topic_bind[g_task_id-2].topic_name = topics_reconnect[i]; // Antecipa-se 2 no indíce em função das 2 tasks já alocadas para WILL do LWT
-    else
-      g_topic_bind[g_task_id].topic_name = topics_reconnect[i];
-    topic_reg.msg_type_q = MQTT_SN_TYPE_REGISTER;
-    if (!mqtt_sn_insert_queue(topic_reg)) break;
+    if (mqtt_sn_topic_find(client, client->topics_reconnect[i]) >= 0)
+      continue; // Tópico repetido na lista do usuário
+
+    pos = mqtt_sn_topic_free_slot(client);
+    if (pos == 0) break;
+    client->topic_bind[pos].topic_name = client->topics_reconnect[i];
+    mqtt_sn_topic_index(client, pos);
+    verf_predefined(client, pos);
   }
-  /****************************************************************************/
 
-  process_post(&mqtt_sn_main, mqtt_event_run_task, NULL);
+#ifdef MQTT_SN_GW_DISCOVERY
+  // Sem gateway selecionado a sessão só é iniciada ao fim da descoberta
+  if (client->gw_current < 0) {
+    mqtt_sn_gw_discover(client);
+    return SUCCESS_CON;
+  }
+#else
+  if (client->gw_current < 0) {
+    mqtt_sn_gw_configured(client);
+    if (!mqtt_sn_gw_select(client))
+      return FAIL_CON;
+  }
+#endif
+  mqtt_sn_session_start(client);
 
   return SUCCESS_CON;
 }
 
-void mqtt_sn_init(void){
+void mqtt_sn_init(mqtt_sn_client_t *client){
+  // Estado inicial da instância
+  memset(client, 0, sizeof(*client));
+  client->clean_session = true;
+  client->ping_flag_resp = true;
+  client->rto = MQTT_SN_TIMEOUT_CONNECT;
+  client->gw_current = -1;
+  client->status = MQTTSN_DISCONNECTED;
+  init_vectors(client);
+
+  // Processo e eventos são compartilhados, alocados somente na primeira
+  // instância (process_alloc_event nunca retorna 0)
+  if (mqtt_event_connect)
+    return;
+
   process_start(&mqtt_sn_main, NULL);
 
   // Alocação de número de evento disponível para os eventos do MQTT-SN
@@ -991,70 +2904,66 @@ void mqtt_sn_init(void){
   mqtt_event_connected       = process_alloc_event();
   mqtt_event_will_topicreq   = process_alloc_event();
   mqtt_event_will_messagereq = process_alloc_event();
-
-  init_vectors();
+  mqtt_event_asleep          = process_alloc_event();
 }
 
 void timeout_con(void *ptr){
-  switch (mqtt_status) {
+  mqtt_sn_client_t *client = (mqtt_sn_client_t *)ptr;
+
+  switch (client->status) {
     case MQTTSN_WAITING_CONNACK:
-      if (g_tries_send >= MQTT_SN_RETRY) {
-        g_tries_send = 0;
-        process_post(&mqtt_sn_main,mqtt_event_ping_timeout,NULL);
+      if (client->tries_send >= MQTT_SN_RETRY) {
+        client->tries_send = 0;
+        process_post(&mqtt_sn_main, mqtt_event_ping_timeout, client);
         debug_mqtt("Limite maximo de pacotes CONNECT");
       }
       else{
         debug_mqtt("Expirou tempo de CONNECT");
-        mqtt_sn_con_send();
-        mqtt_status = MQTTSN_WAITING_CONNACK;
-        ctimer_reset(&mqtt_time_connect);
-        g_tries_send++;
+        mqtt_sn_con_send(client);
+        client->status = MQTTSN_WAITING_CONNACK;
+        client->tries_send++;
+        ctimer_set(&client->time_connect, mqtt_sn_rto(client, client->tries_send), timeout_con, client);
       }
     break;
     case MQTTSN_WAITING_REGACK:
-      if (g_tries_send >= MQTT_SN_RETRY) {
-        g_tries_send = 0;
-        process_post(&mqtt_sn_main,mqtt_event_ping_timeout,NULL);
-        debug_mqtt("Limite maximo de pacotes REGISTER");
-      }
-      else{
-        debug_mqtt("Expirou tempo de REGISTER");
-        mqtt_sn_reg_send();
-        mqtt_status = MQTTSN_WAITING_REGACK;
-        ctimer_reset(&mqtt_time_register);
-        g_tries_send++;
+      // Verificação periódica dos prazos de cada REGISTER da janela, a
+      // reconexão ocorre somente se todos os pendentes falharam
+      if (!mqtt_sn_reg_resend(client)) {
+        process_post(&mqtt_sn_main, mqtt_event_ping_timeout, client);
+        debug_mqtt("Limite maximo de pacotes REGISTER, gateway inacessivel");
       }
+      else
+        ctimer_set(&client->time_register, client->rto, timeout_con, client);
     break;
-    case MQTTSN_WAITING_SUBACK:
-      if (g_tries_send >= MQTT_SN_RETRY) {
-        g_tries_send = 0;
-        process_post(&mqtt_sn_main,mqtt_event_ping_timeout,NULL);
-        debug_mqtt("Limite maximo de pacotes SUBSCRIBE");
+    case MQTTSN_WAITING_WILLTOPICREQ:
+      if (client->tries_send >= MQTT_SN_RETRY) {
+        client->tries_send = 0;
+        process_post(&mqtt_sn_main, mqtt_event_ping_timeout, client);
+        debug_mqtt("Limite maximo de pacotes CONNECT para WILL TOPIC");
       }
       else{
-        debug_mqtt("Expirou tempo de SUBSCRIBE");
-        mqtt_sn_sub_send(g_topic_bind[mqtt_queue_first->data.short_topic].topic_name, mqtt_queue_first->data.qos_level);
-        mqtt_status = MQTTSN_WAITING_SUBACK;
-        ctimer_reset(&mqtt_time_subscribe);
-        g_tries_send++;
+        debug_mqtt("Expirou tempo de CONNECT para WILL TOPIC");
+        mqtt_sn_con_send(client);
+        client->status = MQTTSN_WAITING_WILLTOPICREQ;
+        client->tries_send++;
+        ctimer_set(&client->time_connect, mqtt_sn_rto(client, client->tries_send), timeout_con, client);
       }
     break;
-    case MQTTSN_WAITING_WILLTOPICREQ:
-      if (g_tries_send >= MQTT_SN_RETRY) {
-        g_tries_send = 0;
-        process_post(&mqtt_sn_main,mqtt_event_ping_timeout,NULL);
-        debug_mqtt("Limite maximo de pacotes CONNECT para WILL TOPIC");
+    case MQTTSN_WAITING_DISCONNECT:
+      if (client->tries_send >= MQTT_SN_RETRY) {
+        client->tries_send = 0;
+        process_post(&mqtt_sn_main, mqtt_event_ping_timeout, client);
+        debug_mqtt("Limite maximo de pacotes DISCONNECT");
       }
       else{
-        debug_mqtt("Expirou tempo de CONNECT para WILL TOPIC");
-        mqtt_sn_con_send();
-        mqtt_status = MQTTSN_WAITING_WILLTOPICREQ;
-        ctimer_reset(&mqtt_time_connect);
-        g_tries_send++;
+        debug_mqtt("Expirou tempo de DISCONNECT");
+        mqtt_sn_disconnect_send(client, client->sleep_duration);
+        client->tries_send++;
+        ctimer_set(&client->time_connect, mqtt_sn_rto(client, client->tries_send), timeout_con, client);
       }
     break;
     case MQTTSN_CONNECTED:
-      //process_post(&mqtt_sn_main, mqtt_event_run_task, NULL);
+      //process_post(&mqtt_sn_main, mqtt_event_run_task, client);
     break;
     default:
       debug_mqtt("Expirou tempo de estado desconhecido");
@@ -1063,129 +2972,441 @@ void timeout_con(void *ptr){
 }
 
 void timeout_ping_mqtt(void *ptr){
-  //debug_mqtt("\nTentativas PING:%d",g_tries_ping);
-  if (g_ping_flag_resp) {
-    g_ping_flag_resp = false;
-    g_tries_ping = 0;
+  mqtt_sn_client_t *client = (mqtt_sn_client_t *)ptr;
+  clock_time_t period = (clock_time_t)client->con.keep_alive*CLOCK_SECOND;
+  clock_time_t idle, idle_tx;
+
+  // No estado AWAKE somente o PINGRESP encerra a troca, as publicações
+  // retidas chegam antes dele
+  if (client->status != MQTTSN_AWAKE) {
+    // Qualquer pacote recebido após o PINGREQ vale como resposta
+    if (client->rx_since_ping)
+      client->ping_flag_resp = true;
+
+    // Tráfego nos dois sentidos dentro do keep alive dispensa o PINGREQ: o
+    // gateway também precisa ouvir o nó, então vale o mais antigo entre a
+    // última recepção e o último envio
+    idle = clock_time() - client->last_rx;
+    idle_tx = clock_time() - client->last_tx;
+    if (idle_tx > idle)
+      idle = idle_tx;
+    if (client->ping_flag_resp && idle < period) {
+      ctimer_set(&client->time_ping, period - idle, timeout_ping_mqtt, client);
+      return;
+    }
+  }
+
+  //debug_mqtt("\nTentativas PING:%d",tries_ping);
+  if (client->ping_flag_resp) {
+    client->ping_flag_resp = false;
+    client->tries_ping = 0;
     //debug_mqtt("Enviando PING REQUEST");
-    mqtt_sn_ping_send();
+    mqtt_sn_ping_send(client);
+    client->ping_sent_at = clock_time();
+    client->rx_since_ping = false;
   }
   else{
-    if (g_tries_ping >= MQTT_SN_RETRY_PING) {
-      g_tries_ping = 0;
-      ctimer_stop(&mqtt_time_ping);
-      if (mqtt_status != MQTTSN_DISCONNECTED)
-        process_post(&mqtt_sn_main,mqtt_event_ping_timeout,NULL);
+    if (client->tries_ping >= MQTT_SN_RETRY_PING) {
+      client->tries_ping = 0;
+      ctimer_stop(&client->time_ping);
+      if (client->status != MQTTSN_DISCONNECTED)
+        process_post(&mqtt_sn_main, mqtt_event_ping_timeout, client);
       debug_mqtt("Limite tentativas de PING RESPONSE");
     }
     else{
       debug_mqtt("INCREMENTANDO PING");
-      mqtt_sn_ping_send();
-      g_tries_ping++;
+      mqtt_sn_ping_send(client);
+      client->tries_ping++;
+    }
+  }
+  // No estado AWAKE o PINGREQ é uma retransmissão comum, com backoff
+  if (client->status == MQTTSN_AWAKE)
+    ctimer_set(&client->time_ping, mqtt_sn_rto(client, client->tries_ping), timeout_ping_mqtt, client);
+  else
+    ctimer_set(&client->time_ping, period, timeout_ping_mqtt, client);
+}
+
+static int16_t mqtt_sn_offline_pick(mqtt_sn_client_t *client){
+  int16_t best[MQTT_SN_PRIO_CLASSES];
+  mqtt_sn_offline_t *entry;
+  int16_t pos;
+  uint8_t k, c;
+
+  // Mais antiga de cada classe que já pode ser enviada
+  for (c = 0; c < MQTT_SN_PRIO_CLASSES; c++)
+    best[c] = -1;
+  for (k = 0; k < client->offline_len; k++) {
+    entry = mqtt_sn_offline_at(client, k);
+    if (best[entry->prio] >= 0)
+      continue;
+    pos = mqtt_sn_topic_find(client, entry->topic);
+    // Tópico não mais registrado: sai como está e é descartado no envio
+    if (pos < 0 || mqtt_sn_pub_ready(client, pos, entry->prio))
+      best[entry->prio] = k;
+  }
+
+#if MQTT_SN_PRIO_SCHED == MQTT_SN_PRIO_WEIGHTED
+  // Rodada ponderada: cada classe envia até MQTT_SN_PRIO_WEIGHT_x por rodada,
+  // a rodada recomeça quando nenhuma classe com envios restantes tem pendência
+  for (k = 0; k < 2; k++) {
+    for (c = MQTT_SN_PRIO_CLASSES; c-- > 0; )
+      if (best[c] >= 0 && client->prio_credit[c] > 0) {
+        client->prio_credit[c]--;
+        return best[c];
+      }
+    client->prio_credit[MQTT_SN_PRIO_LOW] = MQTT_SN_PRIO_WEIGHT_LOW;
+    client->prio_credit[MQTT_SN_PRIO_NORMAL] = MQTT_SN_PRIO_WEIGHT_NORMAL;
+    client->prio_credit[MQTT_SN_PRIO_HIGH] = MQTT_SN_PRIO_WEIGHT_HIGH;
+  }
+  return -1;
+#else
+  // Prioridade estrita: a classe mais alta com pendência sempre sai primeiro
+  for (c = MQTT_SN_PRIO_CLASSES; c-- > 0; )
+    if (best[c] >= 0)
+      return best[c];
+  return -1;
+#endif
+}
+
+void timeout_offline(void *ptr){
+  mqtt_sn_client_t *client = (mqtt_sn_client_t *)ptr;
+
+  mqtt_sn_offline_t *entry;
+  int16_t i, k;
+
+  if (client->offline_len == 0)
+    return;
+
+  // Nenhuma retida pode ser enviada ainda, verifica novamente após um RTO
+  k = mqtt_sn_offline_pick(client);
+  if (k < 0) {
+    ctimer_set(&client->time_offline, client->rto, timeout_offline, client);
+    return;
+  }
+
+  entry = mqtt_sn_offline_at(client, k);
+  i = mqtt_sn_topic_find(client, entry->topic);
+  if (i < 0) {
+    debug_mqtt("Topico da publicacao offline nao registrado:[%s]",entry->topic);
+    client->offline_dropped++;
+  }
+  else if (!mqtt_sn_pub_send_bin(client, client->topic_bind[i].short_topic_id,
+                                 client->topic_bind[i].topic_type,
+                                 entry->data, entry->len,
+                                 entry->retain, entry->qos)) {
+    // Janela QoS 1/2 cheia, a mesma publicação é tentada no próximo período
+    ctimer_set(&client->time_offline, MQTT_SN_OFFLINE_DRAIN, timeout_offline, client);
+    return;
+  }
+
+  mqtt_sn_offline_remove(client, k);
+#ifdef MQTT_SN_OFFLINE_CFS
+  mqtt_sn_offline_refill(client);
+#endif
+
+  if (client->offline_len > 0)
+    ctimer_set(&client->time_offline, MQTT_SN_OFFLINE_DRAIN, timeout_offline, client);
+  else
+    debug_mqtt("Publicacoes offline enviadas");
+}
+
+#ifdef MQTT_SN_GW_DISCOVERY
+void timeout_gw_search(void *ptr){
+  mqtt_sn_client_t *client = (mqtt_sn_client_t *)ptr;
+  uint32_t window;
+
+  // Fim da janela de respostas do SEARCHGW: inicia a sessão no melhor gateway
+  if (client->gw_search_at != 0 && mqtt_sn_gw_select(client)) {
+    client->gw_search_at = 0;
+    mqtt_sn_session_start(client);
+    return;
+  }
+
+  // Nenhum gateway respondeu: os endereços configurados, se houver, são
+  // utilizados
+  if (client->gw_tries >= MQTT_SN_GW_SEARCH_TRIES) {
+    mqtt_sn_gw_configured(client);
+    if (mqtt_sn_gw_select(client)) {
+      debug_mqtt("Nenhum gateway encontrado, utilizando o broker configurado");
+      client->gw_search_at = 0;
+      mqtt_sn_session_start(client);
+      return;
+    }
+  }
+
+  // Janela dobra a cada busca sem resposta, limitada a MQTT_SN_RTO_MAX
+  window = MQTT_SN_GW_SEARCH_WINDOW;
+  window <<= client->gw_tries < 8 ? client->gw_tries : 8;
+  if (window > MQTT_SN_RTO_MAX)
+    window = MQTT_SN_RTO_MAX;
+  if (client->gw_tries < 0xFF)
+    client->gw_tries++;
+
+  mqtt_sn_gw_search_send(client);
+  ctimer_set(&client->time_gw, window, timeout_gw_search, client);
+}
+#endif
+
+void timeout_sleep(void *ptr){
+  mqtt_sn_client_t *client = (mqtt_sn_client_t *)ptr;
+
+  if (client->status != MQTTSN_ASLEEP)
+    return;
+
+  if (client->sleep_left > 0)
+    mqtt_sn_sleep_arm(client);
+  else
+    mqtt_sn_wake(client);
+}
+
+void timeout_subscribe(void *ptr){
+  mqtt_sn_client_t *client = (mqtt_sn_client_t *)ptr;
+  bool pending = false;
+  uint8_t i;
+
+  for (i = 0; i < MQTT_SN_SUB_WINDOW; i++) {
+    if (client->sub_window[i].message_id == 0x0000)
+      continue;
+    pending = true;
+
+    // Cada SUBSCRIBE possui seu próprio prazo e contador de tentativas, um
+    // SUBACK perdido não atrasa os demais
+    if ((clock_time_t)(clock_time() - client->sub_window[i].sent_at) < client->sub_window[i].timeout)
+      continue;
+
+    if (client->sub_window[i].tries >= MQTT_SN_RETRY) {
+      // Somente esta inscrição é abandonada, a decisão de reconectar cabe ao
+      // keep alive (timeout_ping_mqtt). A posição liberada na janela é
+      // ocupada pelos próximos SUBSCRIBEs da fila, como em um SUBACK
+      debug_mqtt("Limite maximo de pacotes SUBSCRIBE:[%d]",client->sub_window[i].message_id);
+      if (client->sub_window[i].wildcard == NULL)
+        client->topic_bind[client->sub_window[i].pos].subscribed = 0x00;
+      else if (client->wildcard_sub == client->sub_window[i].wildcard)
+        client->wildcard_sub = NULL;
+      client->sub_window[i].message_id = 0x0000;
+      if (client->status != MQTTSN_DISCONNECTED)
+        process_post(&mqtt_sn_main, mqtt_event_suback, client);
+      continue;
+    }
+
+    debug_mqtt("Expirou tempo de SUBSCRIBE:[%d]",client->sub_window[i].message_id);
+    client->sub_window[i].tries++;
+    mqtt_sn_sub_req_send(client, &client->sub_window[i]);
+  }
+
+  if (pending)
+    ctimer_set(&client->time_subscribe, client->rto, timeout_subscribe, client);
+}
+
+void timeout_coalesce(void *ptr){
+  mqtt_sn_coalesce_t *c = (mqtt_sn_coalesce_t *)ptr;
+  mqtt_sn_client_t *client = c->client;
+
+  if (!mqtt_sn_coalesce_send(client, c))
+    ctimer_reset(&c->timer);
+}
+
+void timeout_inflight(void *ptr){
+  mqtt_sn_client_t *client = (mqtt_sn_client_t *)ptr;
+  size_t i;
+  bool pending = false;
+
+  for (i = 0; i < MQTT_SN_QOS1_WINDOW; i++) {
+    if (client->inflight[i].message_id == 0x0000)
+      continue;
+    pending = true;
+
+    // Durante a reconexão os topic ids ainda não são válidos, as publicações
+    // permanecem na janela até o broker voltar a aceitá-las
+    if (!unlock_tasks(client) ||
+        (clock_time_t)(clock_time() - client->inflight[i].sent_at) < client->inflight[i].timeout)
+      continue;
+
+    if (client->inflight[i].tries >= MQTT_SN_RETRY) {
+      debug_mqtt("Limite maximo de PUBLISH QoS 1/2:[%d]",client->inflight[i].message_id);
+      client->inflight[i].message_id = 0x0000;
+      if (client->status != MQTTSN_DISCONNECTED)
+        process_post(&mqtt_sn_main, mqtt_event_ping_timeout, client);
+      continue;
+    }
+
+    debug_mqtt("Expirou tempo de PUBLISH QoS 1/2:[%d]",client->inflight[i].message_id);
+    mqtt_sn_pub_encode(client, client->inflight[i].topic_id,
+                       client->inflight[i].flags | MQTT_SN_FLAG_DUP,
+                       client->inflight[i].message_id,
+                       client->inflight[i].data,
+                       client->inflight[i].data_len);
+    client->inflight[i].sent_at = clock_time();
+    client->inflight[i].tries++;
+    client->inflight[i].timeout = mqtt_sn_rto(client, client->inflight[i].tries);
+  }
+
+  // Trocas QoS 2: cada entrada envelhece um período do temporizador (RTO
+  // atual) antes de
+  // ser retransmitida (PUBREL enviado) ou descartada (PUBREL não recebido)
+  for (i = 0; i < MQTT_SN_QOS2_MAX; i++) {
+    if (client->qos2[i].message_id == 0x0000)
+      continue;
+    pending = true;
+
+    if (!(client->qos2[i].state & MQTT_SN_QOS2_AGED)) {
+      client->qos2[i].state |= MQTT_SN_QOS2_AGED;
+      continue;
+    }
+
+    if ((client->qos2[i].state & MQTT_SN_QOS2_TRIES) >= MQTT_SN_RETRY) {
+      debug_mqtt("Limite maximo de troca QoS 2:[%d]",client->qos2[i].message_id);
+      if (!(client->qos2[i].state & MQTT_SN_QOS2_INBOUND) && client->status != MQTTSN_DISCONNECTED)
+        process_post(&mqtt_sn_main, mqtt_event_ping_timeout, client);
+      client->qos2[i].message_id = 0x0000;
+      continue;
+    }
+
+    client->qos2[i].state++;
+    if (!(client->qos2[i].state & MQTT_SN_QOS2_INBOUND) && unlock_tasks(client)) {
+      debug_mqtt("Expirou tempo de PUBREL:[%d]",client->qos2[i].message_id);
+      mqtt_sn_msg_id_send(client, MQTT_SN_TYPE_PUBREL, client->qos2[i].message_id);
     }
   }
-  ctimer_reset(&mqtt_time_ping);
+
+  if (pending)
+    ctimer_set(&client->time_inflight, client->rto, timeout_inflight, client);
 }
 
 PROCESS_THREAD(mqtt_sn_main, ev, data){
+  mqtt_sn_client_t *client;
+
   PROCESS_BEGIN();
 
   debug_mqtt("Inicio do processo MQTT-SN");
 
   while(1) {
       PROCESS_WAIT_EVENT();
+      // Os eventos do MQTT-SN trazem a instância de origem
+      client = (mqtt_sn_client_t *)data;
       /*************************** CONNECT MQTT-SN ****************************/
       if (ev == mqtt_event_connect &&
-          mqtt_status == MQTTSN_DISCONNECTED){
-        mqtt_sn_con_send();
-        if (g_mqtt_sn_con.will_topic && g_mqtt_sn_con.will_message)
-          mqtt_status = MQTTSN_WAITING_WILLTOPICREQ;
+          client->status == MQTTSN_DISCONNECTED){
+        mqtt_sn_con_send(client);
+        if (client->con.will_topic && client->con.will_message)
+          client->status = MQTTSN_WAITING_WILLTOPICREQ;
         else
-          mqtt_status = MQTTSN_WAITING_CONNACK;
-        ctimer_set(&mqtt_time_connect, MQTT_SN_TIMEOUT_CONNECT, timeout_con, NULL);
-        g_tries_send = 0;
+          client->status = MQTTSN_WAITING_CONNACK;
+        ctimer_set(&client->time_connect, mqtt_sn_rto(client, 0), timeout_con, client);
+        client->tries_send = 0;
       }
       else if(ev == mqtt_event_connack){
-        mqtt_status = MQTTSN_CONNECTED;
+        client->status = MQTTSN_CONNECTED;
         debug_mqtt("Conectado ao broker MQTT-SN");
-        ctimer_stop(&mqtt_time_connect);
-        mqtt_sn_delete_queue(); // Deleta requisição de CONNECT já que estamos conectados;
+        ctimer_stop(&client->time_connect);
+        if (client->gw_current >= 0)
+          client->gw[client->gw_current].fails = 0;
+        if (client->tries_send == 0)
+          mqtt_sn_rtt_sample(client, client->connect_sent_at);
+        mqtt_sn_delete_queue(client); // Deleta requisição de CONNECT já que estamos conectados;
+        #ifdef MQTT_SN_PERSISTENT_SESSION
+          // Sessão estabelecida no gateway, as próximas reconexões a retomam
+          client->clean_session = false;
+        #else
+          // CONNECT sem CLEAN apenas para sair do modo dormindo
+          client->clean_session = true;
+        #endif
         // Iniciamos o PING Request a partir deste momento
-        ctimer_set(&mqtt_time_ping, g_mqtt_sn_con.keep_alive*CLOCK_SECOND , timeout_ping_mqtt, NULL);
-        process_post(&mqtt_sn_main, mqtt_event_run_task, NULL);
+        ctimer_set(&client->time_ping, client->con.keep_alive*CLOCK_SECOND , timeout_ping_mqtt, client);
+        process_post(&mqtt_sn_main, mqtt_event_run_task, client);
       }
 
       /************************** WILL TOPIC MQTT-SN **************************/
       if(ev == mqtt_event_will_topicreq){
-        mqtt_status = MQTTSN_WAITING_WILLMSGREQ;
-        mqtt_sn_will_topic_send();
-        mqtt_sn_delete_queue();
+        client->status = MQTTSN_WAITING_WILLMSGREQ;
+        mqtt_sn_will_topic_send(client);
+        mqtt_sn_delete_queue(client);
       }
 
       /************************** WILL MESSAGE MQTT-SN ************************/
       else if(ev == mqtt_event_will_messagereq){
-        mqtt_sn_delete_queue();
-        mqtt_sn_will_message_send();
-        mqtt_status = MQTTSN_WAITING_CONNACK;
+        mqtt_sn_delete_queue(client);
+        mqtt_sn_will_message_send(client);
+        client->status = MQTTSN_WAITING_CONNACK;
       }
 
       /*************************** REGISTER MQTT-SN ***************************/
-      else if(ev == mqtt_event_register &&
-              mqtt_queue_first->data.msg_type_q == MQTT_SN_TYPE_REGISTER){
-        mqtt_sn_reg_send();
-        mqtt_status = MQTTSN_WAITING_REGACK;
-        ctimer_set(&mqtt_time_register, MQTT_SN_TIMEOUT, timeout_con, NULL);
-        g_tries_send = 0;
+      else if(ev == mqtt_event_register && !mqtt_sn_check_empty(client) &&
+              client->queue_first->msg_type_q == MQTT_SN_TYPE_REGISTER){
+        // Até MQTT_SN_REG_WINDOW REGISTERs seguem juntos, sem esperar o REGACK
+        // cada um com seu message id e prazo, verificados a cada RTO
+        mqtt_sn_reg_fill(client);
+        client->status = MQTTSN_WAITING_REGACK;
+        ctimer_set(&client->time_register, client->rto, timeout_con, client);
       }
-      else if(ev == mqtt_event_regack &&
-              mqtt_queue_first->data.msg_type_q == MQTT_SN_TYPE_REGISTER){
-        mqtt_sn_delete_queue(); // Deleta requisição de REGISTER
-        ctimer_stop(&mqtt_time_register);
-        debug_mqtt("Topico registrado no broker");
-
-        if (!mqtt_sn_check_empty())
-          process_post(&mqtt_sn_main, mqtt_event_run_task, NULL); // Gera evento de processo de tasks
-        else{
-          mqtt_status = MQTTSN_TOPIC_REGISTERED;
-          process_post(&mqtt_sn_main, mqtt_event_connected, NULL); // Gera evento de processo de tasks
+      else if(ev == mqtt_event_regack && !mqtt_sn_check_empty(client) &&
+              client->queue_first->msg_type_q == MQTT_SN_TYPE_REGISTER){
+        mqtt_sn_delete_queue(client); // Deleta uma requisição de REGISTER
+        debug_mqtt("REGISTER concluido (REGACK ou limite de tentativas)");
+
+        // Ainda há REGISTERs na fila: a posição liberada na janela é ocupada
+        // pelo próximo tópico, os pendentes mantêm os próprios prazos
+        if (!mqtt_sn_check_empty(client) &&
+            client->queue_first->msg_type_q == MQTT_SN_TYPE_REGISTER)
+          mqtt_sn_reg_fill(client);
+        else {
+          ctimer_stop(&client->time_register);
+          #ifdef MQTT_SN_TOPIC_CACHE
+            mqtt_sn_cache_save(client); // Fim dos REGISTERs, uma única gravação em flash
+          #endif
+          if (!mqtt_sn_check_empty(client))
+            process_post(&mqtt_sn_main, mqtt_event_run_task, client); // Gera evento de processo de tasks
+          else{
+            client->status = MQTTSN_TOPIC_REGISTERED;
+            process_post(&mqtt_sn_main, mqtt_event_connected, client); // Gera evento de processo de tasks
+          }
         }
       }
 
       /*************************** RUN TASKS MQTT-SN **************************/
+      else if(ev == mqtt_event_run_task && mqtt_sn_check_empty(client)){
+        client->status = MQTTSN_TOPIC_REGISTERED;
+        debug_task("Nenhuma tarefa a ser processada!");
+      }
       else if(ev == mqtt_event_run_task){
         char *teste;
-        parse_mqtt_type_string(mqtt_queue_first->data.msg_type_q,&teste);
+        parse_mqtt_type_string(client->queue_first->msg_type_q,&teste);
         debug_task("Task a executar:%s",teste);
-        switch (mqtt_queue_first->data.msg_type_q) {
+        switch (client->queue_first->msg_type_q) {
           case MQTT_SN_TYPE_CONNECT:
-            process_post(&mqtt_sn_main, mqtt_event_connect, NULL);
+            #ifdef MQTT_SN_GW_DISCOVERY
+              // CONNECT somente após a escolha do gateway (timeout_gw_search)
+              if (client->gw_current < 0)
+                break;
+            #endif
+            process_post(&mqtt_sn_main, mqtt_event_connect, client);
           break;
           case MQTT_SN_TYPE_PUBLISH:
-            process_post(&mqtt_sn_main, mqtt_event_pub_qos_0, NULL);
+            process_post(&mqtt_sn_main, mqtt_event_pub_qos_0, client);
           break;
           case MQTT_SN_TYPE_SUBSCRIBE:
-            process_post(&mqtt_sn_main,mqtt_event_subscribe,NULL);
+            process_post(&mqtt_sn_main, mqtt_event_subscribe, client);
           break;
           case MQTT_SN_TYPE_REGISTER:
-            process_post(&mqtt_sn_main, mqtt_event_register, NULL);
+            process_post(&mqtt_sn_main, mqtt_event_register, client);
           break;
           case MQTT_SN_TYPE_SUB_WILDCARD:
-            mqtt_sn_sub_send_wildcard(topic_temp_wildcard, mqtt_queue_first->data.qos_level);
+            process_post(&mqtt_sn_main, mqtt_event_subscribe, client);
           break;
           case MQTT_SN_TYPE_WILLTOPIC:
           break;
           case MQTT_SN_TYPE_WILLMSG:
           break;
           default:
-            mqtt_status = MQTTSN_TOPIC_REGISTERED;
+            client->status = MQTTSN_TOPIC_REGISTERED;
             debug_task("Nenhuma tarefa a ser processada!");
           break;
         }
       }
 
       /********************** PUBLISH QoS 0 - MQTT-SN *************************/
-      else if(ev == mqtt_event_pub_qos_0 &&
-              mqtt_queue_first->data.msg_type_q == MQTT_SN_TYPE_PUBLISH){
+      else if(ev == mqtt_event_pub_qos_0 && !mqtt_sn_check_empty(client) &&
+              client->queue_first->msg_type_q == MQTT_SN_TYPE_PUBLISH){
         // Este evento de "mqtt_event_pub_qos_0" só ocorre quando não conhecemos
         // o tópico e precisamos registra, caso contrário a API desenvolvida
         // envia direto pro broker sem criar task, testes mostraram que a criação
@@ -1196,49 +3417,79 @@ PROCESS_THREAD(mqtt_sn_main, ev, data){
         // do tópico recém registrado
         size_t j = 0;
         for (j=0; j < MAX_TOPIC_USED; j++)
-          if (g_topic_bind[j].short_topic_id == 0xFF)
+          if (client->topic_bind[j].short_topic_id == MQTT_SN_TOPIC_ID_NONE)
             break;
-        mqtt_sn_pub_send(g_topic_bind[j-1].topic_name,
-                         g_message_bind,
-                         mqtt_queue_first->data.retain,
-                         mqtt_queue_first->data.qos_level);
-        mqtt_sn_delete_queue(); // Deleta requisição de PUBLISH
-        if (!mqtt_sn_check_empty())
-          process_post(&mqtt_sn_main, mqtt_event_run_task, NULL); // Inicia outras tasks caso a fila não esteja vazia
+        mqtt_sn_pub_send(client, client->topic_bind[j-1].topic_name,
+                         client->message_bind,
+                         client->queue_first->retain,
+                         client->queue_first->qos_level);
+        mqtt_sn_delete_queue(client); // Deleta requisição de PUBLISH
+        if (!mqtt_sn_check_empty(client))
+          process_post(&mqtt_sn_main, mqtt_event_run_task, client); // Inicia outras tasks caso a fila não esteja vazia
       }
 
       /*************************** SUBSCRIBE MQTT-SN **************************/
-      else if(ev == mqtt_event_subscribe &&
-              mqtt_queue_first->data.msg_type_q == MQTT_SN_TYPE_SUBSCRIBE){
-        mqtt_sn_sub_send(g_topic_bind[mqtt_queue_first->data.short_topic].topic_name, mqtt_queue_first->data.qos_level);
-        mqtt_status = MQTTSN_WAITING_SUBACK;
-        ctimer_set(&mqtt_time_subscribe, 3*MQTT_SN_TIMEOUT, timeout_con, NULL);
-        g_tries_send = 0;
+      else if(ev == mqtt_event_subscribe){
+        // Os SUBSCRIBEs do início da fila seguem juntos enquanto houver
+        // posição livre em sub_window, cada um com seu message id
+        while (!mqtt_sn_check_empty(client) &&
+               (client->queue_first->msg_type_q == MQTT_SN_TYPE_SUBSCRIBE ||
+                client->queue_first->msg_type_q == MQTT_SN_TYPE_SUB_WILDCARD) &&
+               mqtt_sn_sub_req_free(client) != NULL) {
+          if (client->queue_first->msg_type_q == MQTT_SN_TYPE_SUBSCRIBE)
+            mqtt_sn_sub_send(client, client->topic_bind[client->queue_first->short_topic].topic_name, client->queue_first->qos_level);
+          else
+            mqtt_sn_sub_send_wildcard(client, client->topic_temp_wildcard, client->queue_first->qos_level);
+          mqtt_sn_delete_queue(client); // Deleta requisição de SUBSCRIBE, o SUBACK é aguardado na tabela
+        }
+
+        if (!mqtt_sn_check_empty(client) &&
+            (client->queue_first->msg_type_q == MQTT_SN_TYPE_SUBSCRIBE ||
+             client->queue_first->msg_type_q == MQTT_SN_TYPE_SUB_WILDCARD))
+          client->status = MQTTSN_WAITING_SUBACK; // Tabela cheia, aguarda um SUBACK
+        else if (!mqtt_sn_check_empty(client))
+          process_post(&mqtt_sn_main, mqtt_event_run_task, client); // Gera evento de processo de tasks
+        else
+          client->status = MQTTSN_TOPIC_REGISTERED; // Libera publicações e outra operações, caso não haja mais tasks para fazer
       }
-      else if(ev == mqtt_event_suback &&
-              mqtt_queue_first->data.msg_type_q == MQTT_SN_TYPE_SUBSCRIBE){
-        mqtt_sn_delete_queue(); // Deleta requisição de SUBSCRIBE
-        ctimer_stop(&mqtt_time_subscribe);
+      else if(ev == mqtt_event_suback && !mqtt_sn_check_empty(client) &&
+              (client->queue_first->msg_type_q == MQTT_SN_TYPE_SUBSCRIBE ||
+               client->queue_first->msg_type_q == MQTT_SN_TYPE_SUB_WILDCARD)){
         debug_mqtt("Topico inscrito no broker");
-        if (!mqtt_sn_check_empty())
-          process_post(&mqtt_sn_main, mqtt_event_run_task, NULL); // Gera evento de processo de tasks
-        else
-          mqtt_status = MQTTSN_TOPIC_REGISTERED; // Libera publicações e outra operações, caso não haja mais tasks para fazer
+        process_post(&mqtt_sn_main, mqtt_event_subscribe, client);
+      }
+
+      /************************ SLEEPING CLIENT - MQTT-SN *********************/
+      else if(ev == mqtt_event_asleep){
+        // DISCONNECT(duration) confirmado ou PINGRESP após as mensagens
+        // retidas: o PINGREQ periódico é suspenso até o fim do sono
+        ctimer_stop(&client->time_connect);
+        ctimer_stop(&client->time_ping);
+        client->status = MQTTSN_ASLEEP;
+        client->ping_flag_resp = true;
+        client->sleep_left = client->sleep_duration;
+        mqtt_sn_sleep_arm(client);
+        debug_mqtt("Cliente dormindo");
       }
 
       /********************** PING REQUEST - MQTT-SN **************************/
       else if(ev == mqtt_event_ping_timeout){
-        ctimer_stop(&mqtt_time_connect);
-        ctimer_stop(&mqtt_time_register);
-        ctimer_stop(&mqtt_time_ping);
-        ctimer_stop(&mqtt_time_subscribe);
+        ctimer_stop(&client->time_connect);
+        ctimer_stop(&client->time_register);
+        ctimer_stop(&client->time_ping);
+        ctimer_stop(&client->time_subscribe);
+        ctimer_stop(&client->time_sleep);
 
-        mqtt_status = MQTTSN_DISCONNECTED;
+        client->status = MQTTSN_DISCONNECTED;
         debug_mqtt("Desconectado broker");
         #ifdef MQTT_SN_AUTO_RECONNECT
-          g_recon = true;
-          init_vectors();
-          mqtt_sn_create_sck(g_mqtt_sn_con, topics_reconnect, topics_len, callback_mqtt);
+          client->recon = true;
+          // Gateway em silêncio: havendo outro candidato a sessão segue nele
+          mqtt_sn_gw_failover(client);
+          if (!client->clean_session)
+            mqtt_sn_session_resume(client);
+          else
+            mqtt_sn_session_clean(client);
         #endif
       }
   }
@@ -29,6 +29,10 @@
 #ifndef MQTT__SN_H
 #define MQTT__SN_H
 
+#ifdef MQTT_SN_POSIX
+// Build para Linux (make linux), API do Contiki emulada em posix/
+#include "mqtt_sn_posix.h"
+#else
 #include "simple-udp.h"
 #include "clock.h"
 #include "etimer.h"
@@ -36,6 +40,7 @@
 #include "list.h"
 #include "net/ip/uip-debug.h"
 #include "sys/ctimer.h"
+#endif
 #include <stdbool.h>
 
 /*! \addtogroup MQTT_SN_DEBUG
@@ -60,25 +65,25 @@
 #ifdef DEBUG_TASK
 #define debug_task(fmt, args...) printf("\n[Tarefa] "fmt, ##args)
 #else
-#define debug_task(fmt, ...)
+#define debug_task(fmt, ...) do { } while (0)
 #endif
 
 #ifdef DEBUG_OS
 #define debug_os(fmt, args...) printf("\n[DEMO] "fmt, ##args)
 #else
-#define debug_os(fmt, ...)
+#define debug_os(fmt, ...) do { } while (0)
 #endif
 
 #ifdef DEBUG_MQTT_SN
 #define debug_mqtt(fmt, args...) printf("\n[MQTT-SN] "fmt, ##args)
 #else
-#define debug_mqtt(fmt, ...)
+#define debug_mqtt(fmt, ...) do { } while (0)
 #endif
 
 #ifdef DEBUG_UDP
 #define debug_udp(fmt, args...) printf("\n[UDP] "fmt, ##args)
 #else
-#define debug_udp(fmt, ...)
+#define debug_udp(fmt, ...) do { } while (0)
 #endif
 
 /*! \addtogroup MQTT_SN_CONTROL
@@ -120,12 +125,16 @@
 #define MQTT_SN_TOPIC_TYPE_NORMAL     (0x00)
 #define MQTT_SN_TOPIC_TYPE_PREDEFINED (0x01)
 #define MQTT_SN_TOPIC_TYPE_SHORT      (0x02)
+#define MQTT_SN_TOPIC_TYPE_MASK       (0x03)
+
+#define MQTT_SN_TOPIC_ID_NONE         (0xFFFF) /**< Topic id reservado pela especificação, indica tópico ainda sem topic id */
 
 #define MQTT_SN_FLAG_DUP     (0x1 << 7)
 #define MQTT_SN_FLAG_QOS_0   (0x0 << 5)
 #define MQTT_SN_FLAG_QOS_1   (0x1 << 5)
 #define MQTT_SN_FLAG_QOS_2   (0x2 << 5)
 #define MQTT_SN_FLAG_QOS_N1  (0x3 << 5)
+#define MQTT_SN_FLAG_QOS_MASK (0x3 << 5)
 #define MQTT_SN_FLAG_RETAIN  (0x1 << 4)
 #define MQTT_SN_FLAG_WILL    (0x1 << 3)
 #define MQTT_SN_FLAG_CLEAN   (0x1 << 2)
@@ -148,12 +157,140 @@
 */
 #define ss(x) sizeof(x)/sizeof(*x)               /**< Computa o tamanho de um vetor de ponteiros */
 #define MQTT_SN_AUTO_RECONNECT                   /**< Define se o dispositivo deve se auto conectar de tempos em tempos */
+//#define MQTT_SN_PERSISTENT_SESSION             /**< Reconexões sem a flag CLEAN, mantendo topic ids e inscrições (somente CONNECT/CONNACK) */
+//#define MQTT_SN_TOPIC_CACHE                    /**< Grava os topic ids em flash (CFS/Coffee) e os reutiliza após reinício (requer MQTT_SN_PERSISTENT_SESSION) */
+#ifndef MQTT_SN_TOPIC_CACHE_FILE
+#define MQTT_SN_TOPIC_CACHE_FILE  "mqtt_sn_ids"  /**< Prefixo (até 11 caracteres) dos arquivos CFS de topic ids, um por gateway */
+#endif
+#define MQTT_SN_TOPIC_CACHE_MAGIC 0x4D02         /**< Identificador e versão do formato do arquivo de topic ids */
 #define MQTT_SN_RETRY_PING        5              /**< Número de tentativas de envio de PING REQUEST antes de desconectar nó <-> broker */
-#define MQTT_SN_TIMEOUT_CONNECT   9*CLOCK_SECOND /**< Tempo base para comunicação MQTT-SN broker <-> nó */
+#define MQTT_SN_TIMEOUT_CONNECT   9*CLOCK_SECOND /**< Tempo de retransmissão inicial, utilizado até a primeira amostra de RTT */
 #define MQTT_SN_TIMEOUT           3*CLOCK_SECOND   /**< Tempo base para comunicação MQTT-SN broker <-> nó */
 #define MQTT_SN_RETRY             5              /**< Número de tentativas de enviar qualquer pacote ao broker antes de desconectar */
-#define MAX_QUEUE_MQTT_SN         100            /**< Número máximo de tarefas a serem inseridas alocadas dinamicamente MQTT-SN */
-#define MAX_TOPIC_USED            100            /**< Número máximo de tópicos que o usuário pode registrar, a API cria um conjunto de estruturas para o bind de topic e short topic id */
+#define MQTT_SN_SLEEP_STEP        60             /**< Passo (s) da temporização do sono, cabe em clock_time_t de 16 bits */
+#ifndef MQTT_SN_RTO_MIN
+#define MQTT_SN_RTO_MIN           (CLOCK_SECOND/2) /**< Limite inferior do tempo de retransmissão estimado pelo RTT */
+#endif
+#ifndef MQTT_SN_RTO_MAX
+#define MQTT_SN_RTO_MAX           60*CLOCK_SECOND /**< Limite superior do tempo de retransmissão, inclusive com backoff */
+#endif
+#ifndef MAX_QUEUE_MQTT_SN
+#define MAX_QUEUE_MQTT_SN         16             /**< Número máximo de tarefas de cada classe na fila MQTT-SN (tamanho de cada anel estático de tarefas, um REGISTER/SUBSCRIBE por tópico) */
+#endif
+#define MQTT_SN_QOS1_WINDOW       4              /**< Número máximo de publicações QoS 1/2 aguardando PUBACK/PUBREC ao mesmo tempo (janela) */
+#define MQTT_SN_INFLIGHT_PAYLOAD  64             /**< Bytes de payload armazenados por publicação da janela QoS 1/2 para retransmissão */
+#define MQTT_SN_QOS2_MAX          32             /**< Número máximo de trocas QoS 2 em andamento (3 bytes cada) aguardando PUBCOMP ou PUBREL */
+#define MQTT_SN_TOPIC_NAME_POOL   256            /**< Bytes reservados para os nomes de tópicos registrados pelo broker (REGISTER via wildcard) */
+#ifndef MAX_TOPIC_USED
+#define MAX_TOPIC_USED            16             /**< Número máximo de tópicos que o usuário pode registrar, a API cria um conjunto de estruturas para o bind de topic e short topic id (max. 16384) */
+#endif
+#ifndef MQTT_SN_TOPIC_HASH_SIZE
+/* Posições dos índices hash de tópicos por nome e por topic id: menor
+ * potência de 2 maior ou igual a 2*MAX_TOPIC_USED, fator de carga máximo de
+ * 50% sem reservar posições além do necessário */
+#if   2*MAX_TOPIC_USED <= 16
+#define MQTT_SN_TOPIC_HASH_SIZE   16
+#elif 2*MAX_TOPIC_USED <= 32
+#define MQTT_SN_TOPIC_HASH_SIZE   32
+#elif 2*MAX_TOPIC_USED <= 64
+#define MQTT_SN_TOPIC_HASH_SIZE   64
+#elif 2*MAX_TOPIC_USED <= 128
+#define MQTT_SN_TOPIC_HASH_SIZE   128
+#elif 2*MAX_TOPIC_USED <= 256
+#define MQTT_SN_TOPIC_HASH_SIZE   256
+#elif 2*MAX_TOPIC_USED <= 512
+#define MQTT_SN_TOPIC_HASH_SIZE   512
+#elif 2*MAX_TOPIC_USED <= 1024
+#define MQTT_SN_TOPIC_HASH_SIZE   1024
+#elif 2*MAX_TOPIC_USED <= 2048
+#define MQTT_SN_TOPIC_HASH_SIZE   2048
+#elif 2*MAX_TOPIC_USED <= 4096
+#define MQTT_SN_TOPIC_HASH_SIZE   4096
+#elif 2*MAX_TOPIC_USED <= 8192
+#define MQTT_SN_TOPIC_HASH_SIZE   8192
+#elif 2*MAX_TOPIC_USED <= 16384
+#define MQTT_SN_TOPIC_HASH_SIZE   16384
+#else
+#define MQTT_SN_TOPIC_HASH_SIZE   32768
+#endif
+#endif
+#ifndef MQTT_SN_REG_WINDOW
+#define MQTT_SN_REG_WINDOW        4              /**< Número máximo de REGISTER aguardando REGACK ao mesmo tempo (correlacionados pelo message id) */
+#endif
+#ifndef MQTT_SN_SUB_WINDOW
+#define MQTT_SN_SUB_WINDOW        4              /**< Número máximo de SUBSCRIBE aguardando SUBACK ao mesmo tempo (correlacionados pelo message id) */
+#endif
+#ifndef MQTT_SN_COALESCE_TOPICS
+#define MQTT_SN_COALESCE_TOPICS   2              /**< Número de tópicos que podem agrupar amostras ao mesmo tempo (mqtt_sn_pub_coalesce) */
+#endif
+#ifndef MQTT_SN_COALESCE_WINDOW
+#define MQTT_SN_COALESCE_WINDOW   5*CLOCK_SECOND /**< Janela de agrupamento: tempo máximo entre a primeira amostra e o envio do PUBLISH */
+#endif
+#ifndef MQTT_SN_COALESCE_BUDGET
+#define MQTT_SN_COALESCE_BUDGET   (MQTT_SN_OFFLINE_PAYLOAD-1) /**< Bytes de amostras por PUBLISH agrupado, menor que MQTT_SN_OFFLINE_PAYLOAD para caber (com o terminador) na fila offline */
+#endif
+#define MQTT_SN_COALESCE_SEP      ';'            /**< Separador entre amostras agrupadas no payload */
+#define MQTT_SN_PRIO_STRICT       0              /**< Publicações retidas: a classe mais alta sempre sai primeiro */
+#define MQTT_SN_PRIO_WEIGHTED     1              /**< Publicações retidas: rodada ponderada entre as classes (MQTT_SN_PRIO_WEIGHT_x) */
+#ifndef MQTT_SN_PRIO_SCHED
+#define MQTT_SN_PRIO_SCHED        MQTT_SN_PRIO_STRICT /**< Escalonamento das publicações retidas entre as classes de prioridade */
+#endif
+#ifndef MQTT_SN_PRIO_WEIGHT_HIGH
+#define MQTT_SN_PRIO_WEIGHT_HIGH   4             /**< Envios por rodada ponderada da classe MQTT_SN_PRIO_HIGH */
+#endif
+#ifndef MQTT_SN_PRIO_WEIGHT_NORMAL
+#define MQTT_SN_PRIO_WEIGHT_NORMAL 2             /**< Envios por rodada ponderada da classe MQTT_SN_PRIO_NORMAL */
+#endif
+#ifndef MQTT_SN_PRIO_WEIGHT_LOW
+#define MQTT_SN_PRIO_WEIGHT_LOW    1             /**< Envios por rodada ponderada da classe MQTT_SN_PRIO_LOW */
+#endif
+#define MQTT_SN_OFFLINE_DROP_OLDEST 0            /**< Fila offline cheia: descarta a publicação retida mais antiga */
+#define MQTT_SN_OFFLINE_DROP_NEWEST 1            /**< Fila offline cheia: descarta a nova publicação */
+#ifndef MQTT_SN_OFFLINE_POLICY
+#define MQTT_SN_OFFLINE_POLICY    MQTT_SN_OFFLINE_DROP_OLDEST /**< Política de descarte da fila offline */
+#endif
+#ifndef MQTT_SN_OFFLINE_SLOTS
+#define MQTT_SN_OFFLINE_SLOTS     8              /**< Publicações retidas em RAM enquanto a sessão não está pronta (1 a 255) */
+#endif
+#ifndef MQTT_SN_OFFLINE_PAYLOAD
+#define MQTT_SN_OFFLINE_PAYLOAD   24             /**< Bytes de payload por publicação retida */
+#endif
+#ifndef MQTT_SN_OFFLINE_DRAIN
+#define MQTT_SN_OFFLINE_DRAIN     (CLOCK_SECOND/4) /**< Intervalo entre os envios das publicações retidas após a reconexão */
+#endif
+//#define MQTT_SN_OFFLINE_CFS                    /**< Transborda a fila offline cheia para um arquivo CFS/Coffee */
+#ifndef MQTT_SN_OFFLINE_CFS_FILE
+#define MQTT_SN_OFFLINE_CFS_FILE  "mqtt_sn_off"  /**< Nome do arquivo CFS das publicações retidas */
+#endif
+#ifndef MQTT_SN_OFFLINE_CFS_MAX
+#define MQTT_SN_OFFLINE_CFS_MAX   64             /**< Publicações gravadas no arquivo até ele esvaziar e ser recriado */
+#endif
+//#define MQTT_SN_GW_DISCOVERY                   /**< Descobre o gateway por SEARCHGW/GWINFO/ADVERTISE, ipv6_broker passa a ser apenas a alternativa */
+#ifndef MQTT_SN_GW_MAX
+#define MQTT_SN_GW_MAX            4              /**< Gateways candidatos ao mesmo tempo (configurados e descobertos) */
+#endif
+#ifndef MQTT_SN_GW_TOPICS
+#define MQTT_SN_GW_TOPICS         16             /**< Topic ids guardados em RAM, de todos os gateways, para o failover (requer MQTT_SN_PERSISTENT_SESSION) */
+#endif
+#ifndef MQTT_SN_GW_SEARCH_ADDR
+#define MQTT_SN_GW_SEARCH_ADDR    {0xff03, 0, 0, 0, 0, 0, 0, 0x1} /**< Destino multicast do SEARCHGW: realm-local alcança a malha com UIP_CONF_IPV6_MULTICAST, ff02::1 restringe a busca aos vizinhos */
+#endif
+#ifndef MQTT_SN_GW_RADIUS
+#define MQTT_SN_GW_RADIUS         0              /**< Campo Radius do SEARCHGW (0: toda a rede) */
+#endif
+#ifndef MQTT_SN_GW_SEARCH_JITTER
+#define MQTT_SN_GW_SEARCH_JITTER  CLOCK_SECOND   /**< Atraso aleatório máximo antes do primeiro SEARCHGW */
+#endif
+#ifndef MQTT_SN_GW_SEARCH_WINDOW
+#define MQTT_SN_GW_SEARCH_WINDOW  2*CLOCK_SECOND /**< Espera pelas respostas GWINFO, dobra a cada busca sem resposta */
+#endif
+#ifndef MQTT_SN_GW_SEARCH_TRIES
+#define MQTT_SN_GW_SEARCH_TRIES   3              /**< SEARCHGW sem resposta antes de utilizar ipv6_broker (se configurado) */
+#endif
+#ifndef MQTT_SN_GW_HOP_COST
+#define MQTT_SN_GW_HOP_COST       (CLOCK_SECOND/8) /**< Custo somado ao RTT por unidade de hop limit abaixo do maior recebido entre os gateways */
+#endif
+#define MQTT_SN_GW_HOP_LIMIT_UNKNOWN 0           /**< Hop limit desconhecido (gateway conhecido somente por ADVERTISE ou configuração) */
 /** @}*/
 
 /*! \addtogroup Pacotes
@@ -175,6 +312,21 @@ typedef struct __attribute__((packed)){
   uint16_t duration;
 } disconnect_packet_t;
 
+/** @struct searchgw_packet_t
+ *  @brief Estrutura de pacote MQTT-SN do tipo SEARCHGW
+ *  @var searchgw_packet_t::length
+ *    Comprimento do pacote
+ *  @var searchgw_packet_t::msg_type
+ *    Tipo de mensagem
+ *  @var searchgw_packet_t::radius
+ *    Alcance em saltos da busca
+ */
+typedef struct __attribute__((packed)){
+  uint8_t length;
+  uint8_t msg_type;
+  uint8_t radius;
+} searchgw_packet_t;
+
 /** @struct ping_req_t
  *  @brief Estrutura de pacote de desconexão do broker MQTT-SN
  *  @var ping_req_t::length
@@ -214,6 +366,42 @@ typedef struct __attribute__((packed)){
   char data[MQTT_SN_MAX_PACKET_LENGTH-7];
 } publish_packet_t;
 
+/** @struct puback_packet_t
+ *  @brief Estrutura de pacote MQTT-SN do tipo PUBACK
+ *  @var puback_packet_t::length
+ *    Comprimento do pacote
+ *  @var puback_packet_t::type
+ *    Tipo de mensagem
+ *  @var puback_packet_t::topic_id
+ *    Topic id da publicação reconhecida
+ *  @var puback_packet_t::message_id
+ *    Identificador da publicação reconhecida
+ *  @var puback_packet_t::return_code
+ *    Código de retorno
+ */
+typedef struct __attribute__((packed)){
+  uint8_t length;
+  uint8_t type;
+  uint16_t topic_id;
+  uint16_t message_id;
+  uint8_t return_code;
+} puback_packet_t;
+
+/** @struct msg_id_packet_t
+ *  @brief Estrutura de pacotes MQTT-SN do tipo PUBREC, PUBREL e PUBCOMP
+ *  @var msg_id_packet_t::length
+ *    Comprimento do pacote
+ *  @var msg_id_packet_t::type
+ *    Tipo de mensagem
+ *  @var msg_id_packet_t::message_id
+ *    Identificador da publicação QoS 2 correspondente
+ */
+typedef struct __attribute__((packed)){
+  uint8_t length;
+  uint8_t type;
+  uint16_t message_id;
+} msg_id_packet_t;
+
 /** @struct subscribe_wildcard_packet_t
  *  @brief Estrutura de pacote de inscrição do tipo Wildcard MQTT-SN
  *  @var subscribe_wildcard_packet_t::length
@@ -356,11 +544,31 @@ typedef struct __attribute__((packed)){
 } regack_packet_t;
 /** @}*/
 
+/** @typedef mqtt_sn_client_t
+ *  @brief Instância do cliente MQTT-SN (struct mqtt_sn_client)
+ */
+typedef struct mqtt_sn_client mqtt_sn_client_t;
+
+/** @typedef mqtt_sn_topic_pos_t
+ *  @brief Posição+1 em topic_bind guardada nos índices hash (0 indica vazio),
+ *  com 1 byte por entrada enquanto os tópicos couberem em 8 bits
+ */
+#if MAX_TOPIC_USED < 254
+typedef uint8_t  mqtt_sn_topic_pos_t;
+#else
+typedef uint16_t mqtt_sn_topic_pos_t;
+#endif
+
 /** @typedef mqtt_sn_cb_f
  *  @brief Tipo de função de callback que deve ser repassada ao broker
  */
 typedef void (*mqtt_sn_cb_f)(char *,char *);
 
+/** @typedef mqtt_sn_bin_cb_f
+ *  @brief Tipo de função de callback para payloads binários (tópico, ponteiro do payload e comprimento)
+ */
+typedef void (*mqtt_sn_bin_cb_f)(char *,const uint8_t *,uint8_t);
+
 /** @struct mqtt_sn_task_t
  *  @brief Estrutura de tarefa de fila MQTT-SN
  *  @var mqtt_sn_task_t::msg_type_q
@@ -371,26 +579,290 @@ typedef void (*mqtt_sn_cb_f)(char *,char *);
  *    Nível QoS da tarefa a ser alocada na pilha
  *  @var mqtt_sn_task_t::id_task
  *    Identificador da tarefa
+ *  @var mqtt_sn_task_t::prio
+ *    Classe da tarefa (mqtt_sn_prio_t), define o anel da fila que a recebe
  */
 typedef struct {
   uint8_t  msg_type_q;
-  uint8_t  short_topic;
+  uint16_t short_topic;
   uint16_t id_task;
   uint8_t  qos_level;
   uint8_t  retain;
+  uint8_t  prio;
 } mqtt_sn_task_t;
 
-/** @struct node
- *  @brief Estrutura de fila MQTT-SN
- *  @var data
- *    Tarefa a ser processada
- *  @var link
- *    Link para a próxima tarefa
+/** @struct mqtt_sn_task_ring_t
+ *  @brief Fila circular de tarefas de uma classe de prioridade
+ *  @var mqtt_sn_task_ring_t::task
+ *    Pool estático de tarefas da classe
+ *  @var mqtt_sn_task_ring_t::head
+ *    Índice da tarefa mais antiga da classe
+ *  @var mqtt_sn_task_ring_t::len
+ *    Quantidade de tarefas da classe
+ */
+typedef struct {
+  mqtt_sn_task_t task[MAX_QUEUE_MQTT_SN];
+  uint8_t        head;
+  uint8_t        len;
+} mqtt_sn_task_ring_t;
+
+/** @struct mqtt_sn_inflight_t
+ *  @brief Publicação QoS 1 aguardando PUBACK
+ *  @var mqtt_sn_inflight_t::message_id
+ *    Identificador da mensagem (0x0000 indica posição livre na janela)
+ *  @var mqtt_sn_inflight_t::topic_id
+ *    Topic id utilizado na publicação
+ *  @var mqtt_sn_inflight_t::flags
+ *    Flags do PUBLISH (QoS, retain e tipo de tópico), sem a flag DUP
+ *  @var mqtt_sn_inflight_t::tries
+ *    Número de retransmissões realizadas
+ *  @var mqtt_sn_inflight_t::sent_at
+ *    Instante do último envio
+ *  @var mqtt_sn_inflight_t::timeout
+ *    Tempo de retransmissão deste envio (RTO com backoff e jitter)
+ *  @var mqtt_sn_inflight_t::data_len
+ *    Comprimento do payload
+ *  @var mqtt_sn_inflight_t::data
+ *    Cópia do payload para retransmissão
+ */
+typedef struct {
+  uint16_t     message_id;
+  uint16_t     topic_id;
+  uint8_t      flags;
+  uint8_t      tries;
+  clock_time_t sent_at;
+  clock_time_t timeout;
+  uint8_t      data_len;
+  uint8_t      data[MQTT_SN_INFLIGHT_PAYLOAD];
+} mqtt_sn_inflight_t;
+
+/*! \addtogroup MQTT_SN_CONTROL
+*  Estado compacto das trocas QoS 2
+*  @{
+*/
+#define MQTT_SN_QOS2_INBOUND  (0x80) /**< Troca iniciada pelo broker (aguardando PUBREL) */
+#define MQTT_SN_QOS2_AGED     (0x40) /**< Entrada sem resposta há pelo menos um período do temporizador */
+#define MQTT_SN_QOS2_TRIES    (0x07) /**< Número de retransmissões/períodos expirados */
+/** @}*/
+
+/** @struct mqtt_sn_sub_req_t
+ *  @brief SUBSCRIBE aguardando SUBACK
+ *  @var mqtt_sn_sub_req_t::message_id
+ *    Identificador da mensagem (0x0000 indica posição livre na tabela)
+ *  @var mqtt_sn_sub_req_t::pos
+ *    Posição do tópico em topic_bind
+ *  @var mqtt_sn_sub_req_t::wildcard
+ *    Nome do tópico wildcard (NULL para tópicos do vetor de tópicos)
+ *  @var mqtt_sn_sub_req_t::qos
+ *    Nível de QoS da inscrição
+ *  @var mqtt_sn_sub_req_t::tries
+ *    Número de retransmissões realizadas
+ *  @var mqtt_sn_sub_req_t::sent_at
+ *    Instante do último envio
+ *  @var mqtt_sn_sub_req_t::timeout
+ *    Tempo de retransmissão deste envio (RTO com backoff e jitter)
+ */
+typedef struct {
+  uint16_t     message_id;
+  uint16_t     pos;
+  char         *wildcard;
+  uint8_t      qos;
+  uint8_t      tries;
+  clock_time_t sent_at;
+  clock_time_t timeout;
+} mqtt_sn_sub_req_t;
+
+/** @struct mqtt_sn_reg_req_t
+ *  @brief REGISTER aguardando REGACK
+ *  @var mqtt_sn_reg_req_t::message_id
+ *    Identificador da mensagem (0x0000 indica posição livre na janela)
+ *  @var mqtt_sn_reg_req_t::pos
+ *    Posição do tópico em topic_bind
+ *  @var mqtt_sn_reg_req_t::tries
+ *    Número de retransmissões realizadas
+ *  @var mqtt_sn_reg_req_t::sent_at
+ *    Instante do último envio
+ *  @var mqtt_sn_reg_req_t::timeout
+ *    Tempo de retransmissão deste envio (RTO com backoff e jitter)
+ */
+typedef struct {
+  uint16_t     message_id;
+  uint16_t     pos;
+  uint8_t      tries;
+  clock_time_t sent_at;
+  clock_time_t timeout;
+} mqtt_sn_reg_req_t;
+
+/** @struct mqtt_sn_coalesce_t
+ *  @brief Amostras de um tópico aguardando envio em um único PUBLISH
+ *  @var mqtt_sn_coalesce_t::topic
+ *    Tópico das amostras (NULL indica posição livre)
+ *  @var mqtt_sn_coalesce_t::timer
+ *    Temporizador da janela de agrupamento
+ *  @var mqtt_sn_coalesce_t::retain
+ *    Identificador de mensagem retentiva
+ *  @var mqtt_sn_coalesce_t::qos
+ *    Nível de QoS da publicação
+ *  @var mqtt_sn_coalesce_t::prio
+ *    Classe de prioridade da publicação (mqtt_sn_prio_t)
+ *  @var mqtt_sn_coalesce_t::len
+ *    Bytes ocupados em data
+ *  @var mqtt_sn_coalesce_t::data
+ *    Amostras separadas por MQTT_SN_COALESCE_SEP
+ *  @var mqtt_sn_coalesce_t::client
+ *    Instância dona das amostras (timeout_coalesce)
+ */
+typedef struct {
+  mqtt_sn_client_t *client;
+  char          *topic;
+  struct ctimer timer;
+  bool          retain;
+  int8_t        qos;
+  uint8_t       prio;
+  uint8_t       len;
+  char          data[MQTT_SN_COALESCE_BUDGET+1];
+} mqtt_sn_coalesce_t;
+
+/** @typedef mqtt_sn_prio_t
+ *  @brief Classes de prioridade das publicações
+ *
+ *  A fila de tarefas possui um anel por classe e executa primeiro a classe
+ *  mais alta: CONNECT e LWT são MQTT_SN_PRIO_HIGH, REGISTER é
+ *  MQTT_SN_PRIO_NORMAL e SUBSCRIBE é MQTT_SN_PRIO_LOW. Uma publicação só
+ *  espera as tarefas de classe igual ou maior
+ *  @var mqtt_sn_prio_t::MQTT_SN_PRIO_LOW
+ *    Dados de fundo, saem por último e esperam também os SUBSCRIBEs
+ *  @var mqtt_sn_prio_t::MQTT_SN_PRIO_NORMAL
+ *    Uso geral, espera os REGISTERs mas não os SUBSCRIBEs
+ *  @var mqtt_sn_prio_t::MQTT_SN_PRIO_HIGH
+ *    Alarmes: enviados logo após o CONNACK, sem esperar REGISTER/SUBSCRIBE
+ */
+typedef enum {
+  MQTT_SN_PRIO_LOW,
+  MQTT_SN_PRIO_NORMAL,
+  MQTT_SN_PRIO_HIGH,
+  MQTT_SN_PRIO_CLASSES
+} mqtt_sn_prio_t;
+
+/** @struct mqtt_sn_offline_t
+ *  @brief Publicação retida enquanto a sessão não está pronta
+ *  @var mqtt_sn_offline_t::topic
+ *    Nome do tópico (ponteiro do usuário)
+ *  @var mqtt_sn_offline_t::retain
+ *    Flag de retenção
+ *  @var mqtt_sn_offline_t::qos
+ *    Nível de QoS da publicação
+ *  @var mqtt_sn_offline_t::prio
+ *    Classe de prioridade (mqtt_sn_prio_t)
+ *  @var mqtt_sn_offline_t::len
+ *    Comprimento do payload
+ *  @var mqtt_sn_offline_t::data
+ *    Cópia do payload
+ */
+typedef struct {
+  char     *topic;
+  bool     retain;
+  int8_t   qos;
+  uint8_t  prio;
+  uint8_t  len;
+  uint8_t  data[MQTT_SN_OFFLINE_PAYLOAD];
+} mqtt_sn_offline_t;
+
+/** @struct mqtt_sn_gw_t
+ *  @brief Gateway conhecido pela descoberta (MQTT_SN_GW_DISCOVERY)
+ *  @var mqtt_sn_gw_t::addr
+ *    Endereço IPv6 do gateway
+ *  @var mqtt_sn_gw_t::last_seen
+ *    Instante do último GWINFO/ADVERTISE recebido
+ *  @var mqtt_sn_gw_t::rtt
+ *    RTT suavizado medido pelo SEARCHGW/GWINFO (0: desconhecido)
+ *  @var mqtt_sn_gw_t::duration
+ *    Intervalo (s) entre ADVERTISE informado pelo gateway (0: desconhecido)
+ *  @var mqtt_sn_gw_t::gw_id
+ *    Identificador do gateway
+ *  @var mqtt_sn_gw_t::hop_limit
+ *    Hop limit do último GWINFO, como recebido (MQTT_SN_GW_HOP_LIMIT_UNKNOWN: desconhecido)
+ *  @var mqtt_sn_gw_t::fails
+ *    Perdas do gateway desde o último CONNACK, menos falhas tem preferência
+ */
+typedef struct {
+  uip_ipaddr_t addr;
+  clock_time_t last_seen;
+  clock_time_t rtt;
+  uint16_t     duration;
+  uint8_t      gw_id;
+  uint8_t      hop_limit;
+  uint8_t      fails;
+} mqtt_sn_gw_t;
+
+/** @struct mqtt_sn_gw_topic_t
+ *  @brief Topic id atribuído por um gateway, reutilizado ao voltar a ele
+ *  @var mqtt_sn_gw_topic_t::topic_name
+ *    Nome do tópico (NULL indica posição livre)
+ *  @var mqtt_sn_gw_topic_t::topic_id
+ *    Topic id recebido no REGACK
+ *  @var mqtt_sn_gw_topic_t::gw
+ *    Posição em gw do gateway que atribuiu o topic id
+ */
+typedef struct {
+  char     *topic_name;
+  uint16_t topic_id;
+  int8_t   gw;
+} mqtt_sn_gw_topic_t;
+
+/** @struct mqtt_sn_qos2_t
+ *  @brief Troca QoS 2 em andamento, compactada em 3 bytes
+ *  @var mqtt_sn_qos2_t::message_id
+ *    Identificador da mensagem (0x0000 indica posição livre)
+ *  @var mqtt_sn_qos2_t::state
+ *    Direção, envelhecimento e tentativas (MQTT_SN_QOS2_*)
+ */
+typedef struct __attribute__((packed)){
+  uint16_t message_id;
+  uint8_t  state;
+} mqtt_sn_qos2_t;
+
+/** @struct mqtt_sn_cache_hdr_t
+ *  @brief Cabeçalho do arquivo de topic ids em flash
+ *  @var mqtt_sn_cache_hdr_t::magic
+ *    MQTT_SN_TOPIC_CACHE_MAGIC
+ *  @var mqtt_sn_cache_hdr_t::fingerprint
+ *    Hash de 32 bits do endereço/porta do broker e do client id da sessão
+ *  @var mqtt_sn_cache_hdr_t::gw_addr
+ *    Endereço do gateway que atribuiu os topic ids
+ *  @var mqtt_sn_cache_hdr_t::udp_port
+ *    Porta UDP do gateway
+ *  @var mqtt_sn_cache_hdr_t::client_id
+ *    Client id da sessão (até 23 caracteres, completado com zeros)
+ *  @var mqtt_sn_cache_hdr_t::count
+ *    Número de entradas mqtt_sn_cache_entry_t que seguem o cabeçalho
+ */
+typedef struct __attribute__((packed)){
+  uint16_t magic;
+  uint32_t fingerprint;
+  uint8_t  gw_addr[16];
+  uint16_t udp_port;
+  char     client_id[24];
+  uint16_t count;
+} mqtt_sn_cache_hdr_t;
+
+/** @struct mqtt_sn_cache_entry_t
+ *  @brief Entrada do arquivo de topic ids em flash
+ *  @var mqtt_sn_cache_entry_t::topic_id
+ *    Topic id recebido no REGACK
+ *  @var mqtt_sn_cache_entry_t::hash
+ *    Hash do nome do tópico (mesmo do índice topic_hash)
+ *  @var mqtt_sn_cache_entry_t::fingerprint
+ *    Hash de 32 bits (FNV-1a) do nome do tópico
+ *  @var mqtt_sn_cache_entry_t::name_len
+ *    Comprimento do nome do tópico, gravado logo após a entrada
  */
-struct node {
-    mqtt_sn_task_t data;
-    struct node *link;
-}*mqtt_queue_first, *mqtt_queue_last;
+typedef struct __attribute__((packed)){
+  uint16_t topic_id;
+  uint16_t hash;
+  uint32_t fingerprint;
+  uint8_t  name_len;
+} mqtt_sn_cache_entry_t;
 
 /** @typedef resp_con_t
  *  @brief Tipo de erros de funções
@@ -410,8 +882,11 @@ typedef enum resp_con{
  */
 typedef struct {
    char *topic_name;
-   uint8_t short_topic_id;
+   uint16_t hash;
+   uint16_t short_topic_id;
    uint8_t subscribed;
+   uint8_t sub_qos;
+   uint8_t topic_type;
 } short_topics_t;
 
 /** @typedef mqtt_sn_status_t
@@ -423,6 +898,9 @@ typedef enum {
   MQTTSN_WAITING_CONNACK,
   MQTTSN_WAITING_WILLTOPICREQ,
   MQTTSN_WAITING_WILLMSGREQ,
+  MQTTSN_WAITING_DISCONNECT,
+  MQTTSN_ASLEEP,
+  MQTTSN_AWAKE,
   MQTTSN_WAITING_REGACK,
   MQTTSN_CONNECTED,
   MQTTSN_TOPIC_REGISTERED,
@@ -441,11 +919,17 @@ typedef enum {
  *  @var mqtt_sn_con_t::udp_port
  *    Porta UDP de conexão com o broker (default:1884)
  *  @var mqtt_sn_con_t::ipv6_broker
- *    Endereço IPv6 do broker UDP
+ *    Endereço IPv6 do broker UDP (com MQTT_SN_GW_DISCOVERY, alternativa caso nenhum gateway responda; NULL para nenhuma)
  *  @var mqtt_sn_con_t::keep_alive
  *    Tempo de requisição Keep Alive para PINGREQ e PINGRESP
  *  @var mqtt_sn_con_t::client_id
  *    Identificador de cliente para conexão com o broker MQTT-SN
+ *  @var mqtt_sn_con_t::ipv6_gateways
+ *    Gateways reservas, utilizados em ordem quando o atual para de responder (0x00 para nenhum)
+ *  @var mqtt_sn_con_t::gateways_len
+ *    Quantidade de endereços em ipv6_gateways
+ *  @var mqtt_sn_con_t::local_port
+ *    Porta UDP local (0: udp_port), distinta para cada instância do mesmo nó
  */
 typedef struct {
   struct simple_udp_connection udp_con;
@@ -455,45 +939,138 @@ typedef struct {
   const char* client_id;
   char *will_topic;
   char *will_message;
+  uint16_t (*ipv6_gateways)[8];
+  uint8_t  gateways_len;
+  uint16_t local_port;
 } mqtt_sn_con_t;
 
+/** @struct mqtt_sn_client
+ *  @brief Estado de uma sessão MQTT-SN. Cada instância (mqtt_sn_init) é
+ *  independente das demais, somente o processo mqtt_sn_main e seus eventos
+ *  são compartilhados
+ */
+struct mqtt_sn_client {
+  struct ctimer time_connect;                            /**< Estrutura de temporização para envio de CONNECT */
+  struct ctimer time_register;                           /**< Estrutura de temporização para envio de REGISTER */
+  struct ctimer time_ping;                               /**< Estrutura de temporização para envio de PING */
+  struct ctimer time_subscribe;                          /**< Estrutura de temporização para retransmissão de SUBSCRIBE */
+  struct ctimer time_inflight;                           /**< Estrutura de temporização para retransmissão de PUBLISH QoS 1 */
+  struct ctimer time_sleep;                              /**< Estrutura de temporização do período ASLEEP (cliente dormindo) */
+  struct ctimer time_offline;                            /**< Estrutura de temporização do envio das publicações retidas offline */
+#ifdef MQTT_SN_GW_DISCOVERY
+  struct ctimer time_gw;                                 /**< Estrutura de temporização da descoberta de gateways (SEARCHGW) */
+#endif
+  bool recon;                                            /**< Identificador de reconexão evitando dupla conexão UDP aberta */
+  bool will;                                             /**< Identificador de utilização de LWT */
+  bool clean_session;                                    /**< Envia o próximo CONNECT com a flag CLEAN (descarta a sessão no gateway) */
+  bool session_resumed;                                  /**< Sessão atual retomada sem CLEAN, tabela de topic ids mantida */
+  uint16_t sleep_duration;                               /**< Duração (s) informada no DISCONNECT do cliente dormindo */
+  uint16_t sleep_left;                                   /**< Segundos restantes até acordar e buscar as mensagens retidas */
+#ifdef MQTT_SN_TOPIC_CACHE
+  bool cache_dirty;                                      /**< Tabela de topic ids alterada desde a última gravação em flash */
+#endif
+  bool ping_flag_resp;                                   /**< Identificador de resposta ao PING REQUEST */
+  char *message_bind;                                    /**< Buffer temporário para o envio de mensagens do tipo publicação no caso de tarefas */
+  char *topic_temp_wildcard;                             /**< Buffer temporário para o armazenamento do buffer de inscrição wildcard */
+  char *wildcard_sub;                                    /**< Última inscrição wildcard do usuário, refeita após CONNECT com CLEAN */
+  uint8_t wildcard_qos;                                  /**< Nível de QoS da inscrição wildcard_sub */
+  uint8_t tries_send;                                    /**< Identificador de tentativas de envio */
+  uint8_t tries_ping;                                    /**< Identificador de tentativas de envio de PING REQUEST */
+  int32_t srtt;                                          /**< RTT suavizado em ticks (x8), 0 indica nenhuma amostra */
+  int32_t rttvar;                                        /**< Variação do RTT em ticks (x4) */
+  clock_time_t rto;                                      /**< Tempo de retransmissão atual (sem backoff) */
+  clock_time_t connect_sent_at;                          /**< Instante do CONNECT/WILLMSG, amostra de RTT no CONNACK */
+  clock_time_t ping_sent_at;                             /**< Instante do PINGREQ de keep alive, amostra de RTT no PINGRESP */
+  clock_time_t last_rx;                                  /**< Instante do último pacote válido recebido do gateway */
+  clock_time_t last_tx;                                  /**< Instante do último pacote enviado ao gateway */
+  bool rx_since_ping;                                    /**< Pacote recebido após o último PINGREQ (comprova a conexão) */
+  uint8_t task_id;                                       /**< Identificador unitário de tarefa incremental */
+  short_topics_t topic_bind[MAX_TOPIC_USED];             /**< Vetor que armazena a relação nome do tópico com short topic id */
+  mqtt_sn_topic_pos_t topic_hash[MQTT_SN_TOPIC_HASH_SIZE]; /**< Índice hash (endereçamento aberto) nome do tópico -> posição+1 em topic_bind */
+  mqtt_sn_topic_pos_t topic_id_hash[MQTT_SN_TOPIC_HASH_SIZE]; /**< Índice hash (endereçamento aberto) topic id -> posição+1 em topic_bind */
+  mqtt_sn_con_t con;                                     /**< Estrutura principal da conexão MQTT */
+  uip_ipaddr_t gw_addr;                                  /**< Endereço do gateway em uso (configurado ou descoberto) */
+  mqtt_sn_gw_t gw[MQTT_SN_GW_MAX];                       /**< Gateways candidatos (configurados e descobertos por GWINFO/ADVERTISE) */
+  uint8_t gw_len;                                        /**< Quantidade de gateways em gw */
+  int8_t gw_current;                                     /**< Posição em gw do gateway selecionado (-1 antes da seleção) */
+  bool gw_switched;                                      /**< Gateway trocado (failover), seus topic ids vêm de gw_topics e do cache */
+#ifdef MQTT_SN_PERSISTENT_SESSION
+  mqtt_sn_gw_topic_t gw_topics[MQTT_SN_GW_TOPICS];       /**< Topic ids por gateway, preenchidos pelos REGACKs e restaurados no failover */
+#endif
+#ifdef MQTT_SN_GW_DISCOVERY
+  clock_time_t gw_search_at;                             /**< Instante do último SEARCHGW, 0 fora da janela de respostas */
+  uint8_t gw_tries;                                      /**< SEARCHGW enviados sem nenhum gateway conhecido */
+#endif
+  mqtt_sn_status_t status;                               /**< ASM principal do MQTT-SN */
+  char *topics_reconnect[MAX_TOPIC_USED];                /**< Vetor de tópicos [reconexão] */
+  uint16_t topics_len;                                   /**< Comprimento total de tópicos fornecidos pelo usuário [reconexão] */
+  mqtt_sn_cb_f callback;                                 /**< Callback de recebimento das mensagens (mqtt_sn_create_sck) */
+  mqtt_sn_bin_cb_f callback_bin;                         /**< Callback opcional de payload binário (ponteiro + comprimento) */
+  mqtt_sn_task_ring_t queue[MQTT_SN_PRIO_CLASSES];       /**< Fila de tarefas, um anel estático por classe de prioridade */
+  mqtt_sn_task_t *queue_first;                           /**< Tarefa em execução: início do anel da classe mais alta no momento da escolha (NULL quando a fila está vazia) */
+  uint8_t queue_len;                                     /**< Quantidade de tarefas presentes na fila (todas as classes) */
+  char topic_name_pool[MQTT_SN_TOPIC_NAME_POOL];         /**< Armazena os nomes de tópicos registrados pelo broker */
+  uint16_t topic_name_pool_len;                          /**< Bytes utilizados em topic_name_pool */
+  mqtt_sn_inflight_t inflight[MQTT_SN_QOS1_WINDOW];      /**< Janela de publicações QoS 1/2 aguardando PUBACK/PUBREC */
+  mqtt_sn_qos2_t qos2[MQTT_SN_QOS2_MAX];                 /**< Trocas QoS 2 aguardando PUBCOMP (enviadas) ou PUBREL (recebidas) */
+  uint16_t msg_id;                                       /**< Último message id utilizado em publicações QoS > 0 */
+  mqtt_sn_offline_t offline[MQTT_SN_OFFLINE_SLOTS];      /**< Publicações retidas durante a desconexão (fila circular) */
+  uint8_t offline_head;                                  /**< Índice da publicação retida mais antiga */
+  uint8_t offline_len;                                   /**< Quantidade de publicações retidas em RAM */
+  uint16_t offline_dropped;                              /**< Publicações descartadas por falta de espaço (overflow) */
+#if MQTT_SN_PRIO_SCHED == MQTT_SN_PRIO_WEIGHTED
+  uint8_t prio_credit[MQTT_SN_PRIO_CLASSES];             /**< Envios restantes de cada classe na rodada ponderada */
+#endif
+#ifdef MQTT_SN_OFFLINE_CFS
+  uint16_t spill_rd;                                     /**< Entradas do arquivo offline já movidas para a RAM */
+  uint16_t spill_wr;                                     /**< Entradas gravadas no arquivo offline desde sua criação */
+#endif
+  mqtt_sn_coalesce_t coalesce[MQTT_SN_COALESCE_TOPICS];  /**< Amostras aguardando envio agrupado por tópico */
+  mqtt_sn_reg_req_t reg_window[MQTT_SN_REG_WINDOW];      /**< REGISTERs aguardando REGACK, correlacionados pelo message id */
+  uint16_t reg_next;                                     /**< Próxima posição de topic_bind candidata a REGISTER na sessão */
+  mqtt_sn_sub_req_t sub_window[MQTT_SN_SUB_WINDOW];      /**< SUBSCRIBEs aguardando SUBACK, correlacionados pelo message id */
+};
+
 /** @brief Insere uma tarefa na fila
  *
  * 		Insere uma nova tarefa na fila de requisições a serem processadas.
+ *    A tarefa é copiada, em O(1), para o anel estático da sua classe
+ *    (mqtt_sn_task_t::prio) de MAX_QUEUE_MQTT_SN posições, sem alocação
+ *    dinâmica de memória. A próxima tarefa executada é a mais antiga da
+ *    classe mais alta, sem interromper a que estiver em andamento.
  *
+ *  @param [in] client Instância do cliente MQTT-SN (mqtt_sn_init)
  *  @param [in] new Nova tarefa a ser processada pela ASM do MQTT-SN
  *
- *  @retval FAIL_CON         Não foi possível alocar uma nova tarefa a fila
- *  @retval SUCCESS_CON      Foi possível alocar uma nova tarefa a fila
- *
- * 	@todo		Melhorar alocação dinâmica de memória
+ *  @retval FAIL_CON         Classe inválida ou anel da classe cheio, não foi possível inserir a tarefa
+ *  @retval SUCCESS_CON      Foi possível inserir a tarefa na fila
  **/
-resp_con_t mqtt_sn_insert_queue(mqtt_sn_task_t new);
+resp_con_t mqtt_sn_insert_queue(mqtt_sn_client_t *client, mqtt_sn_task_t new);
 
 /** @brief Remove o elemento mais próximo de ser processado
  *
- * 		Realiza a remoção do elemento mais próximo de ser processado, no caso o
- *    mais antigo inserido na fila
+ * 		Realiza a remoção da tarefa em execução (queue_first) e escolhe a
+ *    próxima: a mais antiga da classe mais alta com tarefas pendentes
  *
- *  @param [in] 0 Não recebe argumento
+ *  @param [in] client Instância do cliente MQTT-SN (mqtt_sn_init)
  *
  *  @retval 0 Não retorna nada
  *
  * 	@todo	Adicionar opção de exclusão intermediária
  **/
-void mqtt_sn_delete_queue();
+void mqtt_sn_delete_queue(mqtt_sn_client_t *client);
 
 /** @brief Lista as tarefas da fila
  *
- * 		Percorre os links dos ponteiros listando os elementos a serem
+ * 		Percorre a fila circular listando os elementos a serem
  *    processados pela ASM do MQTT-SN
  *
- *  @param [in] 0 Não recebe argumento
+ *  @param [in] client Instância do cliente MQTT-SN (mqtt_sn_init)
  *
  *  @retval 0 Não retorna nada
  *
  **/
-void mqtt_sn_check_queue();
+void mqtt_sn_check_queue(mqtt_sn_client_t *client);
 
 /** @brief Envia requisição de conexão ao broker MQTT-SN
  *
@@ -513,13 +1090,17 @@ resp_con_t mqtt_sn_check_rc(uint8_t rc);
  *
  * 		Realiza o parsing das mensagens UDP recebidas de acordo com
  *    o protocolo MQTT-SN, alterando o status da conexão geral com
- *    o broker.
+ *    o broker. Pacotes com comprimento inconsistente com o datagrama ou
+ *    menores que o mínimo do tipo são descartados. As publicações são
+ *    entregues ao callback sem cópia, apontando para o próprio pacote.
  *
- *  @param [in] data Ponteiro para o conteúdo UDP recebido
+ *  @param [in] client Instância do cliente MQTT-SN (mqtt_sn_init)
+ *  @param [in] data Ponteiro para o conteúdo UDP recebido (no uip_buf)
+ *  @param [in] datalen Comprimento do datagrama UDP recebido
  *
  *  @retval 0 Não retorna nada
  **/
-void mqtt_sn_recv_parser(const uint8_t *data);
+void mqtt_sn_recv_parser(mqtt_sn_client_t *client, uint8_t *data, uint16_t datalen);
 
 /** @brief Inicia conexão ao broker UDP
  *
@@ -527,6 +1108,7 @@ void mqtt_sn_recv_parser(const uint8_t *data);
  *    da porta 1884 além de iniciar a fila
  *    de processos de conexão do protocolo.
  *
+ *  @param [in] client Instância do cliente MQTT-SN (mqtt_sn_init)
  *  @param [in] mqtt_sn_connection Estrutura padrão de comunicação MQTT-SN
  *  @param [in] topics Vetor de tópicos a serem registrados
  *  @param [in] topic_len Tamanho do vetor de tópicos a serem registrados
@@ -536,55 +1118,117 @@ void mqtt_sn_recv_parser(const uint8_t *data);
  *  @retval SUCCESS_CON   Sucesso ao alocar conexão UDP
  *
  **/
-resp_con_t mqtt_sn_create_sck(mqtt_sn_con_t mqtt_sn_connection, char *topics[],size_t topic_len, mqtt_sn_cb_f cb_f);
+resp_con_t mqtt_sn_create_sck(mqtt_sn_client_t *client, mqtt_sn_con_t mqtt_sn_connection, char *topics[],size_t topic_len, mqtt_sn_cb_f cb_f);
+
+/** @brief Define o callback de recebimento de payloads binários
+ *
+ * 		Quando definido, substitui o callback de mqtt_sn_create_sck: as
+ *    publicações recebidas são entregues com ponteiro e comprimento, sem cópia
+ *    e sem terminador '\0'. O ponteiro aponta para o pacote no buffer do uIP,
+ *    logo só é válido até o retorno do callback e até o primeiro envio MQTT-SN.
+ *
+ *  @param [in] client Instância do cliente MQTT-SN (mqtt_sn_init)
+ *  @param [in] cb_f Ponteiro para a função de callback (NULL retorna ao callback de texto)
+ *
+ *  @retval 0 Não retorna nada
+ *
+ **/
+void mqtt_sn_set_bin_callback(mqtt_sn_client_t *client, mqtt_sn_bin_cb_f cb_f);
+
+/** @brief Abre o socket UDP para publicações QoS -1
+ *
+ * 		Registra somente a conexão UDP com o gateway, sem CONNECT, keep alive ou
+ *    fila de tarefas, para nós que acordam, publicam uma leitura com
+ *    mqtt_sn_pub_qos_n1 e voltam a dormir. A instância deve ser inicializada
+ *    antes por mqtt_sn_init (estado zerado) e não deve ser combinada com
+ *    mqtt_sn_create_sck.
+ *
+ *  @param [in] client Instância do cliente MQTT-SN (mqtt_sn_init)
+ *  @param [in] mqtt_sn_connection Estrutura padrão de comunicação MQTT-SN (client_id e keep_alive são ignorados)
+ *
+ *  @retval FAIL_CON      Falha ao alocar conexão UDP
+ *  @retval SUCCESS_CON   Sucesso ao alocar conexão UDP
+ *
+ **/
+resp_con_t mqtt_sn_open_qos_n1(mqtt_sn_client_t *client, mqtt_sn_con_t mqtt_sn_connection);
 
 /** @brief Envio de mensagens ao broker do tipo REGISTER
  *
- * 		Envia ao broker mensagens do tipo REGISTER com o topic name informado conforme a tarefa
- *    primeira na fila
+ * 		Envia ao broker o REGISTER do próximo tópico sem topic id que ainda não
+ *    aguarda REGACK, ocupando uma posição da janela MQTT_SN_REG_WINDOW com
+ *    o próximo message id do cliente e prazo de retransmissão próprio. Um
+ *    REGISTER sem REGACK após MQTT_SN_RETRY tentativas é abandonado sozinho,
+ *    a reconexão ocorre somente quando todos os pendentes falham.
  *
- *  @param [in] 0 Não recebe parâmetro
+ *  @param [in] client Instância do cliente MQTT-SN (mqtt_sn_init)
  *
- *  @retval FAIL_CON      Falha ao enviar o pacote REGISTER
+ *  @retval FAIL_CON      Janela cheia, nenhum tópico pendente ou falha ao enviar o pacote REGISTER
  *  @retval SUCCESS_CON   Sucesso ao enviar o pacote REGISTER
  *
  **/
-resp_con_t mqtt_sn_reg_send(void);
+resp_con_t mqtt_sn_reg_send(mqtt_sn_client_t *client);
+
+/** @brief Preenche a janela de REGISTER
+ *
+ * 		Envia REGISTERs até ocupar a janela MQTT_SN_REG_WINDOW ou até não haver
+ *    mais tópicos a registrar, sem aguardar os REGACKs
+ *
+ *  @param [in] client Instância do cliente MQTT-SN (mqtt_sn_init)
+ *
+ *  @retval uint8_t Número de REGISTERs enviados
+ *
+ **/
+uint8_t mqtt_sn_reg_fill(mqtt_sn_client_t *client);
+
+/** @brief Trata o recebimento de REGACK
+ *
+ * 		Correlaciona o REGACK com o REGISTER da janela pelo message id, libera a
+ *    posição da janela e atribui o topic id ao tópico
+ *
+ *  @param [in] client Instância do cliente MQTT-SN (mqtt_sn_init)
+ *  @param [in] msg_id Message id do REGACK
+ *  @param [in] topic_id Topic id atribuído pelo broker
+ *
+ *  @retval FAIL_CON      REGACK sem REGISTER correspondente na janela
+ *  @retval SUCCESS_CON   Topic id atribuído
+ *
+ **/
+resp_con_t mqtt_sn_regack_recv(mqtt_sn_client_t *client, uint16_t msg_id, uint16_t topic_id);
 
 /** @brief Checa o status da conexão MQTT-SN
  *
  * 		Retorna o status da conexão MQTT-SN baseado na estrutura mqtt_sn_status_t
  *
- *  @param [in] 0 Não recebe argumento
+ *  @param [in] client Instância do cliente MQTT-SN (mqtt_sn_init)
  *
  *  @retval mqtt_sn_status_t Estado da conexão
  *
  **/
-mqtt_sn_status_t mqtt_sn_check_status(void);
+mqtt_sn_status_t mqtt_sn_check_status(mqtt_sn_client_t *client);
 
 /** @brief Envia requisição de conexão ao broker MQTT-SN
  *
  * 		Realiza o envio de mensagens do tipo CONNECT ao broker MQTT-SN
  *
- *  @param [in] 0 Não recebe argumento
+ *  @param [in] client Instância do cliente MQTT-SN (mqtt_sn_init)
  *
  *  @retval FAIL_CON      Falha ao enviar o pacote CONNECT
  *  @retval SUCCESS_CON   Sucesso ao enviar o pacote CONNECT
  *
  **/
-resp_con_t mqtt_sn_con_send(void);
+resp_con_t mqtt_sn_con_send(mqtt_sn_client_t *client);
 
 /** @brief Checa o status da fila de tarefas MQTT-SN
  *
- * 		Percorra a lista encadeada de tarefas para verificar se está vazia
+ * 		Verifica o contador de tarefas da fila para saber se está vazia
  *
- *  @param [in] 0 Não recebe argumento
+ *  @param [in] client Instância do cliente MQTT-SN (mqtt_sn_init)
  *
  *  @retval TRUE  Fila vazia
  *  @retval FALSE  Há tarefas a serem processadas
  *
  **/
-bool mqtt_sn_check_empty(void);
+bool mqtt_sn_check_empty(mqtt_sn_client_t *client);
 
 /** @brief Retorna a string de status correspondente
  *
@@ -600,19 +1244,21 @@ void parse_mqtt_type_string(uint8_t type, char **type_string);
 
 /** @brief Inicializa PROCESS_THREAD MQTT-SN
  *
- * 		Inicializa a PROCESS_THREAD de MQTT-SN bem como as variáveis utilizadas e a alocaçãod e eventos
+ * 		Inicializa a instância do cliente MQTT-SN e, na primeira chamada,
+ *    a PROCESS_THREAD compartilhada e a alocação de eventos
  *
- *  @param [in] 0 Não recebe argumento
+ *  @param [in] client Instância do cliente MQTT-SN a ser inicializada
  *
  *  @retval 0 Não retorna nada
  *
  **/
-void mqtt_sn_init(void);
+void mqtt_sn_init(mqtt_sn_client_t *client);
 
 /** @brief Envia pacote PUBLISH ao broker MQTT-SN
  *
  * 		Monta o pacote e envia ao broker a mensagem de publicação
  *
+ *  @param [in] client Instância do cliente MQTT-SN (mqtt_sn_init)
  *  @param [in] topic Tópico a ser publicado
  *  @param [in] message Mensagem a ser publicada
  *  @param [in] qos Nível de QoS da publicação
@@ -621,18 +1267,56 @@ void mqtt_sn_init(void);
  *  @retval SUCCESS_CON   Sucesso ao enviar a publicação
  *
  **/
-resp_con_t mqtt_sn_pub_send(char *topic,char *message, bool retain_flag, uint8_t qos);
+resp_con_t mqtt_sn_pub_send(mqtt_sn_client_t *client, char *topic,char *message, bool retain_flag, int8_t qos);
+
+/** @brief Envia pacote PUBLISH ao broker MQTT-SN a partir do topic id
+ *
+ * 		Monta o pacote e envia ao broker a mensagem de publicação utilizando
+ *    diretamente o topic id e o tipo informados, sem consultar o vetor de tópicos
+ *
+ *  @param [in] client Instância do cliente MQTT-SN (mqtt_sn_init)
+ *  @param [in] stopic Topic id (ou short topic name codificado em 2 bytes)
+ *  @param [in] topic_type Tipo do topic id (MQTT_SN_TOPIC_TYPE_*)
+ *  @param [in] message Mensagem a ser publicada
+ *  @param [in] retain_flag Identificador de mensagem retentiva
+ *  @param [in] qos Nível de QoS da publicação
+ *
+ *  @retval FAIL_CON      Falha ao enviar a publicação
+ *  @retval SUCCESS_CON   Sucesso ao enviar a publicação
+ *
+ **/
+resp_con_t mqtt_sn_pub_send_id(mqtt_sn_client_t *client, uint16_t stopic, uint8_t topic_type, char *message, bool retain_flag, int8_t qos);
+
+/** @brief Envia pacote PUBLISH binário ao broker MQTT-SN a partir do topic id
+ *
+ * 		Igual a mqtt_sn_pub_send_id, porém o payload é enviado exatamente com
+ *    data_len bytes, sem o terminador '\0'
+ *
+ *  @param [in] client Instância do cliente MQTT-SN (mqtt_sn_init)
+ *  @param [in] stopic Topic id (ou short topic name codificado em 2 bytes)
+ *  @param [in] topic_type Tipo do topic id (MQTT_SN_TOPIC_TYPE_*)
+ *  @param [in] payload Dados a serem publicados
+ *  @param [in] data_len Comprimento do payload em bytes
+ *  @param [in] retain_flag Identificador de mensagem retentiva
+ *  @param [in] qos Nível de QoS da publicação
+ *
+ *  @retval FAIL_CON      Falha ao enviar a publicação
+ *  @retval SUCCESS_CON   Sucesso ao enviar a publicação
+ *
+ **/
+resp_con_t mqtt_sn_pub_send_bin(mqtt_sn_client_t *client, uint16_t stopic, uint8_t topic_type, const uint8_t *payload, size_t data_len, bool retain_flag, int8_t qos);
 
 /** @brief Checa o status da conexãoe em String
  *
  * 		Verifica o status da conexão MQTT-SN e retorna uma string com o estado
  *
+ *  @param [in] client Instância do cliente MQTT-SN (mqtt_sn_init)
  *  @param [in] Não recebe argumento
  *
  *  @retval STRING  String do estado atual da conexão MQTT-SN
  *
  **/
-char* mqtt_sn_check_status_string(void);
+char* mqtt_sn_check_status_string(mqtt_sn_client_t *client);
 
 /** @brief Gera a flag de nível QoS
  *
@@ -647,29 +1331,230 @@ uint8_t mqtt_sn_get_qos_flag(int8_t qos);
 
 /** @brief Prepara requisição de publicação ao broker MQTT-SN
  *
- * 		Formata e gera a tarefa na fila para publicação no tópico pré-registrado
+ * 		Publica no tópico pré-registrado. A publicação só espera as tarefas da
+ * 		fila de classe igual ou maior que prio (mqtt_sn_prio_t), sem a sessão
+ * 		pronta ela é retida e as retidas de classe mais alta saem antes das
+ * 		demais (MQTT_SN_PRIO_SCHED). Todas as demais funções de publicação
+ * 		passam por aqui.
+ *
+ *  @param [in] client Instância do cliente MQTT-SN (mqtt_sn_init)
+ *  @param [in] topic Tópico a ser publicado
+ *  @param [in] message Mensagem a ser publicada
+ *  @param [in] retain_flag Identificador de mensagem retentiva
+ *  @param [in] qos Nível de QoS da publicação (QoS 1 e 2 utilizam a janela MQTT_SN_QOS1_WINDOW, QoS -1 segue mqtt_sn_pub_qos_n1)
+ *  @param [in] prio Classe de prioridade da publicação
+ *
+ *  @retval FAIL_CON      Classe inválida, mensagem maior que um PUBLISH (MQTT_SN_MAX_PACKET_LENGTH-7 bytes com o '\0'), falha ao enviar ou ao reter a publicação
+ *  @retval SUCCESS_CON   Publicação enviada ou retida
+ *
+ **/
+resp_con_t mqtt_sn_pub(mqtt_sn_client_t *client, char *topic,char *message, bool retain_flag, int8_t qos, mqtt_sn_prio_t prio);
+
+/** @brief Publica um payload binário em um tópico
+ *
+ * 		Igual a mqtt_sn_pub, porém o payload (structs empacotadas, CBOR...) é
+ *    enviado com exatamente len bytes, sem o terminador '\0' no pacote
  *
+ *  @param [in] client Instância do cliente MQTT-SN (mqtt_sn_init)
  *  @param [in] topic Tópico a ser publicado
+ *  @param [in] payload Dados a serem publicados
+ *  @param [in] len Comprimento do payload em bytes
+ *  @param [in] retain_flag Identificador de mensagem retentiva
+ *  @param [in] qos Nível de QoS da publicação
+ *  @param [in] prio Classe de prioridade da publicação
+ *
+ *  @retval FAIL_CON      Falha ao publicar ou janela QoS 1 cheia
+ *  @retval SUCCESS_CON   Sucesso ao publicar
+ *
+ **/
+resp_con_t mqtt_sn_pub_bin(mqtt_sn_client_t *client, char *topic, const uint8_t *payload, uint8_t len, bool retain_flag, int8_t qos, mqtt_sn_prio_t prio);
+
+/** @brief Publica em um short topic name
+ *
+ * 		Publica em um tópico de 2 caracteres codificados diretamente no campo de
+ *    topic id (MQTT_SN_TOPIC_TYPE_SHORT), sem REGISTER. O tópico entra no
+ *    vetor de tópicos e a publicação segue mqtt_sn_pub: liberada logo após o
+ *    CONNACK, retida antes dele, ou a qualquer momento com QoS -1.
+ *
+ *  @param [in] client Instância do cliente MQTT-SN (mqtt_sn_init)
+ *  @param [in] topic Short topic name (exatamente 2 caracteres)
  *  @param [in] message Mensagem a ser publicada
  *  @param [in] retain_flag Identificador de mensagem retentiva
  *  @param [in] qos Nível de QoS da publicação
+ *  @param [in] prio Classe de prioridade da publicação
+ *
+ *  @retval FAIL_CON      Tópico inválido, vetor de tópicos cheio ou falha ao publicar
+ *  @retval SUCCESS_CON   Publicação enviada ou retida
+ *
+ **/
+resp_con_t mqtt_sn_pub_short(mqtt_sn_client_t *client, char *topic, char *message, bool retain_flag, int8_t qos, mqtt_sn_prio_t prio);
+
+/** @brief Agrupa amostras de um tópico em um único PUBLISH
+ *
+ * 		Acumula a amostra no buffer do tópico, separada das anteriores por
+ *    MQTT_SN_COALESCE_SEP, e publica o conjunto com mqtt_sn_pub quando a
+ *    janela MQTT_SN_COALESCE_WINDOW expira ou quando a próxima amostra não
+ *    cabe em MQTT_SN_COALESCE_BUDGET bytes (ou muda QoS, retain ou classe). Amostras maiores que o orçamento
+ *    ou sem posição livre são publicadas diretamente.
+ *
+ *  @param [in] client Instância do cliente MQTT-SN (mqtt_sn_init)
+ *  @param [in] topic Tópico a ser publicado (o ponteiro deve permanecer válido até o envio)
+ *  @param [in] sample Amostra a ser agrupada (copiada)
+ *  @param [in] retain_flag Identificador de mensagem retentiva
+ *  @param [in] qos Nível de QoS da publicação
+ *  @param [in] prio Classe de prioridade da publicação
+ *
+ *  @retval FAIL_CON      Falha na publicação direta ou no envio forçado do buffer (o buffer é mantido e a amostra não é agrupada)
+ *  @retval SUCCESS_CON   Amostra agrupada ou publicada
+ *
+ **/
+resp_con_t mqtt_sn_pub_coalesce(mqtt_sn_client_t *client, char *topic, char *sample, bool retain_flag, int8_t qos, mqtt_sn_prio_t prio);
+
+/** @brief Envia as amostras agrupadas de todos os tópicos
+ *
+ * 		Publica imediatamente os buffers de agrupamento não vazios, por exemplo
+ *    antes do nó entrar em modo de baixo consumo
+ *
+ *  @param [in] client Instância do cliente MQTT-SN (mqtt_sn_init)
+ *
+ *  @retval 0 Não retorna nada
+ *
+ **/
+void mqtt_sn_coalesce_flush(mqtt_sn_client_t *client);
+
+/** @brief Publicações retidas aguardando envio
  *
- *  @retval FAIL_CON      Falha ao gerar a tarefa de publicação
- *  @retval SUCCESS_CON   Sucesso ao gerar a tarefa de publicação
+ * 		Número de publicações feitas sem a sessão pronta que ainda serão
+ * 		enviadas ao retomar a conexão (RAM e arquivo CFS)
+ *
+ *  @param [in] client Instância do cliente MQTT-SN (mqtt_sn_init)
+ *
+ *  @retval n Publicações pendentes
+ *
+ **/
+uint16_t mqtt_sn_offline_pending(mqtt_sn_client_t *client);
+
+/** @brief Publicações descartadas pela fila offline
+ *
+ * 		Contador de overflow: publicações perdidas por fila cheia (conforme
+ * 		MQTT_SN_OFFLINE_POLICY), payload maior que MQTT_SN_OFFLINE_PAYLOAD ou
+ * 		tópico não mais registrado no envio
+ *
+ *  @param [in] client Instância do cliente MQTT-SN (mqtt_sn_init)
+ *
+ *  @retval n Publicações descartadas desde o início
  *
  **/
-resp_con_t mqtt_sn_pub(char *topic,char *message, bool retain_flag, uint8_t qos);
+uint16_t mqtt_sn_offline_dropped(mqtt_sn_client_t *client);
+
+/** @brief Processa o fim da janela de agrupamento
+ *
+ * 		Publica as amostras acumuladas do tópico. Caso a publicação seja
+ *    recusada (sem conexão ou janela QoS cheia) o buffer é mantido e a janela
+ *    é reiniciada.
+ *
+ *  @param [in] ptr Ponteiro para a estrutura mqtt_sn_coalesce_t do tópico
+ *
+ *  @retval 0 Não retorna nada
+ *
+ **/
+void timeout_coalesce(void *ptr);
+
+/** @brief Retransmissão de SUBSCRIBE
+ *
+ * 		Reenvia individualmente cada SUBSCRIBE de sub_window que não
+ * 		recebeu SUBACK dentro do seu tempo de retransmissão, descartando-o após
+ * 		MQTT_SN_RETRY tentativas
+ *
+ *  @param [in] ptr Não utilizado
+ *
+ *  @retval void
+ *
+ **/
+void timeout_subscribe(void *ptr);
+
+/** @brief Temporização do sono
+ *
+ * 		Conta o período ASLEEP em passos de MQTT_SN_SLEEP_STEP e acorda o
+ * 		cliente (mqtt_sn_wake) ao final
+ *
+ *  @param [in] ptr Não utilizado
+ *
+ *  @retval void
+ *
+ **/
+void timeout_sleep(void *ptr);
+
+/** @brief Envio das publicações retidas
+ *
+ * 		Com a sessão pronta envia a publicação retida mais antiga a cada
+ * 		MQTT_SN_OFFLINE_DRAIN, sem a sessão verifica novamente após um RTO
+ *
+ *  @param [in] ptr Não utilizado
+ *
+ *  @retval void
+ *
+ **/
+void timeout_offline(void *ptr);
+
+/** @brief Descoberta de gateways
+ *
+ * 		Envia o SEARCHGW e, ao fim da janela de respostas, seleciona o gateway
+ * 		de menor RTT somado ao custo do hop limit (MQTT_SN_GW_HOP_COST) e inicia a
+ * 		sessão. Sem respostas repete a busca com a janela dobrada, utilizando
+ * 		ipv6_broker após MQTT_SN_GW_SEARCH_TRIES buscas
+ *
+ *  @param [in] ptr Não utilizado
+ *
+ *  @retval void
+ *
+ **/
+void timeout_gw_search(void *ptr);
+
+/** @brief Publica com QoS -1 (sem conexão)
+ *
+ * 		Envia um único PUBLISH com QoS -1 ao gateway, sem CONNECT, REGISTER,
+ *    PINGREQ ou fila de tarefas (mqtt_sn_pub com QoS -1, que não é retido e
+ *    portanto não depende da classe). O tópico deve ser pré-definido
+ *    (tools/predefined_topics.conf) ou um short topic name de 2 caracteres.
+ *
+ *  @param [in] client Instância do cliente MQTT-SN (mqtt_sn_init)
+ *  @param [in] topic Tópico pré-definido ou short topic name
+ *  @param [in] message Mensagem a ser publicada
+ *  @param [in] retain_flag Identificador de mensagem retentiva
+ *
+ *  @retval FAIL_CON      Tópico não pré-definido nem short topic name
+ *  @retval SUCCESS_CON   Sucesso ao enviar a publicação
+ *
+ **/
+resp_con_t mqtt_sn_pub_qos_n1(mqtt_sn_client_t *client, char *topic, char *message, bool retain_flag);
+
+/** @brief Prepara requisição de inscrição em um short topic name
+ *
+ * 		Insere o short topic name no vetor de tópicos (sem REGISTER) e gera a
+ *    tarefa de inscrição. As publicações recebidas neste tópico são entregues
+ *    ao callback com o nome de 2 caracteres.
+ *
+ *  @param [in] client Instância do cliente MQTT-SN (mqtt_sn_init)
+ *  @param [in] topic Short topic name (exatamente 2 caracteres, o ponteiro deve permanecer válido)
+ *  @param [in] qos Nível de QoS da inscrição
+ *
+ *  @retval FAIL_CON      Falha ao gerar a tarefa de inscrição
+ *  @retval SUCCESS_CON   Sucesso ao gerar a tarefa de inscrição
+ *
+ **/
+resp_con_t mqtt_sn_sub_short(mqtt_sn_client_t *client, char *topic, uint8_t qos);
 
 /** @brief Exibe os tópicos registrados
  *
  * 		Exibe a lista de tópicos registrados no broker
  *
- *  @param [in] 0 Não recebe argumento
+ *  @param [in] client Instância do cliente MQTT-SN (mqtt_sn_init)
  *
  *  @retval 0 Não retorna nada
  *
  **/
-void print_g_topics(void);
+void print_g_topics(mqtt_sn_client_t *client);
 
 /** @brief Processa timeout de pacotes
  *
@@ -684,7 +1569,10 @@ void timeout_con(void *ptr);
 
 /** @brief Processa timeout de ping
  *
- * 		Processa toda expiração de tempo por timeout de envio de mensagens PINGREQ
+ * 		Processa toda expiração de tempo por timeout de envio de mensagens PINGREQ.
+ * 		O PINGREQ só é enviado se não houve recepção e envio de pacotes dentro
+ * 		do keep alive, caso contrário o temporizador é rearmado a partir do
+ * 		tráfego mais antigo
  *
  *  @param [in] 0 Não recebe argumento
  *
@@ -693,33 +1581,113 @@ void timeout_con(void *ptr);
  **/
 void timeout_ping_mqtt(void *ptr);
 
+/** @brief Processa timeout de publicações QoS 1 e 2
+ *
+ * 		Retransmite com a flag DUP as publicações da janela que não receberam
+ *    PUBACK/PUBREC dentro do RTO estimado, retransmite PUBREL sem PUBCOMP
+ *    e descarta as trocas após MQTT_SN_RETRY tentativas
+ *
+ *  @param [in] 0 Não recebe argumento
+ *
+ *  @retval 0 Não retorna nada
+ *
+ **/
+void timeout_inflight(void *ptr);
+
+/** @brief Trata o recebimento de PUBACK
+ *
+ * 		Localiza a publicação da janela QoS 1 pelo message id e trata o código
+ *    de retorno: ACCEPTED libera a posição, REJECTED_CONGESTION mantém a
+ *    publicação para retransmissão e os demais códigos a descartam. PUBACK
+ *    de uma troca QoS 2 (janela ou tabela compacta) é erro de protocolo e a
+ *    descarta
+ *
+ *  @param [in] client Instância do cliente MQTT-SN (mqtt_sn_init)
+ *  @param [in] msg_id Message id do PUBACK
+ *  @param [in] rc Código de retorno do PUBACK
+ *
+ *  @retval 0 Não retorna nada
+ *
+ **/
+void mqtt_sn_puback_recv(mqtt_sn_client_t *client, uint16_t msg_id, uint8_t rc);
+
+/** @brief Trata o recebimento de PUBREC
+ *
+ * 		Libera o payload da publicação QoS 2 da janela, armazena somente o
+ *    message id na tabela compacta e envia o PUBREL
+ *
+ *  @param [in] client Instância do cliente MQTT-SN (mqtt_sn_init)
+ *  @param [in] msg_id Message id do PUBREC
+ *
+ *  @retval 0 Não retorna nada
+ *
+ **/
+void mqtt_sn_pubrec_recv(mqtt_sn_client_t *client, uint16_t msg_id);
+
+/** @brief Trata o recebimento de PUBCOMP
+ *
+ * 		Conclui a troca QoS 2 enviada pelo nó
+ *
+ *  @param [in] client Instância do cliente MQTT-SN (mqtt_sn_init)
+ *  @param [in] msg_id Message id do PUBCOMP
+ *
+ *  @retval 0 Não retorna nada
+ *
+ **/
+void mqtt_sn_pubcomp_recv(mqtt_sn_client_t *client, uint16_t msg_id);
+
+/** @brief Trata o recebimento de PUBREL
+ *
+ * 		Conclui a troca QoS 2 iniciada pelo broker e responde com PUBCOMP
+ *
+ *  @param [in] client Instância do cliente MQTT-SN (mqtt_sn_init)
+ *  @param [in] msg_id Message id do PUBREL
+ *
+ *  @retval 0 Não retorna nada
+ *
+ **/
+void mqtt_sn_pubrel_recv(mqtt_sn_client_t *client, uint16_t msg_id);
+
+/** @brief Retorna o número de publicações QoS 1 em andamento
+ *
+ * 		Permite à aplicação controlar o envio conforme a ocupação da janela
+ *    QoS 1 (MQTT_SN_QOS1_WINDOW)
+ *
+ *  @param [in] client Instância do cliente MQTT-SN (mqtt_sn_init)
+ *
+ *  @retval N Número de publicações aguardando PUBACK
+ *
+ **/
+uint8_t mqtt_sn_pub_inflight(mqtt_sn_client_t *client);
+
 /** @brief Envia requisição de ping ao broker
  *
  * 		Envia requisição de ping ao broker diretamente por mensagens PING REQ
  *
- *  @param [in] 0 Não recebe argumento
+ *  @param [in] client Instância do cliente MQTT-SN (mqtt_sn_init)
  *
  *  @retval 0 Não retorna nada
  *
  **/
-void mqtt_sn_ping_send(void);
+void mqtt_sn_ping_send(mqtt_sn_client_t *client);
 
 /** @brief Libera opção de geração de tarefas
  *
  * 		Habilita a geração de tarefas na fila conforma o estado da conexão MQTT-SN
  *
- *  @param [in] 0 Não recebe argumento
+ *  @param [in] client Instância do cliente MQTT-SN (mqtt_sn_init)
  *
  *  @retval TRUE Pode-se gerar tarefa na fila
  *  @retval FALSE Estado da conexão MQTT-SN impossibilita geração de tarefas na fila
  *
  **/
-bool unlock_tasks(void);
+bool unlock_tasks(mqtt_sn_client_t *client);
 
 /** @brief Prepara requisição de inscrição ao broker MQTT-SN
  *
  * 		Formata e gera a tarefa na fila para inscrição no tópico pré-registrado
  *
+ *  @param [in] client Instância do cliente MQTT-SN (mqtt_sn_init)
  *  @param [in] topic Tópico a ser inscrito
  *  @param [in] qos Nível de QoS da inscrição
  *
@@ -727,68 +1695,159 @@ bool unlock_tasks(void);
  *  @retval SUCCESS_CON   Sucesso ao gerar a tarefa de inscrição
  *
  **/
-resp_con_t mqtt_sn_sub(char *topic, uint8_t qos);
+resp_con_t mqtt_sn_sub(mqtt_sn_client_t *client, char *topic, uint8_t qos);
 
 /** @brief Envia pacote SUBSCRIBE ao broker MQTT-SN
  *
- * 		Monta o pacote e envia ao broker a mensagem de inscrição
+ * 		Monta o pacote e envia ao broker a mensagem de inscrição, registrando-a
+ * 		em sub_window com um message id próprio até a chegada do SUBACK
  *
+ *  @param [in] client Instância do cliente MQTT-SN (mqtt_sn_init)
  *  @param [in] topic Tópico a ser inscrito (deve estar pré-listado e passado como argumento em mqtt_sn_create_sck)
  *  @param [in] qos Nível de QoS da publicação
  *
- *  @retval FAIL_CON      Falha ao enviar a inscrição
+ *  @retval FAIL_CON      Falha ao enviar a inscrição ou tabela de SUBSCRIBE cheia
  *  @retval SUCCESS_CON   Sucesso ao enviar a inscrição
  *
  **/
-resp_con_t mqtt_sn_sub_send(char *topic, uint8_t qos);
+resp_con_t mqtt_sn_sub_send(mqtt_sn_client_t *client, char *topic, uint8_t qos);
 
 /** @brief Envia pacote SUBSCRIBE do tipo WILDCARD ao broker MQTT-SN
  *
  * 		Monta o pacote e envia ao broker a mensagem de inscrição do tipo Wildcard (#,+)
  *
+ *  @param [in] client Instância do cliente MQTT-SN (mqtt_sn_init)
  *  @param [in] topic Tópico a ser inscrito (deve estar pré-listado e passado como argumento em mqtt_sn_create_sck)
  *  @param [in] qos Nível de QoS da publicação
  *
- *  @retval FAIL_CON      Falha ao enviar a inscrição
+ *  @retval FAIL_CON      Falha ao enviar a inscrição ou tabela de SUBSCRIBE cheia
  *  @retval SUCCESS_CON   Sucesso ao enviar a inscrição
  *
  **/
-resp_con_t mqtt_sn_sub_send_wildcard(char *topic, uint8_t qos);
+resp_con_t mqtt_sn_sub_send_wildcard(mqtt_sn_client_t *client, char *topic, uint8_t qos);
+
+/** @brief Trata o SUBACK recebido do broker
+ *
+ * 		Localiza pelo message id o SUBSCRIBE correspondente em sub_window,
+ * 		atualiza o estado de inscrição do tópico e libera a posição da tabela
+ *
+ *  @param [in] client Instância do cliente MQTT-SN (mqtt_sn_init)
+ *  @param [in] msg_id Message id do pacote SUBACK
+ *  @param [in] rc Código de retorno do SUBACK
+ *
+ *  @retval void
+ *
+ **/
+void mqtt_sn_suback_recv(mqtt_sn_client_t *client, uint16_t msg_id, uint8_t rc);
 
 /** @brief Verifica se o tópico já foi registrado
  *
  * 		Verifica se o tópico em análise já foi previamente registrado ou está em processo de registro
  *
+ *  @param [in] client Instância do cliente MQTT-SN (mqtt_sn_init)
  *  @param [in] topic Tópico a ser inscrito (deve estar pré-listado e passado como argumento em mqtt_sn_create_sck)
  *
  *  @retval FAIL_CON      Tópico já foi registrado ou está em andamento
  *  @retval SUCCESS_CON   Tópico liberado para inscrição
  *
  **/
-resp_con_t verf_hist_sub(char *topic);
+resp_con_t verf_hist_sub(mqtt_sn_client_t *client, char *topic);
 
 /** @brief Envia pacote DISCONNECT ao broker MQTT-SN
  *
  * 		Monta o pacote e envia ao broker a mensagem de desconexão
  *
+ *  @param [in] client Instância do cliente MQTT-SN (mqtt_sn_init)
  *  @param [in] duration Tempo que irá ficar desconectado, utilizado para sleeping devices
  *
  *  @retval FAIL_CON      Falha ao enviar a desconexão
  *  @retval SUCCESS_CON   Sucesso ao enviar a desconexão
  *
  **/
-resp_con_t mqtt_sn_disconnect_send(uint16_t duration);
+resp_con_t mqtt_sn_disconnect_send(mqtt_sn_client_t *client, uint16_t duration);
+
+/** @brief Coloca o cliente em modo dormindo (sleeping client)
+ *
+ * 		Envia DISCONNECT com a duração do sono e, após a confirmação do gateway,
+ * 		suspende o PINGREQ periódico. Ao fim da duração o cliente acorda com
+ * 		PINGREQ, recebe as mensagens retidas e volta a dormir no PINGRESP
+ *
+ *  @param [in] client Instância do cliente MQTT-SN (mqtt_sn_init)
+ *  @param [in] duration Duração do sono em segundos
+ *
+ *  @retval FAIL_CON      Duração nula ou conexão com tarefas pendentes
+ *  @retval SUCCESS_CON   DISCONNECT enviado
+ *
+ **/
+resp_con_t mqtt_sn_sleep(mqtt_sn_client_t *client, uint16_t duration);
+
+/** @brief Acorda o cliente dormindo antes do fim do sono
+ *
+ * 		Envia PINGREQ com o client id (estado AWAKE) para receber as mensagens
+ * 		retidas pelo gateway, voltando ao estado ASLEEP no PINGRESP
+ *
+ *  @param [in] client Instância do cliente MQTT-SN (mqtt_sn_init)
+ *
+ *  @retval FAIL_CON      Cliente não está dormindo
+ *  @retval SUCCESS_CON   PINGREQ enviado
+ *
+ **/
+resp_con_t mqtt_sn_wake(mqtt_sn_client_t *client);
+
+/** @brief Retorna o cliente dormindo ao estado ativo
+ *
+ * 		Envia CONNECT sem a flag CLEAN, retomando a sessão mantida pelo
+ * 		gateway e o PINGREQ periódico de keep alive
+ *
+ *  @param [in] client Instância do cliente MQTT-SN (mqtt_sn_init)
+ *
+ *  @retval FAIL_CON      Cliente não está dormindo
+ *  @retval SUCCESS_CON   Tarefa de CONNECT gerada
+ *
+ **/
+resp_con_t mqtt_sn_active(mqtt_sn_client_t *client);
 
 /** @brief Inicializa os vetores MQTT-SN
  *
- * 		Deleta tarefas na fila e inicializa o vetor de tópicos setando 0xFF aos identificadores de tópico
+ * 		Deleta tarefas na fila e inicializa o vetor de tópicos setando MQTT_SN_TOPIC_ID_NONE aos identificadores de tópico
  *
- *  @param [in] 0 Não recebe argumento
+ *  @param [in] client Instância do cliente MQTT-SN (mqtt_sn_init)
  *
  *  @retval 0 Não retorna argumento
  *
  **/
-void init_vectors(void);
+void init_vectors(mqtt_sn_client_t *client);
+
+#ifdef MQTT_SN_TOPIC_CACHE
+/** @brief Recupera os topic ids gravados em flash
+ *
+ * 		Lê o arquivo MQTT_SN_TOPIC_CACHE_FILE e, se o gateway (endereço e porta)
+ * 		e o client id gravados no cabeçalho conferem, preenche os topic ids dos
+ * 		tópicos já presentes em topic_bind cujo nome gravado é idêntico,
+ * 		evitando o REGISTER destes
+ *
+ *  @param [in] client Instância do cliente MQTT-SN (mqtt_sn_init)
+ *
+ *  @retval FAIL_CON      Arquivo ausente, inválido ou nenhum tópico recuperado
+ *  @retval SUCCESS_CON   Ao menos um topic id recuperado
+ *
+ **/
+resp_con_t mqtt_sn_cache_load(mqtt_sn_client_t *client);
+
+/** @brief Grava os topic ids em flash
+ *
+ * 		Regrava o arquivo MQTT_SN_TOPIC_CACHE_FILE com os topic ids normais
+ * 		registrados, somente se algum REGACK alterou a tabela desde a última
+ * 		gravação
+ *
+ *  @param [in] client Instância do cliente MQTT-SN (mqtt_sn_init)
+ *
+ *  @retval FAIL_CON      Falha ao gravar o arquivo
+ *  @retval SUCCESS_CON   Arquivo gravado ou sem alterações
+ *
+ **/
+resp_con_t mqtt_sn_cache_save(mqtt_sn_client_t *client);
+#endif
 
 /** @brief Inicia o evento de SUBSCRIBE
  *
@@ -805,37 +1864,110 @@ void init_sub(void *ptr);
  *
  * 		Verifica se o tópico já foi pré-registrado antes de iniciar qualquer operação
  *
+ *  @param [in] client Instância do cliente MQTT-SN (mqtt_sn_init)
  *  @param [in] topic Tópico a ser verificado
  *
  *  @retval FAIL_CON      Tópico não foi pré-registrado
  *  @retval SUCCESS_CON   Tópico registrado no vetor de tópicos
  *
  **/
-resp_con_t verf_register(char *topic);
+resp_con_t verf_register(mqtt_sn_client_t *client, char *topic);
+
+/** @brief Busca a posição de um tópico no vetor de tópicos
+ *
+ * 		Resolve o nome do tópico para a sua posição em topic_bind através do
+ *    índice hash (endereçamento aberto), comparando o hash pré-calculado antes
+ *    do strcmp. Custo O(1) no caso médio.
+ *
+ *  @param [in] client Instância do cliente MQTT-SN (mqtt_sn_init)
+ *  @param [in] topic Nome do tópico (NULL é aceito e retorna -1)
+ *
+ *  @retval -1    Tópico não encontrado
+ *  @retval >=0   Posição do tópico em topic_bind
+ *
+ **/
+int16_t mqtt_sn_topic_find(mqtt_sn_client_t *client, const char *topic);
+
+/** @brief Busca a posição de um tópico pelo topic id
+ *
+ * 		Utilizado na recepção de publicações, onde o broker informa somente o
+ *    topic id e o tipo (normal ou pré-definido) do tópico
+ *
+ *  @param [in] client Instância do cliente MQTT-SN (mqtt_sn_init)
+ *  @param [in] topic_id Topic id recebido do broker
+ *  @param [in] topic_type Tipo do topic id (MQTT_SN_TOPIC_TYPE_*)
+ *
+ *  @retval -1    Topic id não encontrado
+ *  @retval >=0   Posição do tópico em topic_bind
+ *
+ **/
+int16_t mqtt_sn_topic_find_id(mqtt_sn_client_t *client, uint16_t topic_id, uint8_t topic_type);
+
+/** @brief Verifica se o tópico é pré-definido
+ *
+ * 		Procura o tópico na tabela de tópicos pré-definidos gerada a partir de
+ *    tools/predefined_topics.conf. Caso encontrado, atribui o topic id pré-
+ *    definido ao tópico, dispensando o envio de REGISTER ao broker.
+ *
+ *  @param [in] client Instância do cliente MQTT-SN (mqtt_sn_init)
+ *  @param [in] pos Posição do tópico em topic_bind
+ *
+ *  @retval FAIL_CON      Tópico não é pré-definido
+ *  @retval SUCCESS_CON   Tópico pré-definido, topic id atribuído
+ *
+ **/
+resp_con_t verf_predefined(mqtt_sn_client_t *client, uint16_t pos);
+
+/** @brief Indexa um tópico do vetor de tópicos
+ *
+ * 		Calcula o hash do nome do tópico armazenado na posição informada e o
+ *    insere no índice utilizado por mqtt_sn_topic_find
+ *
+ *  @param [in] client Instância do cliente MQTT-SN (mqtt_sn_init)
+ *  @param [in] pos Posição do tópico em topic_bind
+ *
+ *  @retval 0 Não retorna nada
+ *
+ **/
+void mqtt_sn_topic_index(mqtt_sn_client_t *client, uint16_t pos);
+
+/** @brief Atribui o topic id de um tópico do vetor de tópicos
+ *
+ * 		Atualiza o topic id (16 bits) da posição informada e o índice utilizado
+ *    por mqtt_sn_topic_find_id, removendo o topic id anterior
+ *
+ *  @param [in] client Instância do cliente MQTT-SN (mqtt_sn_init)
+ *  @param [in] pos Posição do tópico em topic_bind
+ *  @param [in] topic_id Novo topic id (MQTT_SN_TOPIC_ID_NONE remove do índice)
+ *
+ *  @retval 0 Não retorna nada
+ *
+ **/
+void mqtt_sn_topic_set_id(mqtt_sn_client_t *client, uint16_t pos, uint16_t topic_id);
 
 /** @brief Envia mensagem de LWT
  *
  * 		Envia mensagem a ser publicada quando o tópico se desconectar
  *
- *  @param [in] 0 Não recebe argumento
+ *  @param [in] client Instância do cliente MQTT-SN (mqtt_sn_init)
  *
  *  @retval FAIL_CON      Falha ao enviar a mensagem Will MSG
  *  @retval SUCCESS_CON   Sucesso ao enviar a mensagem Will MSG
  *
  **/
-resp_con_t mqtt_sn_will_message_send(void);
+resp_con_t mqtt_sn_will_message_send(mqtt_sn_client_t *client);
 
 /** @brief Envia tópico de LWT
  *
  * 		Envia tópico utilizado quando o dispositivo se desconectar
  *
- *  @param [in] 0 Não recebe argumento
+ *  @param [in] client Instância do cliente MQTT-SN (mqtt_sn_init)
  *
  *  @retval FAIL_CON      Falha ao enviar a mensagem Will MSG
  *  @retval SUCCESS_CON   Sucesso ao enviar a mensagem Will MSG
  *
  **/
-resp_con_t mqtt_sn_will_topic_send(void);
+resp_con_t mqtt_sn_will_topic_send(mqtt_sn_client_t *client);
 
 /** @brief Callback de recepção UDP
  *
@@ -864,19 +1996,21 @@ void mqtt_sn_udp_rec_cb(struct simple_udp_connection *c,
  *
  * 		Gera tarefa de inscrição com Wildcard ao broker MQTT-SN
  *
+ *  @param [in] client Instância do cliente MQTT-SN (mqtt_sn_init)
  *  @param [in] topic Tópico a ser inscrito (deve estar pré-listado e passado como argumento em mqtt_sn_create_sck)
  *  @param [in] qos Nível de QoS da publicação
  *
- *  @retval FAIL_CON      Falha ao enviar a inscrição
+ *  @retval FAIL_CON      Falha ao enviar a inscrição ou tabela de SUBSCRIBE cheia
  *  @retval SUCCESS_CON   Sucesso ao enviar a inscrição
  *
  **/
-resp_con_t mqtt_sn_sub_wildcard(char *topic, uint8_t qos);
+resp_con_t mqtt_sn_sub_wildcard(mqtt_sn_client_t *client, char *topic, uint8_t qos);
 
 /** @brief Envia pacote do tipo REGACK ao broker
  *
  * 		Envia ao broker MQTT-SN a mensagem do tipo REGACK quando receber algum tópico via Wildcad
  *
+ *  @param [in] client Instância do cliente MQTT-SN (mqtt_sn_init)
  *  @param [in] msg_id Message id correspondente do envio
  *  @param [in] topic_id Topic ID enviado pelo broker para registrar no vetor de tópicos o tópico novo
  *
@@ -884,6 +2018,6 @@ resp_con_t mqtt_sn_sub_wildcard(char *topic, uint8_t qos);
  *  @retval SUCCESS_CON   Sucesso ao enviar a regack
  *
  **/
-resp_con_t mqtt_sn_regack_send(uint16_t msg_id, uint16_t topic_id);
+resp_con_t mqtt_sn_regack_send(mqtt_sn_client_t *client, uint16_t msg_id, uint16_t topic_id);
 
 #endif
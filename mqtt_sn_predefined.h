@@ -0,0 +1,10 @@
+/* Gerado por tools/gen_predefined_topics.sh a partir de tools/predefined_topics.conf - nao editar */
+#ifndef MQTT_SN_PREDEFINED_H
+#define MQTT_SN_PREDEFINED_H
+
+#define MQTT_SN_PREDEFINED_TOPICS \
+  {"/6lowpan_node/alarm", 0x0001}, \
+  {"/6lowpan_node/battery", 0x0002}, \
+  {NULL, 0x0000}
+
+#endif
@@ -0,0 +1,185 @@
+/**
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing,
+  software distributed under the License is distributed on an
+  "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+  KIND, either express or implied.  See the License for the
+  specific language governing permissions and limitations
+  under the License.
+
+ *******************************************************************************
+ * @license Este projeto está sendo liberado pela licença APACHE 2.0.
+ * @file main_posix.c
+ * @brief Demo/carga do MQTT-SN em Linux, equivalente ao main_core.c
+ * @brief Abre N instâncias (mqtt_sn_client_t), cada uma registra e assina o
+ *        próprio tópico e publica nele a cada intervalo. Ao final (SIGINT ou
+ *        -c publicações por cliente) imprime os totais enviados e recebidos.
+ *
+ *  Ex.: ./broker_mqtts broker.cfg (tools/mosquitto.rsmb, listener 1884 mqtts)
+ *       ./mqtt_sn_linux -h 127.0.0.1 -n 50 -m 100 -q 1 -c 1000
+ */
+
+#include "mqtt_sn.h"
+#include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define MAX_CLIENTS 64 // MQTT_SN_POSIX_MAX_CONN
+
+typedef struct {
+  mqtt_sn_client_t mqtt;
+  struct ctimer time_pub;
+  char device_id[24];
+  char topic[32];
+  uint32_t sent;
+  uint32_t failed;
+} demo_client_t;
+
+static demo_client_t          clients[MAX_CLIENTS];
+static uint16_t               broker_address[8];
+static volatile sig_atomic_t  running = 1;
+static uint32_t               received;
+static clock_time_t           pub_interval = CLOCK_SECOND;
+static uint32_t               pub_count;
+static int8_t                 pub_qos;
+
+static void demo_stop(int sig){
+  (void)sig;
+  running = 0;
+}
+
+void mqtt_sn_callback(char *topic, char *message){
+  received++;
+  debug_os("Topic:%s Message:%s",topic,message);
+}
+
+static void demo_pub(void *ptr){
+  demo_client_t *c = (demo_client_t *)ptr;
+  char message[32];
+
+  if (pub_count == 0 || c->sent + c->failed < pub_count) {
+    sprintf(message,"%s #%u",c->device_id,(unsigned)(c->sent + c->failed));
+    // Desconectado, a publicação vai para o buffer offline (QoS >= 0)
+    if (mqtt_sn_pub(&c->mqtt,c->topic,message,false,pub_qos,MQTT_SN_PRIO_NORMAL))
+      c->sent++;
+    else
+      c->failed++;
+    ctimer_reset(&c->time_pub);
+  }
+}
+
+static bool demo_done(int n){
+  int i;
+
+  if (pub_count == 0)
+    return false;
+  for (i = 0; i < n; i++)
+    if (clients[i].sent + clients[i].failed < pub_count ||
+        mqtt_sn_pub_inflight(&clients[i].mqtt) ||
+        mqtt_sn_offline_pending(&clients[i].mqtt))
+      return false;
+  return true;
+}
+
+static void usage(const char *prog){
+  printf("Uso: %s [-h broker] [-p porta] [-i prefixo id] [-k keep alive]\n"
+         "          [-n clientes] [-l porta local] [-m intervalo ms]\n"
+         "          [-c publicações por cliente] [-q qos 0..2]\n", prog);
+}
+
+int main(int argc, char *argv[]){
+  mqtt_sn_con_t mqtt_sn_connection;
+  const char *host = "127.0.0.1", *prefix = "linux";
+  uint16_t udp_port = 1884, local_port = 41884, keep_alive = 30;
+  uint32_t total_sent = 0, total_failed = 0;
+  clock_time_t start, end = 0;
+  int n = 1, i, opt;
+
+  while ((opt = getopt(argc, argv, "h:p:i:k:n:l:m:c:q:")) != -1) {
+    switch (opt) {
+      case 'h': host = optarg; break;
+      case 'p': udp_port = atoi(optarg); break;
+      case 'i': prefix = optarg; break;
+      case 'k': keep_alive = atoi(optarg); break;
+      case 'n': n = atoi(optarg); break;
+      case 'l': local_port = atoi(optarg); break;
+      case 'm': pub_interval = (clock_time_t)atoi(optarg)*CLOCK_SECOND/1000; break;
+      case 'c': pub_count = atoi(optarg); break;
+      case 'q': pub_qos = atoi(optarg); break;
+      default: usage(argv[0]); return 1;
+    }
+  }
+  if (n < 1 || n > MAX_CLIENTS || pub_qos < 0 || pub_qos > 2 ||
+      !mqtt_sn_posix_addr(host, broker_address)) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  signal(SIGINT, demo_stop);
+  signal(SIGTERM, demo_stop);
+  random_init(getpid());
+
+  memset(&mqtt_sn_connection, 0, sizeof(mqtt_sn_connection));
+  mqtt_sn_connection.udp_port      = udp_port;
+  mqtt_sn_connection.ipv6_broker   = broker_address;
+  mqtt_sn_connection.keep_alive    = keep_alive;
+  mqtt_sn_connection.will_topic    = 0x00;
+  mqtt_sn_connection.will_message  = 0x00;
+
+  for (i = 0; i < n; i++) {
+    demo_client_t *c = &clients[i];
+    char *topics[1];
+
+    sprintf(c->device_id,"%s-%d",prefix,i);
+    sprintf(c->topic,"/%s/%d",prefix,i);
+    topics[0] = c->topic;
+
+    // Cada instância no mesmo host precisa de uma porta local própria
+    mqtt_sn_connection.client_id  = c->device_id;
+    mqtt_sn_connection.local_port = local_port + i;
+
+    mqtt_sn_init(&c->mqtt);
+    if (!mqtt_sn_create_sck(&c->mqtt, mqtt_sn_connection, topics, 1, mqtt_sn_callback)) {
+      debug_os("Falha ao abrir a conexao UDP de %s",c->device_id);
+      return 1;
+    }
+    mqtt_sn_sub(&c->mqtt, c->topic, pub_qos);
+    ctimer_set(&c->time_pub, pub_interval, demo_pub, c);
+  }
+
+  start = clock_time();
+  while (running) {
+    mqtt_sn_posix_poll(CLOCK_SECOND);
+    // Aguarda um intervalo extra pelas publicações de retorno da assinatura
+    if (!end && demo_done(n))
+      end = clock_time();
+    if (end && (clock_time_t)(clock_time() - end) >= pub_interval + CLOCK_SECOND)
+      break;
+  }
+
+  // DISCONNECT encerra a sessão no broker, que não precisa tratar a mesma
+  // identificação como conexão duplicada na próxima execução
+  for (i = 0; i < n; i++)
+    mqtt_sn_disconnect_send(&clients[i].mqtt, 0);
+
+  for (i = 0; i < n; i++) {
+    debug_os("%s %s enviadas:%u falhas:%u",clients[i].device_id,
+             mqtt_sn_check_status_string(&clients[i].mqtt),
+             (unsigned)clients[i].sent,(unsigned)clients[i].failed);
+    total_sent += clients[i].sent;
+    total_failed += clients[i].failed;
+  }
+  debug_os("Total enviadas:%u falhas:%u recebidas:%u em %lu ms\n",
+           (unsigned)total_sent,(unsigned)total_failed,(unsigned)received,
+           (unsigned long)((clock_time() - start)*1000/CLOCK_SECOND));
+  return 0;
+}
@@ -0,0 +1,413 @@
+/**
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing,
+  software distributed under the License is distributed on an
+  "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+  KIND, either express or implied.  See the License for the
+  specific language governing permissions and limitations
+  under the License.
+
+ *******************************************************************************
+ * @license Este projeto está sendo liberado pela licença APACHE 2.0.
+ * @file mqtt_sn_posix.c
+ * @brief Camada de transporte e temporização POSIX do MQTT-SN
+ * @see mqtt_sn_posix.h
+
+ [Apontamento POSIX-1]:
+ O laço (mqtt_sn_posix_poll) reproduz a ordem do escalonador do Contiki em
+ uma única thread: eventos postados, ctimers expirados e só então recepção
+ UDP. Nenhum callback é chamado de dentro de process_post/ctimer_set, como
+ no Contiki, logo o mqtt_sn.c não precisa de travas.
+
+ [Apontamento POSIX-2]:
+ O datagrama recebido é copiado para a área de dados UDP do uip_buf, a mesma
+ usada pelo mqtt_sn_tx_buf, preservando o aliasing entre recepção e envio
+ descrito no [Apontamento n-3] do mqtt_sn.c.
+*/
+
+#define _GNU_SOURCE
+#include "mqtt_sn_posix.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+uint8_t uip_buf[UIP_BUFSIZE + 2];
+
+static struct {
+  struct process *p;
+  process_event_t ev;
+  process_data_t data;
+} g_events[MQTT_SN_POSIX_NUMEVENTS];                  // Fila circular de eventos pendentes
+static uint16_t                   g_event_head;
+static uint16_t                   g_event_len;
+static process_event_t            g_last_event = PROCESS_EVENT_MAX;
+static struct ctimer              *g_ctimers;         // Lista de ctimers ativos
+static struct simple_udp_connection *g_conns[MQTT_SN_POSIX_MAX_CONN];
+static uint8_t                    g_conns_len;
+
+/******************************* Relógio **************************************/
+clock_time_t clock_time(void){
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (clock_time_t)ts.tv_sec*CLOCK_SECOND + ts.tv_nsec/(1000000000L/CLOCK_SECOND);
+}
+
+/****************************** Processos *************************************/
+static void process_deliver(struct process *p, process_event_t ev, process_data_t data){
+  if (!p->running)
+    return;
+  if (p->thread(&p->pt, ev, data) >= PT_EXITED)
+    p->running = false;
+}
+
+process_event_t process_alloc_event(void){
+  return g_last_event++;
+}
+
+void process_start(struct process *p, process_data_t data){
+  if (p->running)
+    return;
+  p->pt.lc = 0;
+  p->running = true;
+  // Como no Contiki, o evento de INIT é entregue de forma síncrona
+  process_deliver(p, PROCESS_EVENT_INIT, data);
+}
+
+int process_post(struct process *p, process_event_t ev, process_data_t data){
+  uint16_t slot;
+
+  if (g_event_len == MQTT_SN_POSIX_NUMEVENTS)
+    return PROCESS_ERR_FULL;
+
+  slot = (g_event_head + g_event_len) % MQTT_SN_POSIX_NUMEVENTS;
+  g_events[slot].p = p;
+  g_events[slot].ev = ev;
+  g_events[slot].data = data;
+  g_event_len++;
+  return PROCESS_ERR_OK;
+}
+
+static bool process_run_events(void){
+  uint16_t n = g_event_len;
+
+  // Somente os eventos presentes na entrada, os postados durante a entrega
+  // ficam para a próxima iteração (ctimers e UDP não sofrem inanição)
+  while (n--) {
+    struct process *p = g_events[g_event_head].p;
+    process_event_t ev = g_events[g_event_head].ev;
+    process_data_t data = g_events[g_event_head].data;
+
+    g_event_head = (g_event_head + 1) % MQTT_SN_POSIX_NUMEVENTS;
+    g_event_len--;
+    process_deliver(p, ev, data);
+  }
+  return g_event_len > 0;
+}
+
+/******************************* ctimer ***************************************/
+static void ctimer_unlink(struct ctimer *c){
+  struct ctimer **it;
+
+  for (it = &g_ctimers; *it != NULL; it = &(*it)->next)
+    if (*it == c) {
+      *it = c->next;
+      return;
+    }
+}
+
+static void ctimer_link(struct ctimer *c){
+  ctimer_unlink(c);
+  c->next = g_ctimers;
+  g_ctimers = c;
+}
+
+void ctimer_set(struct ctimer *c, clock_time_t t, void (*f)(void *), void *ptr){
+  c->f = f;
+  c->ptr = ptr;
+  c->start = clock_time();
+  c->interval = t;
+  ctimer_link(c);
+}
+
+void ctimer_reset(struct ctimer *c){
+  // Mantém o período sem acumular o atraso do disparo
+  c->start += c->interval;
+  ctimer_link(c);
+}
+
+void ctimer_restart(struct ctimer *c){
+  c->start = clock_time();
+  ctimer_link(c);
+}
+
+void ctimer_stop(struct ctimer *c){
+  ctimer_unlink(c);
+}
+
+int ctimer_expired(struct ctimer *c){
+  struct ctimer *t;
+
+  for (t = g_ctimers; t != NULL; t = t->next)
+    if (t == c)
+      return 0;
+  return 1;
+}
+
+static void ctimer_run(void){
+  struct ctimer *c;
+  clock_time_t now = clock_time();
+
+  // A lista é percorrida desde o início a cada disparo, pois o callback pode
+  // armar ou parar qualquer outro ctimer. Os armados pelo callback (start
+  // posterior a now) ficam para a próxima iteração
+  do {
+    for (c = g_ctimers; c != NULL; c = c->next)
+      if ((long)(now - c->start) >= (long)c->interval)
+        break;
+    if (c != NULL) {
+      ctimer_unlink(c);
+      if (c->f != NULL)
+        c->f(c->ptr);
+    }
+  } while (c != NULL);
+}
+
+static clock_time_t ctimer_next(clock_time_t max_wait){
+  struct ctimer *c;
+  clock_time_t now = clock_time(), wait = max_wait;
+  long left;
+
+  for (c = g_ctimers; c != NULL; c = c->next) {
+    left = (long)c->interval - (long)(now - c->start);
+    if (left <= 0)
+      return 0;
+    if ((clock_time_t)left < wait)
+      wait = left;
+  }
+  return wait;
+}
+
+/********************************* uIP ****************************************/
+static void posix_sockaddr(struct sockaddr_in6 *sa, const uip_ipaddr_t *addr, uint16_t port){
+  memset(sa, 0, sizeof(*sa));
+  sa->sin6_family = AF_INET6;
+  sa->sin6_port = htons(port);
+  memcpy(&sa->sin6_addr, addr->u8, sizeof(addr->u8));
+}
+
+void uip_debug_ipaddr_print(const uip_ipaddr_t *addr){
+  char str[INET6_ADDRSTRLEN];
+
+  if (inet_ntop(AF_INET6, addr->u8, str, sizeof(str)) != NULL)
+    printf("%s", str);
+}
+
+bool mqtt_sn_posix_addr(const char *str, uint16_t ipv6[8]){
+  uip_ipaddr_t addr;
+  struct in_addr v4;
+  uint8_t i;
+
+  if (inet_pton(AF_INET6, str, addr.u8) != 1) {
+    if (inet_pton(AF_INET, str, &v4) != 1)
+      return false;
+    memset(addr.u8, 0, 10);
+    addr.u8[10] = addr.u8[11] = 0xff;
+    memcpy(&addr.u8[12], &v4, 4);
+  }
+  for (i = 0; i < 8; i++)
+    ipv6[i] = ntohs(addr.u16[i]);
+  return true;
+}
+
+/****************************** simple_udp ************************************/
+int simple_udp_register(struct simple_udp_connection *c,
+                        uint16_t local_port,
+                        uip_ipaddr_t *remote_addr,
+                        uint16_t remote_port,
+                        simple_udp_callback receive_callback){
+  struct sockaddr_in6 sa;
+  uip_ipaddr_t any;
+  int off = 0, on = 1;
+
+  if (g_conns_len == MQTT_SN_POSIX_MAX_CONN)
+    return 0;
+
+  c->fd = socket(AF_INET6, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (c->fd < 0) {
+    perror("[POSIX] socket");
+    return 0;
+  }
+  // Dual-stack: brokers IPv4 são endereçados como ::ffff:a.b.c.d
+  setsockopt(c->fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+  // Hop limit recebido alimenta UIP_IP_BUF->ttl (0: desconhecido)
+  setsockopt(c->fd, IPPROTO_IPV6, IPV6_RECVHOPLIMIT, &on, sizeof(on));
+
+  memset(&any, 0, sizeof(any));
+  posix_sockaddr(&sa, &any, local_port);
+  if (bind(c->fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+    perror("[POSIX] bind");
+    close(c->fd);
+    c->fd = -1;
+    return 0;
+  }
+
+  if (remote_addr != NULL)
+    uip_ipaddr_copy(&c->remote_addr, remote_addr);
+  else
+    memset(&c->remote_addr, 0, sizeof(c->remote_addr));
+  c->remote_port = remote_port;
+  c->local_port = local_port;
+  c->receive_callback = receive_callback;
+  g_conns[g_conns_len++] = c;
+  return 1;
+}
+
+int simple_udp_sendto(struct simple_udp_connection *c,
+                      const void *data, uint16_t datalen,
+                      const uip_ipaddr_t *to){
+  struct sockaddr_in6 sa;
+
+  posix_sockaddr(&sa, to, c->remote_port);
+  if (sendto(c->fd, data, datalen, 0, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+    // Como no uIP, o datagrama é descartado e a retransmissão fica a cargo do MQTT-SN
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+      perror("[POSIX] sendto");
+    return 0;
+  }
+  return 1;
+}
+
+int simple_udp_send(struct simple_udp_connection *c,
+                    const void *data, uint16_t datalen){
+  return simple_udp_sendto(c, data, datalen, &c->remote_addr);
+}
+
+static void simple_udp_input(struct simple_udp_connection *c){
+  struct sockaddr_in6 sa;
+  struct iovec iov;
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  char control[CMSG_SPACE(sizeof(int))];
+  uip_ipaddr_t src, dst;
+  uint8_t *data = &uip_buf[UIP_LLH_LEN + UIP_IPUDPH_LEN];
+  ssize_t len;
+
+  // Esvazia o socket, um datagrama por vez no uip_buf
+  while (1) {
+    iov.iov_base = data;
+    iov.iov_len = UIP_BUFSIZE - (UIP_LLH_LEN + UIP_IPUDPH_LEN);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &sa;
+    msg.msg_namelen = sizeof(sa);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    len = recvmsg(c->fd, &msg, 0);
+    if (len < 0)
+      return;
+
+    UIP_IP_BUF->ttl = 0;
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+      if (cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_HOPLIMIT) {
+        int hop_limit;
+        memcpy(&hop_limit, CMSG_DATA(cmsg), sizeof(hop_limit));
+        UIP_IP_BUF->ttl = (uint8_t)hop_limit;
+      }
+
+    memcpy(src.u8, &sa.sin6_addr, sizeof(src.u8));
+    memset(&dst, 0, sizeof(dst));
+    uip_ipaddr_copy(&UIP_IP_BUF->srcipaddr, &src);
+    if (c->receive_callback != NULL)
+      c->receive_callback(c, &src, ntohs(sa.sin6_port), &dst, c->local_port,
+                          data, (uint16_t)len);
+  }
+}
+
+/***************************** random e CFS ***********************************/
+void random_init(unsigned short seed){
+  srand(seed);
+}
+
+unsigned short random_rand(void){
+  return (unsigned short)rand();
+}
+
+int cfs_open(const char *name, int flags){
+  int s = 0;
+
+  if ((flags & (CFS_READ | CFS_WRITE)) == (CFS_READ | CFS_WRITE))
+    s = O_RDWR | O_CREAT;
+  else if (flags & CFS_WRITE)
+    s = O_WRONLY | O_CREAT | O_TRUNC;
+  else
+    s = O_RDONLY;
+  if (flags & CFS_APPEND)
+    s = (s & ~O_TRUNC) | O_APPEND;
+  return open(name, s | O_CLOEXEC, 0600);
+}
+
+void cfs_close(int fd){
+  close(fd);
+}
+
+int cfs_read(int fd, void *buf, unsigned int len){
+  return read(fd, buf, len);
+}
+
+int cfs_write(int fd, const void *buf, unsigned int len){
+  return write(fd, buf, len);
+}
+
+cfs_offset_t cfs_seek(int fd, cfs_offset_t offset, int whence){
+  int w = whence == CFS_SEEK_SET ? SEEK_SET : whence == CFS_SEEK_CUR ? SEEK_CUR : SEEK_END;
+
+  return lseek(fd, offset, w);
+}
+
+int cfs_remove(const char *name){
+  return unlink(name);
+}
+
+/******************************* Laço *****************************************/
+void mqtt_sn_posix_poll(clock_time_t max_wait){
+  struct pollfd fds[MQTT_SN_POSIX_MAX_CONN];
+  clock_time_t wait;
+  uint8_t i;
+
+  ctimer_run();
+  // Eventos postados pelos ctimers (ex.: ping timeout) não aguardam o poll
+  if (process_run_events())
+    max_wait = 0;
+
+  wait = ctimer_next(max_wait);
+  for (i = 0; i < g_conns_len; i++) {
+    fds[i].fd = g_conns[i]->fd;
+    fds[i].events = POLLIN;
+    fds[i].revents = 0;
+  }
+  if (poll(fds, g_conns_len, (int)(wait*1000/CLOCK_SECOND)) <= 0)
+    return;
+
+  for (i = 0; i < g_conns_len; i++)
+    if (fds[i].revents & POLLIN) {
+      simple_udp_input(g_conns[i]);
+      process_run_events();
+    }
+}
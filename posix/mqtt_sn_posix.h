@@ -0,0 +1,265 @@
+/**
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing,
+  software distributed under the License is distributed on an
+  "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+  KIND, either express or implied.  See the License for the
+  specific language governing permissions and limitations
+  under the License.
+
+ *******************************************************************************
+ * @license Este projeto está sendo liberado pela licença APACHE 2.0.
+ * @file mqtt_sn_posix.h
+ * @brief Camada de transporte e temporização POSIX do MQTT-SN
+ * @brief Implementa, sobre sockets UDP não bloqueantes e CLOCK_MONOTONIC, o
+ *        subconjunto da API do Contiki utilizado por mqtt_sn.c (processo,
+ *        eventos, ctimer, clock, simple_udp, uip_buf, CFS e random), de forma
+ *        que a mesma máquina de estados rode em Linux (make linux)
+ */
+
+#ifndef MQTT_SN_POSIX_H
+#define MQTT_SN_POSIX_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+/*! \addtogroup MQTT_SN_POSIX
+*  Macros de configuração da camada POSIX
+*  @{
+*/
+/*!
+  @brief Capacidade da fila de eventos pendentes (PROCESS_CONF_NUMEVENTS do Contiki),
+         compartilhada por todas as instâncias, logo maior que os 32 do Contiki
+         para os testes de carga com dezenas de clientes
+*/
+#ifndef MQTT_SN_POSIX_NUMEVENTS
+#define MQTT_SN_POSIX_NUMEVENTS 256
+#endif
+/*!
+  @brief Tamanho do uip_buf emulado (MTU mínimo IPv6)
+*/
+#ifndef MQTT_SN_POSIX_BUFSIZE
+#define MQTT_SN_POSIX_BUFSIZE   1280
+#endif
+/*!
+  @brief Quantidade máxima de conexões simple_udp abertas
+*/
+#ifndef MQTT_SN_POSIX_MAX_CONN
+#define MQTT_SN_POSIX_MAX_CONN  64
+#endif
+/** @}*/
+
+/***************************** Relógio *****************************************/
+typedef unsigned long clock_time_t;
+
+#define CLOCK_SECOND 1000 // Ticks em milissegundos (CLOCK_MONOTONIC)
+
+/****************************** Processos *************************************/
+// Protothread local-continuation por switch, como o lc-switch.h do Contiki,
+// com as mesmas restrições (sem switch ou variável local viva entre esperas)
+typedef unsigned char process_event_t;
+typedef void *        process_data_t;
+
+struct pt {
+  unsigned short lc;
+};
+
+struct process {
+  const char *name;
+  char (*thread)(struct pt *, process_event_t, process_data_t);
+  struct pt pt;
+  bool running;
+};
+
+#define PT_WAITING 0
+#define PT_YIELDED 1
+#define PT_EXITED  2
+#define PT_ENDED   3
+
+#define PROCESS_EVENT_INIT 0x81
+#define PROCESS_EVENT_MAX  0x8a
+
+#define PROCESS_ERR_OK     0
+#define PROCESS_ERR_FULL   1
+
+#define PROCESS_THREAD(name, ev, data) \
+  static char process_thread_##name(struct pt *process_pt, process_event_t ev, process_data_t data)
+
+#define PROCESS(name, strname) \
+  PROCESS_THREAD(name, ev, data); \
+  struct process name = { strname, process_thread_##name, { 0 }, false }
+
+#define PROCESS_BEGIN() { char PT_YIELD_FLAG = 1; (void)PT_YIELD_FLAG; \
+                          switch (process_pt->lc) { case 0:
+
+#define PROCESS_WAIT_EVENT() \
+  do { \
+    PT_YIELD_FLAG = 0; \
+    process_pt->lc = __LINE__; __attribute__((fallthrough)); case __LINE__: \
+    if (PT_YIELD_FLAG == 0) \
+      return PT_YIELDED; \
+  } while (0)
+
+#define PROCESS_END() } PT_YIELD_FLAG = 0; process_pt->lc = 0; \
+                        return PT_ENDED; }
+
+/******************************* ctimer ***************************************/
+struct ctimer {
+  struct ctimer *next;
+  clock_time_t start;
+  clock_time_t interval;
+  void (*f)(void *);
+  void *ptr;
+};
+
+/********************************* uIP ****************************************/
+typedef union {
+  uint8_t  u8[16];
+  uint16_t u16[8];
+} uip_ip6addr_t;
+
+typedef uip_ip6addr_t uip_ipaddr_t;
+
+// Somente os campos lidos pelo MQTT-SN são preenchidos na recepção (ttl)
+struct uip_ip_hdr {
+  uint8_t vtc;
+  uint8_t tcflow;
+  uint16_t flow;
+  uint8_t len[2];
+  uint8_t proto;
+  uint8_t ttl;
+  uip_ip6addr_t srcipaddr;
+  uip_ip6addr_t destipaddr;
+};
+
+#define UIP_BUFSIZE    MQTT_SN_POSIX_BUFSIZE
+#define UIP_LLH_LEN    0
+#define UIP_IPH_LEN    40
+#define UIP_UDPH_LEN   8
+#define UIP_IPUDPH_LEN (UIP_IPH_LEN + UIP_UDPH_LEN)
+
+extern uint8_t uip_buf[UIP_BUFSIZE + 2];
+
+#define UIP_IP_BUF ((struct uip_ip_hdr *)&uip_buf[UIP_LLH_LEN])
+
+#define uip_htons(n) htons(n)
+#define uip_ntohs(n) ntohs(n)
+
+#define uip_ip6addr(addr, addr0, addr1, addr2, addr3, addr4, addr5, addr6, addr7) do { \
+    (addr)->u16[0] = uip_htons(addr0); \
+    (addr)->u16[1] = uip_htons(addr1); \
+    (addr)->u16[2] = uip_htons(addr2); \
+    (addr)->u16[3] = uip_htons(addr3); \
+    (addr)->u16[4] = uip_htons(addr4); \
+    (addr)->u16[5] = uip_htons(addr5); \
+    (addr)->u16[6] = uip_htons(addr6); \
+    (addr)->u16[7] = uip_htons(addr7); \
+  } while (0)
+
+#define uip_ipaddr_copy(dest, src) (*(dest) = *(src))
+#define uip_ipaddr_cmp(addr1, addr2) (memcmp(addr1, addr2, sizeof(uip_ip6addr_t)) == 0)
+
+/****************************** simple_udp ************************************/
+struct simple_udp_connection;
+
+typedef void (* simple_udp_callback)(struct simple_udp_connection *c,
+                                     const uip_ipaddr_t *source_addr,
+                                     uint16_t source_port,
+                                     const uip_ipaddr_t *dest_addr,
+                                     uint16_t dest_port,
+                                     const uint8_t *data, uint16_t datalen);
+
+struct simple_udp_connection {
+  uip_ipaddr_t remote_addr;
+  uint16_t remote_port, local_port;
+  simple_udp_callback receive_callback;
+  int fd;                                  /**< Socket UDP dual-stack (IPv4 mapeado em ::ffff:0:0/96) */
+};
+
+/********************************* CFS ****************************************/
+// Arquivos no diretório corrente, com a semântica do cfs-posix.c do Contiki
+typedef long cfs_offset_t;
+
+#define CFS_READ     1
+#define CFS_WRITE    2
+#define CFS_APPEND   4
+#define CFS_SEEK_SET 0
+#define CFS_SEEK_CUR 1
+#define CFS_SEEK_END 2
+
+/*************************** API emulada do Contiki ***************************/
+clock_time_t clock_time(void);
+
+process_event_t process_alloc_event(void);
+void process_start(struct process *p, process_data_t data);
+int process_post(struct process *p, process_event_t ev, process_data_t data);
+
+void ctimer_set(struct ctimer *c, clock_time_t t, void (*f)(void *), void *ptr);
+void ctimer_reset(struct ctimer *c);
+void ctimer_restart(struct ctimer *c);
+void ctimer_stop(struct ctimer *c);
+int ctimer_expired(struct ctimer *c);
+
+void uip_debug_ipaddr_print(const uip_ipaddr_t *addr);
+
+int simple_udp_register(struct simple_udp_connection *c,
+                        uint16_t local_port,
+                        uip_ipaddr_t *remote_addr,
+                        uint16_t remote_port,
+                        simple_udp_callback receive_callback);
+int simple_udp_send(struct simple_udp_connection *c,
+                    const void *data, uint16_t datalen);
+int simple_udp_sendto(struct simple_udp_connection *c,
+                      const void *data, uint16_t datalen,
+                      const uip_ipaddr_t *to);
+
+void random_init(unsigned short seed);
+unsigned short random_rand(void);
+
+int cfs_open(const char *name, int flags);
+void cfs_close(int fd);
+int cfs_read(int fd, void *buf, unsigned int len);
+int cfs_write(int fd, const void *buf, unsigned int len);
+cfs_offset_t cfs_seek(int fd, cfs_offset_t offset, int whence);
+int cfs_remove(const char *name);
+
+/** @brief Executa uma iteração do laço de eventos POSIX
+ *
+ * 		Entrega os eventos pendentes à PROCESS_THREAD, dispara os ctimers
+ *    expirados e aguarda datagramas UDP até o próximo ctimer ou max_wait,
+ *    o que ocorrer primeiro, repassando-os aos callbacks do simple_udp.
+ *
+ *  @param [in] max_wait Tempo máximo de espera em ticks (CLOCK_SECOND)
+ *
+ *  @retval 0 Não retorna nada
+ *
+ **/
+void mqtt_sn_posix_poll(clock_time_t max_wait);
+
+/** @brief Converte endereço textual em vetor IPv6 do MQTT-SN
+ *
+ * 		Aceita endereços IPv6 ou IPv4, estes últimos mapeados em ::ffff:0:0/96
+ *    para o socket dual-stack, no formato de mqtt_sn_con_t::ipv6_broker.
+ *
+ *  @param [in] str Endereço textual (ex.: "::1" ou "127.0.0.1")
+ *  @param [out] ipv6 Vetor de 8 palavras em ordem do host
+ *
+ *  @retval true  Endereço convertido
+ *  @retval false Endereço inválido
+ *
+ **/
+bool mqtt_sn_posix_addr(const char *str, uint16_t ipv6[8]);
+
+#endif
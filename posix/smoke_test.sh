@@ -0,0 +1,102 @@
+#!/bin/sh
+# Teste de fumaça do MQTT-SN em Linux contra um gateway local (RSMB)
+#
+# Conecta, registra, assina e publica com o mqtt_sn_linux. Na segunda etapa
+# o gateway é derrubado e reiniciado no meio das publicações: o cliente deve
+# reconectar, refazer REGISTER/SUBSCRIBE e receber a última publicação.
+#
+#   RSMB=/caminho/broker_mqtts sh posix/smoke_test.sh
+#
+# Variáveis: RSMB (binário do gateway, obrigatório), PORT (1884), QOS (1),
+#            CLIENTS (2), COUNT (20)
+
+RSMB=${RSMB:-}
+PORT=${PORT:-1884}
+QOS=${QOS:-1}
+CLIENTS=${CLIENTS:-2}
+COUNT=${COUNT:-20}
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+BIN=$ROOT/mqtt_sn_linux
+WORK=$(mktemp -d)
+BROKER_PID=
+
+if [ -z "$RSMB" ] || [ ! -x "$RSMB" ]; then
+  echo "Defina RSMB com o caminho do broker_mqtts (tools/mosquitto.rsmb)"
+  exit 2
+fi
+
+cleanup() {
+  [ -n "$BROKER_PID" ] && kill "$BROKER_PID" 2>/dev/null
+  rm -rf "$WORK"
+}
+trap cleanup EXIT INT TERM
+
+broker_start() {
+  (cd "$WORK" && exec "$RSMB" "$WORK/broker.cfg" >> "$WORK/broker.log" 2>&1) &
+  BROKER_PID=$!
+  sleep 1
+}
+
+broker_stop() {
+  kill "$BROKER_PID" 2>/dev/null
+  wait "$BROKER_PID" 2>/dev/null
+  BROKER_PID=
+}
+
+# Confere os totais e a entrega da última publicação de cada cliente
+check() {
+  name=$1
+  log=$2
+  total=$(grep "Total enviadas" "$log")
+  expected=$((CLIENTS * COUNT))
+  i=0
+
+  echo "$name: $total"
+  case "$total" in
+    *"enviadas:$expected falhas:0 "*) ;;
+    *) echo "FALHA $name: esperadas $expected publicações sem falhas"; return 1 ;;
+  esac
+  while [ $i -lt "$CLIENTS" ]; do
+    if ! grep -q "Message:smoke-$i #$((COUNT - 1))" "$log"; then
+      echo "FALHA $name: última publicação de smoke-$i não recebida"
+      return 1
+    fi
+    i=$((i + 1))
+  done
+  return 0
+}
+
+printf 'listener %s INADDR_ANY mqtts\n' "$PORT" > "$WORK/broker.cfg"
+
+make -s -C "$ROOT" linux-clean && make -s -C "$ROOT" linux || exit 1
+
+status=0
+
+# 1) CONNECT, REGISTER, SUBSCRIBE e PUBLISH
+broker_start
+timeout 60 "$BIN" -h 127.0.0.1 -p "$PORT" -i smoke -n "$CLIENTS" -k 5 \
+  -m 100 -c "$COUNT" -q "$QOS" > "$WORK/basic.log" 2>&1
+check basico "$WORK/basic.log" || status=1
+broker_stop
+
+# 2) Reconexão: o gateway reinicia sem as sessões no meio das publicações
+broker_start
+timeout 90 "$BIN" -h 127.0.0.1 -p "$PORT" -i smoke -n "$CLIENTS" -k 3 \
+  -m 500 -c "$COUNT" -q "$QOS" > "$WORK/recon.log" 2>&1 &
+CLIENT_PID=$!
+sleep 4
+broker_stop
+sleep 8
+broker_start
+wait "$CLIENT_PID"
+check reconexao "$WORK/recon.log" || status=1
+broker_stop
+
+if [ $status -ne 0 ]; then
+  echo "Log do gateway:"
+  tail -20 "$WORK/broker.log"
+else
+  echo "SMOKE-OK"
+fi
+exit $status
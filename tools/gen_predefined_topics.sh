@@ -0,0 +1,51 @@
+#!/bin/sh
+#
+# Gera o cabeçalho mqtt_sn_predefined.h a partir da tabela de tópicos
+# pré-definidos do gateway (formato ClientId,TopicName,TopicId).
+#
+# Uso: sh tools/gen_predefined_topics.sh tools/predefined_topics.conf > mqtt_sn_predefined.h
+#
+# Somente entradas com ClientId "*" são aceitas: o client id dos nós só é
+# conhecido em tempo de execução. Qualquer outra entrada, assim como um
+# TopicId inválido, encerra o gerador com erro e sem gerar o cabeçalho.
+#
+CONF=${1:-tools/predefined_topics.conf}
+
+if [ ! -f "$CONF" ]; then
+  echo "Arquivo de configuracao nao encontrado: $CONF" >&2
+  exit 1
+fi
+
+awk -F',' -v conf="$CONF" '
+/^[ \t]*#/ || NF < 3 { next }
+{
+  gsub(/^[ \t]+|[ \t\r]+$/, "", $1)
+  gsub(/^[ \t]+|[ \t\r]+$/, "", $2)
+  gsub(/^[ \t]+|[ \t\r]+$/, "", $3)
+  if ($1 != "*") {
+    printf("%s:%d: ClientId \"%s\" nao suportado, somente \"*\" (o client id dos nos e gerado em tempo de execucao): %s\n", conf, NR, $1, $0) > "/dev/stderr"
+    err = 1
+    exit 1
+  }
+  id = $3 + 0
+  if (id <= 0 || id >= 65535) {
+    printf("%s:%d: TopicId invalido: %s\n", conf, NR, $0) > "/dev/stderr"
+    err = 1
+    exit 1
+  }
+  topics = topics sprintf("  {\"%s\", 0x%04X}, \\\n", $2, id)
+}
+END {
+  if (err)
+    exit 1
+  print "/* Gerado por tools/gen_predefined_topics.sh a partir de " conf " - nao editar */"
+  print "#ifndef MQTT_SN_PREDEFINED_H"
+  print "#define MQTT_SN_PREDEFINED_H"
+  print ""
+  print "#define MQTT_SN_PREDEFINED_TOPICS \\"
+  printf("%s", topics)
+  print "  {NULL, 0x0000}"
+  print ""
+  print "#endif"
+}
+' "$CONF"